@@ -0,0 +1,109 @@
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "Denoiser.h"
+#include "parallel.h"
+
+// the 1D B3-spline taps; the 2D kernel is their outer product
+static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+static inline float distance2(const float *a, const float *b)
+{
+	float d0 = a[0] - b[0], d1 = a[1] - b[1], d2 = a[2] - b[2];
+	return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+Denoiser::Denoiser()
+{
+	passes = 5;
+	colorSigma = 0.15;
+	normalSigma = 0.7;
+	albedoSigma = 0.7;
+	depthSigma = 0.2;
+}
+
+void Denoiser::filter(int width, int height, const float *color, const float *normal,
+					  const float *albedo, const float *depth, float *out) const
+{
+	int n = width * height * 3;
+	std::vector<float> ping(color, color + n);
+	std::vector<float> pong(n);
+
+	float invNormal = (float)(1.0 / (normalSigma * normalSigma));
+	float invAlbedo = (float)(1.0 / (albedoSigma * albedoSigma));
+
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		// later passes see colours that are already smoothed, so their
+		// colour weight is made stricter to hold on to what is left
+		int step = 1 << pass;
+		double sc = colorSigma / step;
+		float invColor = (float)(1.0 / (sc * sc));
+		float invDepth = (float)(1.0 / (depthSigma * step));
+
+		const float *src = &ping[0];
+		float *dst = &pong[0];
+
+		parallelFor(0, height, [&](int y) {
+			for (int x = 0; x < width; ++x)
+			{
+				int p = x + y * width;
+				const float *cp = src + p * 3;
+				const float *np = normal + p * 3;
+				const float *ap = albedo + p * 3;
+				float zp = depth[p];
+
+				float sum[3] = {0, 0, 0};
+				float total = 0;
+
+				for (int dy = -2; dy <= 2; ++dy)
+				{
+					int qy = y + dy * step;
+					if (qy < 0 || qy >= height)
+						continue;
+
+					for (int dx = -2; dx <= 2; ++dx)
+					{
+						int qx = x + dx * step;
+						if (qx < 0 || qx >= width)
+							continue;
+
+						int q = qx + qy * width;
+						float zq = depth[q];
+
+						// a surface and the background never mix
+						if ((zp == FLT_MAX) != (zq == FLT_MAX))
+							continue;
+
+						const float *cq = src + q * 3;
+						float e = distance2(cp, cq) * invColor;
+						if (zp != FLT_MAX)
+						{
+							float dz = fabsf(zp - zq) / zp;
+							e += distance2(np, normal + q * 3) * invNormal +
+								 distance2(ap, albedo + q * 3) * invAlbedo +
+								 dz * invDepth;
+						}
+
+						float w = kernel[dx + 2] * kernel[dy + 2] * expf(-e);
+						sum[0] += w * cq[0];
+						sum[1] += w * cq[1];
+						sum[2] += w * cq[2];
+						total += w;
+					}
+				}
+
+				// the centre tap always has weight kernel[2]^2, so total > 0
+				dst[p * 3] = sum[0] / total;
+				dst[p * 3 + 1] = sum[1] / total;
+				dst[p * 3 + 2] = sum[2] / total;
+			}
+		});
+
+		ping.swap(pong);
+	}
+
+	memcpy(out, &ping[0], n * sizeof(float));
+}
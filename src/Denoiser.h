@@ -0,0 +1,35 @@
+#ifndef __DENOISER_H__
+#define __DENOISER_H__
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) for images
+// rendered with few samples per pixel.  Each pass blurs with a 5x5 B-spline
+// kernel whose taps are spread twice as far apart as the pass before, and
+// every tap is weighted down by how much its colour, normal, albedo and
+// depth differ from the centre pixel's, so that the noise inside a surface
+// is smoothed while the edges between surfaces survive.
+
+class Denoiser
+{
+public:
+	Denoiser();
+
+	// How strongly colour differences stop the blur; larger values give a
+	// smoother but blurrier result.
+	void setColorSigma(double s) { colorSigma = s; }
+	void setPasses(int n) { passes = n; }
+
+	// All buffers are width * height pixels in scanline order; color,
+	// normal, albedo and out have 3 floats per pixel and depth has one,
+	// FLT_MAX where the pixel's ray hit nothing.  out may not be color.
+	void filter(int width, int height, const float *color, const float *normal,
+				const float *albedo, const float *depth, float *out) const;
+
+private:
+	int passes;
+	double colorSigma;
+	double normalSigma;
+	double albedoSigma;
+	double depthSigma;
+};
+
+#endif // __DENOISER_H__
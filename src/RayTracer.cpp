@@ -1,19 +1,27 @@
 // The main ray tracer.
 
+#include <float.h>
+#include <cstring>
+#include <math.h>
+#include <algorithm>
+
 #include <Fl/fl_ask.h>
 
 #include "RayTracer.h"
+#include "Denoiser.h"
+#include "parallel.h"
 #include "scene/light.h"
 #include "scene/material.h"
+#include "scene/photonmap.h"
+#include "scene/animation.h"
 #include "scene/ray.h"
+#include "scene/shadebatch.h"
+#include "scene/raystats.h"
 #include "fileio/read.h"
 #include "fileio/parse.h"
-#include "ui/TraceUI.h"
-
-extern TraceUI *traceUI;
 
 // add reflect
-vec3f RayTracer::reflect(ray r, isect i, bool flipNormal)
+vec3f RayTracer::reflect(const ray &r, const isect &i, bool flipNormal)
 {
 	vec3f D = r.getDirection().normalize();
 
@@ -29,7 +37,7 @@ vec3f RayTracer::reflect(ray r, isect i, bool flipNormal)
 }
 
 // judge is total internal reflection
-bool RayTracer::isTIR(ray r, isect i, double n_i, double n_t)
+bool RayTracer::isTIR(const ray &r, const isect &i, double n_i, double n_t)
 {
 	return (
 		pow(i.N.normalize().dot(r.getDirection().normalize()), 2) <=
@@ -37,7 +45,7 @@ bool RayTracer::isTIR(ray r, isect i, double n_i, double n_t)
 }
 
 // refract
-vec3f RayTracer::refract_dir(ray r, isect i, double n_i, double n_t, bool flipNormal)
+vec3f RayTracer::refract_dir(const ray &r, const isect &i, double n_i, double n_t, bool flipNormal)
 {
 	vec3f ret(0, 0, 0);
 	vec3f n = i.N;
@@ -59,26 +67,53 @@ vec3f RayTracer::refract_dir(ray r, isect i, double n_i, double n_t, bool flipNo
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
 vec3f RayTracer::trace(Scene *scene, double x, double y)
+{
+	isect i;
+	return trace(scene, x, y, i);
+}
+
+// As above, and also hand back the intersection the top-level ray found
+// (i.obj is left NULL if it found none).
+vec3f RayTracer::trace(Scene *scene, double x, double y, isect &i)
 {
 	ray r(vec3f(0, 0, 0), vec3f(0, 0, 0));
 	scene->getCamera()->rayThrough(x, y, r);
+	return trace(scene, r, i);
+}
+
+// Trace a ray that leaves the camera.
+vec3f RayTracer::trace(Scene *scene, const ray &r, isect &i)
+{
 	// return traceRay(scene, r, vec3f(1.0, 1.0, 1.0), traceUI->getDepth());
 	// add threshold
-	return traceRay(scene, r, vec3f(traceUI->getThresh(), traceUI->getThresh(), traceUI->getThresh()), traceUI->getDepth()).clamp();
+	RAY_STAT(rays[RayStats::PRIMARY]);
+	return traceRay(scene, r, vec3f(m_dThresh, m_dThresh, m_dThresh), m_nDepth, i).clamp();
+}
+
+vec3f RayTracer::traceRay(Scene *scene, const ray &r,
+						  const vec3f &thresh, int depth)
+{
+	isect i;
+	return traceRay(scene, r, thresh, depth, i);
 }
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
 vec3f RayTracer::traceRay(Scene *scene, const ray &r,
-						  const vec3f &thresh, int depth)
+						  const vec3f &thresh, int depth, isect &i)
 {
 
-	if (depth < 0 || thresh[0] > 1 || thresh[1] > 1 || thresh[2] > 1)
+	if (depth < 0)
 	{
+		RAY_STAT(depthStops);
 		return {0, 0, 0};
 	}
-	isect i;
-	vec3f intensity;
+	if (thresh[0] > 1 || thresh[1] > 1 || thresh[2] > 1)
+	{
+		RAY_STAT(thresholdStops);
+		return {0, 0, 0};
+	}
+	RAY_STAT(depth[min(m_nDepth - depth, RayStats::DEPTHS - 1)]);
 
 	if (scene->intersect(r, i))
 	{
@@ -95,52 +130,177 @@ vec3f RayTracer::traceRay(Scene *scene, const ray &r,
 
 		const Material &m = i.getMaterial();
 
-		intensity = m.shade(scene, r, i);
+		return addBounces(scene, r, i, thresh, depth, m.shade(scene, r, i));
+	}
+	else
+	{
+		// No intersection.  This ray travels to infinity, so we color
+		// it according to the background color, which in this (simple) case
+		// is just black.
+
+		return vec3f(0.0, 0.0, 0.0);
+	}
+}
 
-		// Refractive indices for incident and transmitted rays
-		double n_i, n_t;
-		bool flipNormal;
-		if (r.getDirection().dot(i.N) < 0)
+// The rest of traceRay once the hit i has been shaded: add the light that
+// arrives there by reflection and refraction.
+vec3f RayTracer::addBounces(Scene *scene, const ray &r, const isect &i,
+							const vec3f &thresh, int depth, vec3f intensity)
+{
+	// Refractive indices for incident and transmitted rays
+	double n_i, n_t;
+	bool flipNormal;
+	if (r.getDirection().dot(i.N) < 0)
+	{
+		// ray is entering the object
+		n_i = 1.0;					 // refractive index of air
+		n_t = i.getMaterial().index; // refractive index of the object
+		flipNormal = true;			 // flip the normal
+	}
+	else
+	{
+		// ray is exiting the object
+		n_i = i.getMaterial().index;
+		n_t = 1.0;
+		flipNormal = false;
+	}
+
+	// Both rays leave from the hit, each on its own side of the surface.
+	// A ray that the material would not pass on is not traced at all: a
+	// refraction ray into an opaque object finds the far side of it, and
+	// would be shaded there for nothing.
+	RayOrigin from(r.at(i.t), i.N, i.obj);
+
+	vec3f kr = i.getMaterial().kr;
+	if (!kr.iszero())
+	{
+		vec3f reflection_dir = reflect(r, i, flipNormal);
+		ray reflection_ray = spawnRay(from, reflection_dir.normalize(), r.getTime());
+		RAY_STAT(rays[RayStats::REFLECTION]);
+		intensity += kr.elementwiseMultiply(traceRay(scene, reflection_ray, thresh, depth - 1));
+	}
+
+	// if not total internal reflection
+	vec3f kt = i.getMaterial().kt;
+	if (!kt.iszero() && !isTIR(r, i, n_i, n_t))
+	{
+		vec3f refraction_dir = refract_dir(r, i, n_i, n_t, flipNormal);
+		ray refraction_ray = spawnRay(from, refraction_dir.normalize(), r.getTime());
+		RAY_STAT(rays[RayStats::REFRACTION]);
+		intensity += kt.elementwiseMultiply(traceRay(scene, refraction_ray, thresh, depth - 1));
+	}
+
+	intensity = intensity.clamp();
+
+	return intensity;
+}
+
+// Paths give up after this many bounces even if roulette keeps them alive.
+static const int MAX_PATH_LENGTH = 64;
+
+// Roulette starts after this many bounces, so that the first few indirect
+// bounces are never cut short.
+static const int ROULETTE_START = 2;
+
+// A direction from the cosine-weighted hemisphere around the unit normal
+// N, for uniform u and v.  Lambertian reflection divided by this density is
+// just the albedo.
+static vec3f cosineDirection(const vec3f &N, double u, double v)
+{
+	vec3f a = fabs(N[0]) > 0.9 ? vec3f(0, 1, 0) : vec3f(1, 0, 0);
+	vec3f t = N.cross(a).normalize();
+	vec3f b = N.cross(t);
+
+	double r = sqrt(u);
+	double phi = 2 * 3.14159265358979323846 * v;
+	return (r * cos(phi)) * t + (r * sin(phi)) * b + sqrt(max(0.0, 1 - u)) * N;
+}
+
+vec3f RayTracer::tracePath(Scene *scene, const ray &start, int px, int py, int index, isect &first)
+{
+	vec3f radiance;
+	vec3f throughput(1.0, 1.0, 1.0);
+	ray r(start);
+	RAY_STAT(rays[RayStats::PRIMARY]);
+
+	for (int bounce = 0; bounce < MAX_PATH_LENGTH; ++bounce)
+	{
+		RAY_STAT(depth[min(bounce, RayStats::DEPTHS - 1)]);
+		isect i;
+		if (!scene->intersect(r, i))
+			break;
+		if (bounce == 0)
+			first = i;
+
+		// Emission, light from the scene's lights (next event estimation)
+		// and caustics from the photon map.  The lights are not geometry,
+		// so no bounce can hit one and count it twice; the ambient term is
+		// left out because the diffuse bounces below compute what it
+		// stands in for.
+		const Material &m = i.getMaterial();
+		radiance += throughput.elementwiseMultiply(m.ke + m.directLight(scene, r, i) + m.causticLight(scene, r, i));
+
+		double wd = (m.kd[0] + m.kd[1] + m.kd[2]) / 3;
+		double wr = (m.kr[0] + m.kr[1] + m.kr[2]) / 3;
+		double wt = (m.kt[0] + m.kt[1] + m.kt[2]) / 3;
+		double total = wd + wr + wt;
+		if (total <= 0.0)
+			break;
+
+		double u, v, lobe, survive;
+		sampler->sample2D(px, py, index, SAMPLE_BOUNCE + 2 * bounce, u, v);
+		sampler->sample2D(px, py, index, SAMPLE_BOUNCE + 2 * bounce + 1, lobe, survive);
+
+		// the normal on the side the ray came from
+		bool entering = r.getDirection().dot(i.N) < 0;
+		vec3f N = entering ? i.N : -i.N;
+		vec3f P = r.at(i.t);
+		vec3f dir;
+
+		// Continue along one of the three ways the material passes light
+		// on, picked in proportion to its weight.  Coefficients that add up
+		// to more than one (reflective defaults to specular, so glass is
+		// often kr + kt > 1) would make every bounce gain energy; such
+		// materials are scaled down to pass on all of the light.
+		lobe *= total;
+		total = min(total, 1.0);
+		if (lobe < wd)
+		{
+			dir = cosineDirection(N, u, v);
+			RAY_STAT(rays[RayStats::DIFFUSE]);
+			throughput = throughput.elementwiseMultiply(m.kd * (total / wd));
+		}
+		else if (lobe < wd + wr || (wt > 0.0 && isTIR(r, i, entering ? 1.0 : m.index, entering ? m.index : 1.0)))
 		{
-			// ray is entering the object
-			n_i = 1.0;					 // refractive index of air
-			n_t = i.getMaterial().index; // refractive index of the object
-			flipNormal = true;			 // flip the normal
+			dir = reflect(r, i, entering).normalize();
+			RAY_STAT(rays[RayStats::REFLECTION]);
+			throughput = throughput.elementwiseMultiply(lobe < wd + wr ? m.kr * (total / wr) : m.kt * (total / wt));
 		}
 		else
 		{
-			// ray is exiting the object
-			n_i = i.getMaterial().index;
-			n_t = 1.0;
-			flipNormal = false;
+			dir = refract_dir(r, i, entering ? 1.0 : m.index, entering ? m.index : 1.0, entering).normalize();
+			RAY_STAT(rays[RayStats::REFRACTION]);
+			throughput = throughput.elementwiseMultiply(m.kt * (total / wt));
 		}
 
-		vec3f reflection_dir = reflect(r, i, flipNormal);
-		vec3f kr = i.getMaterial().kr;
-		ray reflection_ray(r.at(i.t) + i.N.normalize() * NORMAL_EPSILON, reflection_dir.normalize());
-		intensity += kr.elementwiseMultiply(traceRay(scene, reflection_ray, thresh, depth - 1));
-
-		// if not total internal reflection
-		if (!isTIR(r, i, n_i, n_t))
+		// Russian roulette: a path that can only add a little more light
+		// is ended early, and the survivors are weighted up to make up for
+		// the ones that were ended
+		if (bounce >= ROULETTE_START)
 		{
-			vec3f refraction_dir = refract_dir(r, i, n_i, n_t, flipNormal);
-			vec3f kt = i.getMaterial().kt;
-			ray refraction_ray(r.at(i.t), refraction_dir.normalize());
-			intensity += kt.elementwiseMultiply(traceRay(scene, refraction_ray, thresh, depth - 1));
+			double q = min(0.95, max(throughput[0], max(throughput[1], throughput[2])));
+			if (survive >= q)
+			{
+				RAY_STAT(rouletteStops);
+				break;
+			}
+			throughput /= q;
 		}
 
-		intensity = intensity.clamp();
-
-		return intensity;
+		r = spawnRay(RayOrigin(P, i.N, i.obj), dir, r.getTime());
 	}
-	else
-	{
-		// No intersection.  This ray travels to infinity, so we color
-		// it according to the background color, which in this (simple) case
-		// is just black.
 
-		return vec3f(0.0, 0.0, 0.0);
-	}
+	return radiance;
 }
 
 RayTracer::RayTracer()
@@ -148,6 +308,15 @@ RayTracer::RayTracer()
 	buffer = NULL;
 	buffer_width = buffer_height = 256;
 	scene = NULL;
+	tiles_x = tiles_y = 0;
+
+	m_nDepth = 0;
+	m_dThresh = 0.0;
+	sampler = new SobolSampler(1);
+	m_bPathTrace = false;
+	m_nPhotons = 0;
+	animation = NULL;
+	costMetric = COST_NONE;
 
 	m_bSceneLoaded = false;
 }
@@ -156,6 +325,75 @@ RayTracer::~RayTracer()
 {
 	delete[] buffer;
 	delete scene;
+	delete sampler;
+	delete animation;
+}
+
+bool RayTracer::setSampler(const string &name, int spp)
+{
+	Sampler *s = Sampler::create(name, spp);
+	if (!s)
+		return false;
+
+	delete sampler;
+	sampler = s;
+	return true;
+}
+
+bool RayTracer::setCostMetric(const string &name)
+{
+	CostMetric m;
+	if (name == "none")
+		m = COST_NONE;
+	else if (name == "time")
+		m = COST_TIME;
+	else if (name == "rays" && RayStats::enabled())
+		m = COST_RAYS;
+	else if (name == "tests" && RayStats::enabled())
+		m = COST_TESTS;
+	else
+		return false;
+
+	costMetric = m;
+	return true;
+}
+
+double RayTracer::countedCost() const
+{
+	const RayStats &stats = RayStats::local();
+	if (costMetric == COST_RAYS)
+		return (double)stats.traced();
+
+	long long tests = stats.boxTests;
+	for (int k = 0; k < RayStats::PRIMITIVE_KINDS; ++k)
+		tests += stats.primitiveTests[k];
+	return (double)tests;
+}
+
+void RayTracer::getCostImage(std::vector<unsigned char> &rgb)
+{
+	int n = buffer_width * buffer_height;
+	rgb.assign(n * 3, 0);
+	if (costBuffer.empty())
+		return;
+
+	// one pixel that took a page fault or a context switch should not
+	// leave the rest of the map black
+	std::vector<float> sorted(costBuffer);
+	std::vector<float>::iterator top = sorted.begin() + (n - 1) * 99 / 100;
+	std::nth_element(sorted.begin(), top, sorted.end());
+	float scale = *top > 0.0f ? 1.0f / *top : 0.0f;
+
+	static const float ramp[5][3] = {
+		{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+	for (int p = 0; p < n; ++p)
+	{
+		float t = min(costBuffer[p] * scale, 1.0f) * 4;
+		int k = min((int)t, 3);
+		float f = t - k;
+		for (int c = 0; c < 3; ++c)
+			rgb[p * 3 + c] = (int)(255.0f * (ramp[k][c] + f * (ramp[k + 1][c] - ramp[k][c])));
+	}
 }
 
 void RayTracer::getBuffer(unsigned char *&buf, int &w, int &h)
@@ -170,6 +408,16 @@ double RayTracer::aspectRatio()
 	return scene ? scene->getCamera()->getAspectRatio() : 1;
 }
 
+Camera *RayTracer::getCamera()
+{
+	return scene ? scene->getCamera() : NULL;
+}
+
+float RayTracer::pixelDepth(int i, int j)
+{
+	return depthBuffer[i + j * buffer_width];
+}
+
 bool RayTracer::sceneLoaded()
 {
 	return m_bSceneLoaded;
@@ -177,16 +425,62 @@ bool RayTracer::sceneLoaded()
 
 bool RayTracer::loadScene(char *fn)
 {
+	unloadScene();
+
 	try
 	{
+		Stopwatch watch;
 		scene = readScene(fn);
+		times.add(PhaseTimes::PARSE, watch);
 	}
 	catch (ParseError pe)
 	{
-		fl_alert("ParseError: %s\n", pe);
+		fl_alert("ParseError: %s\n", pe.getMsg().c_str());
 		return false;
 	}
 
+	return setupScene();
+}
+
+bool RayTracer::loadScene(istream &is)
+{
+	unloadScene();
+
+	try
+	{
+		Stopwatch watch;
+		scene = readScene(is);
+		times.add(PhaseTimes::PARSE, watch);
+	}
+	catch (ParseError pe)
+	{
+		fl_alert("ParseError: %s\n", pe.getMsg().c_str());
+		return false;
+	}
+
+	return setupScene();
+}
+
+void RayTracer::unloadScene()
+{
+	delete animation;
+	animation = NULL;
+	delete scene;
+	scene = NULL;
+	delete[] buffer;
+	buffer = NULL;
+	m_bSceneLoaded = false;
+	m_nPhotons = 0;
+	times.clear();
+
+	// the tile records point at the objects just deleted
+	tiles_x = tiles_y = 0;
+	tileHits.clear();
+	tileDirty.clear();
+}
+
+bool RayTracer::setupScene()
+{
 	if (!scene)
 		return false;
 
@@ -197,7 +491,9 @@ bool RayTracer::loadScene(char *fn)
 	buffer = new unsigned char[bufferSize];
 
 	// separate objects into bounded and unbounded
+	Stopwatch watch;
 	scene->initScene();
+	times.add(PhaseTimes::BUILD, watch);
 
 	// Add any specialized scene loading code here
 
@@ -218,6 +514,19 @@ void RayTracer::traceSetup(int w, int h)
 		buffer = new unsigned char[bufferSize];
 	}
 	memset(buffer, 0, w * h * 3);
+	pixelLevel.assign(w * h, 0xff);
+	depthBuffer.assign(w * h, FLT_MAX);
+	colorBuffer.assign(w * h * 3, 0.0f);
+	normalBuffer.assign(w * h * 3, 0.0f);
+	albedoBuffer.assign(w * h * 3, 0.0f);
+	accumBuffer.assign(w * h * 3, 0.0f);
+	sampleCount.assign(w * h, 0);
+	costBuffer.assign(w * h, 0.0f);
+
+	tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+	tileHits.assign(tiles_x * tiles_y, HitRecord());
+	tileDirty.assign(tiles_x * tiles_y, false);
 }
 
 void RayTracer::traceLines(int start, int stop)
@@ -229,26 +538,541 @@ void RayTracer::traceLines(int start, int stop)
 	if (stop > buffer_height)
 		stop = buffer_height;
 
+	Stopwatch watch;
 	for (int j = start; j < stop; ++j)
 		for (int i = 0; i < buffer_width; ++i)
 			tracePixel(i, j);
+	times.add(PhaseTimes::RENDER, watch);
 }
 
 void RayTracer::tracePixel(int i, int j)
 {
-	vec3f col;
+	samplePixel(i, j, false);
+}
 
+// Take getSamples() more samples in pixel (i,j), adding them to the ones it
+// already has if accumulate is set, or replacing them if not.
+void RayTracer::samplePixel(int i, int j, bool accumulate)
+{
 	if (!scene)
 		return;
 
-	double x = double(i) / double(buffer_width);
-	double y = double(j) / double(buffer_height);
+	int p = i + j * buffer_width;
+	int first = beginPixel(p, accumulate);
+	int spp = sampler->getSampleCount();
+
+	Stopwatch watch;
+	double counted = costMetric == COST_RAYS || costMetric == COST_TESTS ? countedCost() : 0.0;
+
+	PixelSum sum;
+	Scene::setHitRecord(&tileHits[(i / TILE_SIZE) + (j / TILE_SIZE) * tiles_x]);
+	for (int s = first; s < first + spp; ++s)
+	{
+		ray r = cameraRay(i, j, s);
+
+		isect hit;
+		vec3f col;
+		if (m_bPathTrace)
+			col = tracePath(scene, r, i, j, s, hit);
+		else
+			col = trace(scene, r, hit);
+		addSample(sum, p, s, col, hit);
+	}
+	Scene::setHitRecord(NULL);
+
+	storePixel(p, accumulate, sum);
+
+	if (costMetric != COST_NONE)
+	{
+		double cost = costMetric == COST_TIME ? watch.seconds() * 1e9 : countedCost() - counted;
+		costBuffer[p] = (accumulate ? costBuffer[p] : 0.0f) + (float)cost;
+	}
+}
+
+// Samples the tile's pixels as samplePixel does, but in two passes: every
+// camera ray of the tile is traced first, then the direct light at all of
+// their hits is worked out together in a ShadeBatch, and then each sample
+// is finished off with its reflections and refractions.  Path tracing
+// takes its own way through the lights and goes a pixel at a time, as does
+// measuring the cost of each pixel.
+void RayTracer::sampleTile(int tile, bool refine)
+{
+	int x0 = (tile % tiles_x) * TILE_SIZE;
+	int y0 = (tile / tiles_x) * TILE_SIZE;
+	int x1 = min(x0 + TILE_SIZE, buffer_width);
+	int y1 = min(y0 + TILE_SIZE, buffer_height);
+
+	if (m_bPathTrace || costMetric != COST_NONE)
+	{
+		for (int j = y0; j < y1; ++j)
+			for (int i = x0; i < x1; ++i)
+				samplePixel(i, j, refine && pixelLevel[i + j * buffer_width] == 1);
+		return;
+	}
+
+	int spp = sampler->getSampleCount();
+	int count = (x1 - x0) * (y1 - y0) * spp;
+	vec3f thresh(m_dThresh, m_dThresh, m_dThresh);
+
+	// traceRay's cut-off, which stops the camera rays before they start
+	bool live = m_nDepth >= 0 && m_dThresh <= 1;
+
+	std::vector<ray> rays;
+	std::vector<isect> hits(count);
+	std::vector<int> slot(count, -1);
+	ShadeBatch batch;
+	rays.reserve(count);
+
+	Scene::setHitRecord(&tileHits[tile]);
+
+	int n = 0;
+	for (int j = y0; j < y1; ++j)
+	{
+		for (int i = x0; i < x1; ++i)
+		{
+			int p = i + j * buffer_width;
+			int first = beginPixel(p, refine && pixelLevel[p] == 1);
+			for (int s = first; s < first + spp; ++s, ++n)
+			{
+				rays.push_back(cameraRay(i, j, s));
+				RAY_STAT(rays[RayStats::PRIMARY]);
+				if (m_nDepth < 0)
+					RAY_STAT(depthStops);
+				else if (!live)
+					RAY_STAT(thresholdStops);
+				else
+				{
+					RAY_STAT(depth[0]);
+					if (scene->intersect(rays[n], hits[n]))
+						slot[n] = batch.add(rays[n], hits[n]);
+				}
+			}
+		}
+	}
+
+	batch.light(scene);
+
+	n = 0;
+	for (int j = y0; j < y1; ++j)
+	{
+		for (int i = x0; i < x1; ++i)
+		{
+			int p = i + j * buffer_width;
+			int first = sampleCount[p];
+
+			PixelSum sum;
+			for (int s = first; s < first + spp; ++s, ++n)
+			{
+				vec3f col;
+				if (slot[n] >= 0)
+				{
+					const Material &m = hits[n].getMaterial();
+					vec3f local = m.shade(scene, rays[n], hits[n], batch.direct(slot[n]));
+					col = addBounces(scene, rays[n], hits[n], thresh, m_nDepth, local).clamp();
+				}
+				addSample(sum, p, s, col, hits[n]);
+			}
+			storePixel(p, refine && pixelLevel[p] == 1, sum);
+		}
+	}
+
+	Scene::setHitRecord(NULL);
+}
+
+// Get pixel p ready for more samples, forgetting the ones it has unless
+// accumulate is set; returns the index of the first new sample.
+int RayTracer::beginPixel(int p, bool accumulate)
+{
+	if (!accumulate)
+	{
+		sampleCount[p] = 0;
+		accumBuffer[p * 3] = accumBuffer[p * 3 + 1] = accumBuffer[p * 3 + 2] = 0.0f;
+	}
+	return sampleCount[p];
+}
+
+// With one sample the ray goes through the corner of the pixel, as it
+// always has; with more, each sample takes its own point in the pixel,
+// on the lens and in the shutter interval from the sampler.  Further
+// passes carry on with the sampler's later points.
+ray RayTracer::cameraRay(int i, int j, int s)
+{
+	Camera *camera = scene->getCamera();
+	int spp = sampler->getSampleCount();
+
+	double dx = 0.0, dy = 0.0;
+	if (spp > 1 || s > 0)
+		sampler->sample2D(i, j, s, SAMPLE_PIXEL, dx, dy);
+
+	double lensU = 0.5, lensV = 0.5;
+	if (camera->hasAperture())
+		sampler->sample2D(i, j, s, SAMPLE_LENS, lensU, lensV);
+
+	double time, unused;
+	sampler->sample2D(i, j, s, SAMPLE_TIME, time, unused);
+
+	ray r(vec3f(0, 0, 0), vec3f(0, 0, 0));
+	camera->rayThrough((i + dx) / double(buffer_width), (j + dy) / double(buffer_height), lensU, lensV, r);
+	return ray(r.getPosition(), r.getDirection(), time);
+}
+
+void RayTracer::addSample(PixelSum &sum, int p, int s, const vec3f &col, const isect &hit)
+{
+	sum.col += col;
+	if (hit.obj)
+	{
+		sum.normal += hit.N;
+		sum.albedo += hit.getMaterial().kd;
+	}
 
-	col = trace(scene, x, y);
+	// the first sample stands for the pixel in the depth buffer
+	if (s == 0)
+		depthBuffer[p] = hit.obj ? (float)hit.t : FLT_MAX;
+}
 
-	unsigned char *pixel = buffer + (i + j * buffer_width) * 3;
+void RayTracer::storePixel(int p, bool accumulate, const PixelSum &samples)
+{
+	int spp = sampler->getSampleCount();
+	vec3f col = samples.col;
+
+	float *sum = &accumBuffer[p * 3];
+	float *c = &colorBuffer[p * 3];
+	sampleCount[p] += spp;
+	for (int k = 0; k < 3; ++k)
+	{
+		sum[k] += (float)col[k];
+		c[k] = sum[k] / sampleCount[p];
+	}
+
+	// the features come from the pixel's first samples
+	if (!accumulate)
+	{
+		vec3f normal = samples.normal / double(spp);
+		vec3f albedo = samples.albedo / double(spp);
+
+		float *n = &normalBuffer[p * 3];
+		float *a = &albedoBuffer[p * 3];
+		for (int k = 0; k < 3; ++k)
+		{
+			n[k] = (float)normal[k];
+			a[k] = (float)albedo[k];
+		}
+	}
+
+	// a fresh pixel is rounded from the exact average, as it always was
+	if (!accumulate)
+		col /= double(spp);
+	else
+		col = vec3f(c[0], c[1], c[2]);
+	col = col.clamp();
+
+	unsigned char *pixel = buffer + p * 3;
 
 	pixel[0] = (int)(255.0 * col[0]);
 	pixel[1] = (int)(255.0 * col[1]);
 	pixel[2] = (int)(255.0 * col[2]);
-}
\ No newline at end of file
+
+	pixelLevel[p] = 1;
+}
+
+void RayTracer::traceTiles()
+{
+	if (!scene)
+		return;
+
+	Stopwatch watch;
+	parallelFor(0, tileCount(), [this](int t) { traceTile(t); });
+	times.add(PhaseTimes::RENDER, watch);
+}
+
+void RayTracer::tracePass()
+{
+	if (!scene)
+		return;
+
+	Stopwatch watch;
+	parallelFor(0, tileCount(), [this](int t) {
+		Stopwatch tileWatch;
+		sampleTile(t, true);
+		Timeline::record("tile", tileWatch, t);
+	});
+	times.add(PhaseTimes::RENDER, watch);
+}
+
+void RayTracer::traceBlock(int i, int j, int size)
+{
+	if (pixelLevel[i + j * buffer_width] != 1)
+		tracePixel(i, j);
+
+	if (size <= 1)
+		return;
+
+	unsigned char *src = buffer + (i + j * buffer_width) * 3;
+	float depth = depthBuffer[i + j * buffer_width];
+	int x1 = min(i + size, buffer_width);
+	int y1 = min(j + size, buffer_height);
+
+	for (int y = j; y < y1; ++y)
+	{
+		for (int x = i; x < x1; ++x)
+		{
+			int p = x + y * buffer_width;
+			if (pixelLevel[p] < size)
+				continue;
+
+			unsigned char *dst = buffer + p * 3;
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			depthBuffer[p] = depth;
+			pixelLevel[p] = size;
+		}
+	}
+}
+
+void RayTracer::denoise()
+{
+	if (!scene || !buffer)
+		return;
+
+	Stopwatch watch;
+	int n = buffer_width * buffer_height * 3;
+	std::vector<float> filtered(n);
+
+	Denoiser denoiser;
+	denoiser.filter(buffer_width, buffer_height, &colorBuffer[0], &normalBuffer[0],
+					&albedoBuffer[0], &depthBuffer[0], &filtered[0]);
+
+	for (int k = 0; k < n; ++k)
+		buffer[k] = (int)(255.0 * min(max(filtered[k], 0.0f), 1.0f));
+	times.add(PhaseTimes::DENOISE, watch);
+}
+
+void RayTracer::buildCaustics(int photons)
+{
+	if (!scene)
+		return;
+
+	// whatever gathered from the old map has to be traced again
+	m_nPhotons = photons;
+	for (int t = 0; t < tileCount(); ++t)
+	{
+		if (tileHits[t].usedCaustics())
+			tileDirty[t] = true;
+	}
+	if (photons <= 0)
+	{
+		scene->setCaustics(NULL);
+		return;
+	}
+
+	// gather radius: a small fraction of the scene's size
+	const BoundingBox &b = scene->getBounds();
+	double radius = CAUSTIC_RADIUS * (b.max - b.min).length();
+
+	Stopwatch watch;
+	PhotonMap *map = new PhotonMap(CAUSTIC_GATHER, radius);
+	map->build(scene, photons);
+	scene->setCaustics(map);
+	times.add(PhaseTimes::PHOTONS, watch);
+}
+
+bool RayTracer::loadAnimation(char *fn)
+{
+	if (!scene)
+		return false;
+
+	Animation *anim = readAnimation(fn);
+	if (!anim)
+		return false;
+
+	vector<string> names = anim->getNodeNames();
+	for (size_t n = 0; n < names.size(); ++n)
+	{
+		if (!scene->findNodes(names[n]))
+		{
+			fl_alert("The scene has no node named %s\n", names[n].c_str());
+			delete anim;
+			return false;
+		}
+	}
+
+	delete animation;
+	animation = anim;
+	return true;
+}
+
+int RayTracer::getFrameCount() const
+{
+	return animation ? animation->getFrameCount() : 1;
+}
+
+void RayTracer::setFrame(int frame)
+{
+	if (!animation || !scene)
+		return;
+
+	// Only transforms change from frame to frame, so the objects stay
+	// where they are in the BVH and just have their bounds refitted.
+	// Photons are shot again since the objects they bounced off may have
+	// moved.  The tiles of the last frame that the new pose can change are
+	// marked for traceDirtyTiles; all of them if the camera moves.
+	vector<TransformNode *> changed;
+	bool moved = animation->apply(scene, frame, &changed);
+	if (animation->movesCamera())
+		tileDirty.assign(tileDirty.size(), true);
+	if (!moved)
+		return;
+
+	Stopwatch watch;
+	for (Scene::cgiter g = scene->beginObjects(); g != scene->endObjects(); ++g)
+	{
+		for (size_t n = 0; n < changed.size(); ++n)
+		{
+			if ((*g)->getTransform()->isUnder(changed[n]))
+			{
+				markChanged(*g, true);
+				break;
+			}
+		}
+	}
+	scene->refit();
+	times.add(PhaseTimes::BUILD, watch);
+	if (m_nPhotons > 0)
+		buildCaustics(m_nPhotons);
+}
+
+bool RayTracer::hasCaustics() const
+{
+	return scene && scene->getCaustics();
+}
+
+int RayTracer::tileCount()
+{
+	return tiles_x * tiles_y;
+}
+
+void RayTracer::traceTile(int tile)
+{
+	Stopwatch watch;
+	tileHits[tile].clear();
+	tileDirty[tile] = false;
+
+	sampleTile(tile, false);
+	Timeline::record("tile", watch, tile);
+}
+
+void RayTracer::objectChanged(Geometry *obj, bool moved)
+{
+	if (!scene)
+		return;
+
+	markChanged(obj, moved);
+	if (moved)
+		scene->refit();
+
+	// the photons bounced off obj, or would now
+	if (m_nPhotons > 0)
+		buildCaustics(m_nPhotons);
+}
+
+void RayTracer::markChanged(Geometry *obj, bool moved)
+{
+	// A material edit can only affect rays that hit the object.  A moved
+	// object can also block or be seen by rays that used to pass by it, so
+	// any tile whose rays swept through it where it is now must go too.  If
+	// it left the scene bounds, the swept boxes tell us nothing.
+	bool everywhere = false;
+	if (moved)
+	{
+		obj->ComputeBoundingBox();
+		const BoundingBox &b = obj->getBoundingBox();
+		everywhere = !obj->hasBoundingBoxCapability() ||
+					 !scene->getBounds().intersects(b.min) ||
+					 !scene->getBounds().intersects(b.max);
+	}
+
+	for (int t = 0; t < tileCount(); ++t)
+	{
+		if (everywhere || tileHits[t].touched(obj) ||
+			(moved && tileHits[t].sweeps(obj)))
+			tileDirty[t] = true;
+	}
+}
+
+int RayTracer::traceDirtyTiles()
+{
+	if (!scene)
+		return 0;
+
+	std::vector<int> dirty;
+	for (int t = 0; t < tileCount(); ++t)
+	{
+		if (tileDirty[t])
+			dirty.push_back(t);
+	}
+
+	Stopwatch watch;
+	parallelFor(0, (int)dirty.size(), [this, &dirty](int k) { traceTile(dirty[k]); });
+	times.add(PhaseTimes::RENDER, watch);
+	return (int)dirty.size();
+}
+
+void RayTracer::cameraMoved(const Camera &old)
+{
+	if (!scene || !buffer)
+		return;
+
+	Camera *cam = scene->getCamera();
+	int n = buffer_width * buffer_height;
+
+	std::vector<unsigned char> warped(bufferSize, 0);
+	std::vector<unsigned char> level(n, 0xff);
+	std::vector<float> depth(n, FLT_MAX);
+
+	for (int j = 0; j < buffer_height; ++j)
+	{
+		for (int i = 0; i < buffer_width; ++i)
+		{
+			int p = i + j * buffer_width;
+			if (depthBuffer[p] == FLT_MAX)
+				continue;
+
+			ray r(vec3f(0, 0, 0), vec3f(0, 0, 0));
+			old.rayThrough(double(i) / double(buffer_width), double(j) / double(buffer_height), r);
+			vec3f P = r.at(depthBuffer[p]);
+
+			double x, y;
+			if (!cam->project(P, x, y))
+				continue;
+
+			int ni = (int)floor(x * buffer_width + 0.5);
+			int nj = (int)floor(y * buffer_height + 0.5);
+			if (ni < 0 || ni >= buffer_width || nj < 0 || nj >= buffer_height)
+				continue;
+
+			// nearest surface wins where several pixels land on one spot
+			int q = ni + nj * buffer_width;
+			float d = (float)(P - cam->getEye()).length();
+			if (d >= depth[q])
+				continue;
+
+			depth[q] = d;
+			level[q] = 2;
+			warped[q * 3] = buffer[p * 3];
+			warped[q * 3 + 1] = buffer[p * 3 + 1];
+			warped[q * 3 + 2] = buffer[p * 3 + 2];
+		}
+	}
+
+	memcpy(buffer, &warped[0], bufferSize);
+	pixelLevel.swap(level);
+	depthBuffer.swap(depth);
+
+	// nothing traced from the old view says anything about the new one
+	for (int t = 0; t < tileCount(); ++t)
+	{
+		tileHits[t].clear();
+		tileDirty[t] = false;
+	}
+}
@@ -3,8 +3,38 @@
 
 // The main ray tracer.
 
+#include <vector>
+
 #include "scene/scene.h"
 #include "scene/ray.h"
+#include "scene/sampler.h"
+#include "timing.h"
+
+class Animation;
+
+// The image is split into square tiles of this many pixels on a side; each
+// tile remembers which objects its rays touched.
+const int TILE_SIZE = 32;
+
+// Caustic lookups gather this many photons, from no farther than this
+// fraction of the scene's diagonal.
+const int CAUSTIC_GATHER = 64;
+const double CAUSTIC_RADIUS = 0.02;
+
+// The progressive preview starts by tracing one pixel in every block of
+// this many pixels on a side.
+const int PREVIEW_BLOCK = 16;
+
+// What the cost map measures for each pixel: the nanoseconds spent
+// sampling it, or (only in builds with RAY_STATS) the rays it traced or the
+// BVH box and primitive tests they made.
+enum CostMetric
+{
+	COST_NONE,
+	COST_TIME,
+	COST_RAYS,
+	COST_TESTS
+};
 
 class RayTracer
 {
@@ -13,29 +43,188 @@ public:
 	~RayTracer();
 
 	// added
-	vec3f reflect(ray r, isect i, bool flipNormal = false);
-	bool isTIR(ray r, isect i, double n_i, double n_t);
-	vec3f refract_dir(ray r, isect i, double n_i, double n_t, bool flipNormal = false);
+	vec3f reflect(const ray &r, const isect &i, bool flipNormal = false);
+	bool isTIR(const ray &r, const isect &i, double n_i, double n_t);
+	vec3f refract_dir(const ray &r, const isect &i, double n_i, double n_t, bool flipNormal = false);
 
 	vec3f trace(Scene *scene, double x, double y);
+	vec3f trace(Scene *scene, double x, double y, isect &i);
+	vec3f trace(Scene *scene, const ray &r, isect &i);
 	vec3f traceRay(Scene *scene, const ray &r, const vec3f &thresh, int depth);
+	vec3f traceRay(Scene *scene, const ray &r, const vec3f &thresh, int depth, isect &i);
+	vec3f addBounces(Scene *scene, const ray &r, const isect &i, const vec3f &thresh, int depth, vec3f intensity);
+
+	// Global illumination: follow one path from r, choosing a diffuse,
+	// mirror or refracted bounce at every hit and adding the light that
+	// reaches each vertex directly from the scene's lights.  Paths end by
+	// Russian roulette on their throughput rather than at a fixed depth.
+	// The random numbers come from sample index of pixel (px,py); first
+	// gets the path's first hit.
+	vec3f tracePath(Scene *scene, const ray &r, int px, int py, int index, isect &first);
+
+	// Render settings.  Every pixel is the average of spp samples placed by
+	// the named sampler (see Sampler::create); returns false, keeping the
+	// current sampler, if there is no sampler by that name.
+	void setDepth(int depth) { m_nDepth = depth; }
+	void setThreshold(double thresh) { m_dThresh = thresh; }
+	void setPathTracing(bool on) { m_bPathTrace = on; }
+	bool setSampler(const string &name, int spp);
+	int getSamples() const { return sampler->getSampleCount(); }
+
+	// Measure what each pixel costs while it is traced.  The metric is
+	// named time, rays or tests (or none); returns false, keeping the
+	// current one, for an unknown name or one this build cannot count.
+	// The map adds up over tracePass calls as the samples do.  Tiles are
+	// traced a pixel at a time while it is on, so that every shadow ray
+	// is charged to the pixel that asked for it; the image is unchanged.
+	bool setCostMetric(const string &name);
+	CostMetric getCostMetric() const { return costMetric; }
+
+	// the cost of every pixel in scanline order, and the same as a false
+	// colour heatmap from black through blue, red and yellow to white,
+	// scaled so that only the costliest 1% of pixels come out white
+	const float *getCostBuffer() { return &costBuffer[0]; }
+	void getCostImage(std::vector<unsigned char> &rgb);
 
 	void getBuffer(unsigned char *&buf, int &w, int &h);
 	double aspectRatio();
+	Camera *getCamera();
+
+	// distance from the eye to what pixel (i,j) shows (FLT_MAX if nothing)
+	float pixelDepth(int i, int j);
 	void traceSetup(int w, int h);
 	void traceLines(int start = 0, int stop = 10000000);
 	void tracePixel(int i, int j);
 
+	// Parallel rendering over all hardware threads.  traceTiles traces the
+	// whole image from scratch.  tracePass adds another getSamples()
+	// samples to every pixel that has been traced (and traces the ones
+	// that have not), so calling it repeatedly refines the image.
+	void traceTiles();
+	void tracePass();
+
+	// Make sure pixel (i,j) has been traced, then paint its colour over the
+	// size x size block below and to the right of it, leaving alone pixels
+	// that already came from a finer block.  Tracing every 16th pixel with
+	// size 16, then every 8th with size 8 and so on down to 1 refines the
+	// image progressively without tracing any pixel twice.
+	void traceBlock(int i, int j, int size);
+
+	// Replace the image with an edge-aware smoothing of the last render,
+	// guided by the normal, albedo and depth that each pixel's samples
+	// found.  Use after every pixel has been traced; the unfiltered colours
+	// are kept, so denoising again starts from the same noisy image.
+	void denoise();
+
+	// Shoot photons from the lights at the scene's mirror and glass objects
+	// and keep a map of where they land on diffuse surfaces, which shading
+	// then gathers caustics from.  0 photons removes the map.  The tiles
+	// that gathered from the old map are marked for traceDirtyTiles.
+	void buildCaustics(int photons);
+	bool hasCaustics() const;
+
+	int tileCount();
+	void traceTile(int tile);
+
+	// Incremental re-rendering.  After the material (moved = false) or the
+	// transform (moved = true) of obj has been edited, objectChanged marks the
+	// tiles whose rays could have seen the change, and shoots the caustic
+	// photons again if they are on; traceDirtyTiles traces only those tiles
+	// again, keeping the rest of the image.  Returns the number of tiles
+	// that were traced.
+	void objectChanged(Geometry *obj, bool moved);
+	int traceDirtyTiles();
+
+	// Call after the camera has been moved away from old.  Every pixel of
+	// the current image that shows something is carried over to where it
+	// appears from the new view, using its depth, so that there is a
+	// plausible picture to look at while the new view is traced.  Moved
+	// pixels count as 2x2 blocks for traceBlock; the rest are empty.
+	void cameraMoved(const Camera &old);
+
+	// Read a scene from a file, or from .ray text in a stream, in place of
+	// the one loaded before.
 	bool loadScene(char *fn);
+	bool loadScene(istream &is);
+
+	// Animation.  loadAnimation reads a keyframe file for the loaded scene,
+	// and setFrame poses the scene as it is at a frame, without loading it
+	// again: moving nodes only refits the BVH, and caustics are rebuilt
+	// if they are on.  The objects that moved are passed on as in
+	// objectChanged, so traceDirtyTiles then brings the last frame's image
+	// up to date.  Without an animation there is a single frame.
+	bool loadAnimation(char *fn);
+	int getFrameCount() const;
+	void setFrame(int frame);
 
 	bool sceneLoaded();
 
+	// The time spent in each stage since the scene was loaded.  Parsing,
+	// building, photons, rendering and denoising are timed here; the caller
+	// adds the time it takes to write the image.
+	PhaseTimes &getTimes() { return times; }
+
 private:
 	unsigned char *buffer;
 	int buffer_width, buffer_height;
 	int bufferSize;
 	Scene *scene;
 
+	// the size of the block each pixel's colour came from; 1 means traced
+	std::vector<unsigned char> pixelLevel;
+	std::vector<float> depthBuffer;
+
+	// the colour of each pixel before it is rounded to bytes, and the average normal
+	// and diffuse albedo at the first hits of its samples (zero for misses)
+	std::vector<float> colorBuffer;
+	std::vector<float> normalBuffer;
+	std::vector<float> albedoBuffer;
+
+	// the sum of all the samples taken in each pixel, and their number
+	std::vector<float> accumBuffer;
+	std::vector<int> sampleCount;
+
+	CostMetric costMetric;
+	std::vector<float> costBuffer;
+
+	int tiles_x, tiles_y;
+	std::vector<HitRecord> tileHits;
+	std::vector<bool> tileDirty;
+
+	int m_nDepth;
+	double m_dThresh;
+	Sampler *sampler;
+	bool m_bPathTrace;
+	int m_nPhotons;
+	Animation *animation;
+	PhaseTimes times;
+
+	// objectChanged without the refit, for several objects at once
+	void markChanged(Geometry *obj, bool moved);
+
+	// the steps of loadScene before and after the scene is read
+	void unloadScene();
+	bool setupScene();
+
+	void samplePixel(int i, int j, bool accumulate);
+
+	// the calling thread's running count of what the cost metric counts
+	double countedCost() const;
+
+	// getSamples() more samples in every pixel of the tile, accumulated
+	// in the pixels that have been traced if refine is set
+	void sampleTile(int tile, bool refine);
+
+	// the steps of samplePixel, which sampleTile runs in its own order
+	struct PixelSum
+	{
+		vec3f col, normal, albedo;
+	};
+	int beginPixel(int p, bool accumulate);
+	ray cameraRay(int i, int j, int s);
+	void addSample(PixelSum &sum, int p, int s, const vec3f &col, const isect &hit);
+	void storePixel(int p, bool accumulate, const PixelSum &samples);
+
 	bool m_bSceneLoaded;
 };
 
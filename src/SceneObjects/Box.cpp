@@ -9,59 +9,76 @@ bool Box::intersectLocal(const ray &r, isect &i) const
 	// Add box intersection code here.
 	// it currently ignores all boxes and just returns false.
 
-	// Initialize the ray origin and direction
-	vec3f ray_d = r.getDirection();
+	// Slab test against the unit cube, with the ray's reciprocal direction:
+	// the face a ray enters each slab through is the one at +0.5 when it
+	// points down that axis and at -0.5 otherwise.  A ray parallel to a
+	// slab gets infinite t values from it (NaN if it lies in a face, which
+	// the comparisons let through, as for a ray inside the slab).
 	vec3f ray_o = r.getPosition();
+	const vec3f &inv = r.getInverseDirection();
 
 	// set the t_near and t_far to the maximum and minimum value
 	double t_far = DBL_MAX;
 	double t_near = -DBL_MAX;
+	int axis_near = 0;
+	int axis_far = 0;
 
 	i.obj = this;
-	vec3f n_near, n_far;
 
-	for (int i = 0; i < 3; i++)
+	for (int a = 0; a < 3; a++)
 	{
-		if (abs(ray_d[i]) < RAY_EPSILON)
+		double face = r.getSign(a) ? 0.5 : -0.5;
+		double t1 = (face - ray_o[a]) * inv[a];
+		double t2 = (-face - ray_o[a]) * inv[a];
+
+		if (t1 > t_near)
 		{
-			// If the ray is parallel to the plane, return false
-			if (ray_o[i] < -0.5 || ray_o[i] > 0.5)
-			{
-				return false;
-			}
+			t_near = t1;
+			axis_near = a;
 		}
-		else
+		if (t2 < t_far)
 		{
-			// Calculate the intersection t value
-			double t1 = (-0.5 - ray_o[i]) / ray_d[i];
-			double t2 = (0.5 - ray_o[i]) / ray_d[i];
-			vec3f n1, n2;
-			n1[i] = -1;
-			n2[i] = 1;
-
-			if (t1 > t2)
-			{
-				swap(t1, t2);
-				swap(n1, n2);
-			}
-			if (t1 > t_near)
-			{
-				t_near = t1;
-				n_near = n1;
-			}
-			if (t2 < t_far)
-			{
-				t_far = t2;
-				n_far = n2;
-			}
-			// If the intersection is invalid, return false
-			if (t_near > t_far || t_far < RAY_EPSILON)
-			{
-				return false;
-			}
+			t_far = t2;
+			axis_far = a;
 		}
 	}
-	i.setT(t_near);
-	i.setN(n_near);
+
+	// If the intersection is invalid, or beyond the ray's interval, return false
+	if (t_near > t_far || t_far < RAY_EPSILON || t_far < r.getMinT() || t_near > r.getMaxT())
+	{
+		return false;
+	}
+
+	// a ray from inside leaves through the far face, whose outward normal
+	// points the way the ray goes
+	vec3f n;
+	if (t_near < RAY_EPSILON || t_near < r.getMinT())
+	{
+		if (t_far > r.getMaxT())
+			return false;
+		n[axis_far] = r.getSign(axis_far) ? -1.0 : 1.0;
+		i.setT(t_far);
+	}
+	else
+	{
+		n[axis_near] = r.getSign(axis_near) ? 1.0 : -1.0;
+		i.setT(t_near);
+	}
+	i.setN(n);
+	return true;
+}
+
+// A box that is only moved and scaled along the axes is still axis-aligned
+// in world space.
+bool Box::getBox(BoxRecord &rec) const
+{
+	TransformNode::Kind kind = transform->getKind();
+	if (kind == TransformNode::SIMILARITY || kind == TransformNode::GENERAL)
+		return false;
+
+	rec.center = transform->getOrigin();
+	rec.half = transform->getScale() * 0.5;
+	rec.motion = transform->getMotion();
+	rec.obj = this;
 	return true;
-}
\ No newline at end of file
+}
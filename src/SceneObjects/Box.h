@@ -13,6 +13,8 @@ public:
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool getBox( BoxRecord& rec ) const;
+	virtual bool mayRehit( const vec3f& N, const vec3f& d ) const { return N.dot( d ) < 0.0; }
 	virtual bool hasBoundingBoxCapability() const { return true; }
     virtual BoundingBox ComputeLocalBoundingBox()
     {
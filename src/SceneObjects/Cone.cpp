@@ -42,11 +42,19 @@ bool Cone::intersectBody( const ray& r, isect& i ) const
 	double t1 = (-b - disc) / (2.0 * a);
 	double t2 = (-b + disc) / (2.0 * a);
 
-	if( t2 < RAY_EPSILON ) {
+	// a ray steeper than the side makes a negative, which puts the
+	// roots the other way round
+	if( t1 > t2 ) {
+		double t = t1;
+		t1 = t2;
+		t2 = t;
+	}
+
+	if( t2 < RAY_EPSILON || t2 < r.getMinT() ) {
 		return false;
 	}
 
-	if( t1 > RAY_EPSILON ) {
+	if( t1 > RAY_EPSILON && t1 >= r.getMinT() && t1 <= r.getMaxT() ) {
 		// Two intersections.
 		vec3f P = r.at( t1 );
 		double z = P[2];
@@ -54,7 +62,7 @@ bool Cone::intersectBody( const ray& r, isect& i ) const
 			// It's okay.
 			i.t = t1;
             i.N = vec3f( P[0], P[1], 
-              -(C*P[2]+(t_radius-b_radius)*t_radius/height)).normalize();
+              -(C*P[2]+(t_radius-b_radius)*b_radius/height)).normalize();
 				
 			
 			return true;
@@ -63,10 +71,10 @@ bool Cone::intersectBody( const ray& r, isect& i ) const
 
 	vec3f P = r.at( t2 );
 	double z = P[2];
-	if( z >= 0.0 && z <= height ) {
+	if( z >= 0.0 && z <= height && t2 <= r.getMaxT() ) {
 		i.t = t2;
         i.N = vec3f( P[0], P[1], 
-              -(C*P[2]+(t_radius-b_radius)*t_radius/height)).normalize();
+              -(C*P[2]+(t_radius-b_radius)*b_radius/height)).normalize();
 		// In case we are _inside_ the _uncapped_ cone, we need to flip the normal.
 		// Essentially, the cone in this case is a double-sided surface
 		// and has _2_ normals
@@ -110,11 +118,11 @@ bool Cone::intersectCaps( const ray& r, isect& i ) const
 		r2 = b_radius;
 	}
 
-	if( t2 < RAY_EPSILON ) {
+	if( t2 < RAY_EPSILON || t2 < r.getMinT() ) {
 		return false;
 	}
 
-	if( t1 >= RAY_EPSILON ) {
+	if( t1 >= RAY_EPSILON && t1 >= r.getMinT() && t1 <= r.getMaxT() ) {
 		vec3f p( r.at( t1 ) );
 		if( (p[0]*p[0] + p[1]*p[1]) <= r1 * r1 ) {
 			i.t = t1;
@@ -129,7 +137,7 @@ bool Cone::intersectCaps( const ray& r, isect& i ) const
 	}
 
 	vec3f p( r.at( t2 ) );
-	if( (p[0]*p[0] + p[1]*p[1]) <= r2 * r2 ) {
+	if( (p[0]*p[0] + p[1]*p[1]) <= r2 * r2 && t2 <= r.getMaxT() ) {
 		i.t = t2;
 		if( dz > 0.0 ) {
 			// Intersection with interior of cap at z = 1.
@@ -21,6 +21,8 @@ public:
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	// only convex with its caps on
+	virtual bool mayRehit( const vec3f& N, const vec3f& d ) const { return !capped || N.dot( d ) < 0.0; }
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
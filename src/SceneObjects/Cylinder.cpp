@@ -48,13 +48,13 @@ bool Cylinder::intersectBody( const ray& r, isect& i ) const
 
 	double t2 = (-b + discriminant) / (2.0 * a);
 
-	if( t2 <= RAY_EPSILON ) {
+	if( t2 <= RAY_EPSILON || t2 < r.getMinT() ) {
 		return false;
 	}
 
 	double t1 = (-b - discriminant) / (2.0 * a);
 
-	if( t1 > RAY_EPSILON ) {
+	if( t1 > RAY_EPSILON && t1 >= r.getMinT() && t1 <= r.getMaxT() ) {
 		// Two intersections.
 		vec3f P = r.at( t1 );
 		double z = P[2];
@@ -68,7 +68,7 @@ bool Cylinder::intersectBody( const ray& r, isect& i ) const
 
 	vec3f P = r.at( t2 );
 	double z = P[2];
-	if( z >= 0.0 && z <= 1.0 ) {
+	if( z >= 0.0 && z <= 1.0 && t2 <= r.getMaxT() ) {
 		i.t = t2;
 
 		vec3f normal( P[0], P[1], 0.0 );
@@ -109,11 +109,11 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 		t2 = (-pz)/dz;
 	}
 
-	if( t2 < RAY_EPSILON ) {
+	if( t2 < RAY_EPSILON || t2 < r.getMinT() ) {
 		return false;
 	}
 
-	if( t1 >= RAY_EPSILON ) {
+	if( t1 >= RAY_EPSILON && t1 >= r.getMinT() && t1 <= r.getMaxT() ) {
 		vec3f p( r.at( t1 ) );
 		if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 ) {
 			i.t = t1;
@@ -128,7 +128,7 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 	}
 
 	vec3f p( r.at( t2 ) );
-	if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 ) {
+	if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 && t2 <= r.getMaxT() ) {
 		i.t = t2;
 		if( dz > 0.0 ) {
 			// Intersection with cap at z = 1.
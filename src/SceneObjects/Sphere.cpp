@@ -15,22 +15,38 @@ bool Sphere::intersectLocal( const ray& r, isect& i ) const
 	discriminant = sqrt( discriminant );
 	double t2 = b + discriminant;
 
-	if( t2 <= RAY_EPSILON ) {
+	if( t2 <= RAY_EPSILON || t2 < r.getMinT() ) {
 		return false;
 	}
 
-	i.obj = this;
-
 	double t1 = b - discriminant;
+	double t = t1 > RAY_EPSILON && t1 >= r.getMinT() ? t1 : t2;
 
-	if( t1 > RAY_EPSILON ) {
-		i.t = t1;
-		i.N = r.at( t1 ).normalize();
-	} else {
-		i.t = t2;
-		i.N = r.at( t2 ).normalize();
+	if( t > r.getMaxT() ) {
+		return false;
 	}
 
+	i.obj = this;
+	i.t = t;
+	i.N = r.at( t ).normalize();
+
 	return true;
 }
 
+
+// A sphere that is only moved, turned and scaled evenly is still a sphere in
+// world space.
+bool Sphere::getSphere( SphereRecord& rec ) const
+{
+	const vec3f& scale = transform->getScale();
+	if( transform->getKind() == TransformNode::GENERAL ||
+		scale[0] != scale[1] || scale[1] != scale[2] ) {
+		return false;
+	}
+
+	rec.center = transform->getOrigin();
+	rec.motion = transform->getMotion();
+	rec.radius = scale[0];
+	rec.obj = this;
+	return true;
+}
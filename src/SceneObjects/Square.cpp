@@ -13,7 +13,7 @@ bool Square::intersectLocal( const ray& r, isect& i ) const
 
 	double t = -p[2]/d[2];
 
-	if( t <= RAY_EPSILON ) {
+	if( t <= RAY_EPSILON || t < r.getMinT() || t > r.getMaxT() ) {
 		return false;
 	}
 
@@ -13,6 +13,7 @@ public:
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool mayRehit( const vec3f& N, const vec3f& d ) const { return false; }
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
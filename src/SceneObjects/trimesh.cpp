@@ -13,7 +13,7 @@ Trimesh::~Trimesh()
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const vec3f &v )
 {
-    vertices.push_back( v );
+    vertices.push_back( vec3g( v ) );
 }
 
 void Trimesh::addMaterial( Material *m )
@@ -23,7 +23,7 @@ void Trimesh::addMaterial( Material *m )
 
 void Trimesh::addNormal( const vec3f &n )
 {
-    normals.push_back( n );
+    normals.push_back( vec3g( n ) );
 }
 
 // Returns false if the vertices a,b,c don't all exist
@@ -62,9 +62,9 @@ Trimesh::doubleCheck()
 // Calculates and returns the normal of the triangle too.
 bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
 {
-    const vec3f& a = parent->vertices[ids[0]];
-    const vec3f& b = parent->vertices[ids[1]];
-    const vec3f& c = parent->vertices[ids[2]];
+    vec3f a( parent->vertices[ids[0]] );
+    vec3f b( parent->vertices[ids[1]] );
+    vec3f c( parent->vertices[ids[2]] );
     
     vec3f bary;
     float t;
@@ -90,7 +90,7 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
     
     t = - (ap*n)/vdotn;
     
-    if( t < RAY_EPSILON )
+    if( t < RAY_EPSILON || t < r.getMinT() || t > r.getMaxT() )
         return false;
 
     // find k where k is the index of the component
@@ -122,9 +122,9 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
     if(parent->normals.size())
     {
         // use interpolated normals
-        i.setN( (bary[0] * parent->normals[ids[0]]
-                 + bary[1] * parent->normals[ids[1]]
-                 + bary[2] * parent->normals[ids[2]]).normalize() );
+        i.setN( (bary[0] * vec3f( parent->normals[ids[0]] )
+                 + bary[1] * vec3f( parent->normals[ids[1]] )
+                 + bary[2] * vec3f( parent->normals[ids[2]] )).normalize() );
     } else {
         i.setN( n );           // use face normal
     }
@@ -142,6 +142,63 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
     return true;
 }
 
+// Any affine transformation keeps a triangle a triangle, with the same
+// barycentric coordinates, so every face can be tested in world space
+// except those whose materials are blended per vertex.
+bool TrimeshFace::getTriangle( TriangleRecord& rec, vec3g *normals ) const
+{
+    if( parent->materials.size() )
+        return false;
+
+    vec3f a( parent->vertices[ids[0]] );
+    vec3f ab = vec3f( parent->vertices[ids[1]] ) - a;
+    vec3f ac = vec3f( parent->vertices[ids[2]] ) - a;
+    vec3f cv = ab.cross(ac);
+    if( cv.iszero() )
+        return false;
+
+    vec3f wa = transform->localToGlobalCoords( a );
+    vec3f wab = transform->localToGlobalCoords( a + ab ) - wa;
+    vec3f wac = transform->localToGlobalCoords( a + ac ) - wa;
+    rec.a = vec3g( wa );
+    rec.ab = vec3g( wab );
+    rec.ac = vec3g( wac );
+
+    // the local face normal taken to world space keeps the side that
+    // intersectLocal lets rays hit, even through a mirroring transform
+    vec3f cross = wab.cross(wac);
+    vec3f n = transform->localToGlobalCoordsNormal( cv.normalize() );
+    rec.n = vec3g( n );
+
+    rec.k = 0;
+    for( int j = 1; j < 3; ++j )
+    {
+        if( fabs(n[j]) > fabs(n[rec.k]) )
+            rec.k = j;
+    }
+    rec.invCross = 1.0 / cross[rec.k];
+
+    // RAY_EPSILON is a local distance; scale it by how much the
+    // transformation stretches the triangle
+    rec.epsilon = RAY_EPSILON * sqrt( cross.length() / cv.length() );
+
+    rec.motion = vec3g( transform->getMotion() );
+    rec.obj = this;
+
+    rec.normals = -1;
+    if( parent->normals.size() )
+    {
+        // left unnormalized so that they blend in the same proportions as
+        // the local normals do
+        const mat3f& normi = transform->getNormalXform();
+        for( int j = 0; j < 3; ++j )
+            normals[j] = vec3g( normi * vec3f( parent->normals[ids[j]] ) );
+        rec.normals = 0;
+    }
+
+    return true;
+}
+
 void
 Trimesh::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
@@ -154,15 +211,15 @@ Trimesh::generateNormals()
     
     for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
     {
-        vec3f a = vertices[(**fi)[0]];
-        vec3f b = vertices[(**fi)[1]];
-        vec3f c = vertices[(**fi)[2]];
+        vec3f a( vertices[(**fi)[0]] );
+        vec3f b( vertices[(**fi)[1]] );
+        vec3f c( vertices[(**fi)[2]] );
         
         vec3f faceNormal = ((b-a).cross(c-a)).normalize();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
+            normals[(**fi)[i]] += vec3g( faceNormal );
             ++numFaces[(**fi)[i]];
         }
     }
@@ -12,8 +12,8 @@ class TrimeshFace;
 class Trimesh : public MaterialSceneObject
 {
     friend class TrimeshFace;
-    typedef vector<vec3f> Normals;
-    typedef vector<vec3f> Vertices;
+    typedef vector<vec3g> Normals;
+    typedef vector<vec3g> Vertices;
     typedef vector<TrimeshFace*> Faces;
     typedef vector<Material*> Materials;
     Vertices vertices;
@@ -61,17 +61,22 @@ public:
     }
 
     virtual bool intersectLocal( const ray& r, isect& i ) const;
+    virtual bool getTriangle( TriangleRecord& rec, vec3g *normals ) const;
+    virtual bool mayRehit( const vec3f& N, const vec3f& d ) const { return false; }
 
     virtual bool hasBoundingBoxCapability() const { return true; }
       
     virtual BoundingBox ComputeLocalBoundingBox()
     {
         BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
+        vec3f a( parent->vertices[ids[0]] );
+        vec3f b( parent->vertices[ids[1]] );
+        vec3f c( parent->vertices[ids[2]] );
+        localbounds.max = maximum( a, b );
+		localbounds.min = minimum( a, b );
         
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
+        localbounds.max = maximum( c, localbounds.max);
+		localbounds.min = minimum( c, localbounds.min);
         return localbounds;
     }
     
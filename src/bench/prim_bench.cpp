@@ -0,0 +1,495 @@
+//
+// prim_bench.cpp
+//
+// The prim_bench target: each primitive's intersection code timed on its
+// own, with no BVH and no shading around it.  A batch of rays with a set
+// share of hits is made up in advance for every primitive, and the time
+// each kernel takes per ray is measured over it: the objects'
+// intersectLocal, and for spheres, boxes and triangles the flat record
+// tests the BVH uses as well.  Build with RAY_SIMD or RAY_FLOAT_GEOMETRY to
+// measure those versions of the kernels.
+//
+// Every kernel's answers are also checked against a plain reference
+// intersection written out here, which is slow but easy to trust; the
+// program fails if they disagree.
+//
+// usage : prim_bench [options]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../timing.h"
+#include "../scene/scene.h"
+#include "../scene/ray.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/trimesh.h"
+
+extern int getopt(int argc, char **argv, char *optstring);
+extern char *optarg;
+extern int optind;
+
+int g_rays = 1 << 16;
+int g_repeats = 15;
+unsigned int g_seed = 1;
+char *outName = NULL;
+
+// the hit rates every kernel is timed at
+const double hitRates[] = {0.1, 0.5, 0.9};
+const int HIT_RATES = 3;
+
+void usage(const char *progname)
+{
+	fprintf( stderr, "usage: %s [options]\n", progname );
+	fprintf( stderr, "  -n <#>      rays in each batch (default %d)\n", g_rays );
+	fprintf( stderr, "  -i <#>      passes over each batch, of which the median counts (default %d)\n", g_repeats );
+	fprintf( stderr, "  -x <#>      seed for the rays (default %u)\n", g_seed );
+	fprintf( stderr, "  -o <file>   write the results to file as JSON\n" );
+}
+
+// xorshift, so that the same seed makes the same rays everywhere
+struct Random
+{
+	unsigned int state;
+
+	Random(unsigned int seed) : state( seed ? seed : 1 ) {}
+
+	double next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state / 4294967296.0;
+	}
+
+	double range(double lo, double hi) { return lo + (hi - lo) * next(); }
+};
+
+// ---------------------------------------------------------------------------
+// The reference intersections.  Each surface of a shape offers all of its
+// hits with t > RAY_EPSILON, and the nearest is kept.  Normals point out
+// of closed shapes, and against the ray for the square.
+
+struct Reference
+{
+	bool hit;
+	double t;
+	vec3f N;
+
+	Reference() : hit( false ), t( 0.0 ) {}
+
+	void offer(double tt, const vec3f &n)
+	{
+		if (tt > RAY_EPSILON && (!hit || tt < t)) {
+			hit = true;
+			t = tt;
+			N = n.normalize();
+		}
+	}
+};
+
+// the roots of a t^2 + b t + c = 0, as many as there are
+int solveQuadratic(double a, double b, double c, double roots[2])
+{
+	if (a == 0.0) {
+		if (b == 0.0)
+			return 0;
+		roots[0] = -c / b;
+		return 1;
+	}
+	double disc = b * b - 4.0 * a * c;
+	if (disc < 0.0)
+		return 0;
+	disc = sqrt( disc );
+	roots[0] = (-b - disc) / (2.0 * a);
+	roots[1] = (-b + disc) / (2.0 * a);
+	return 2;
+}
+
+// the disc of the given radius at height z, facing the way of normal
+void offerDisc(Reference &ref, const vec3f &p, const vec3f &d, double z, double radius, double normal)
+{
+	if (d[2] == 0.0)
+		return;
+	double t = (z - p[2]) / d[2];
+	vec3f P = p + t * d;
+	if (P[0] * P[0] + P[1] * P[1] <= radius * radius)
+		ref.offer( t, vec3f( 0.0, 0.0, normal ) );
+}
+
+// the unit sphere at the origin
+Reference referenceSphere(const vec3f &p, const vec3f &d)
+{
+	Reference ref;
+	double roots[2];
+	int n = solveQuadratic( d.dot( d ), 2.0 * p.dot( d ), p.dot( p ) - 1.0, roots );
+	for (int k = 0; k < n; ++k)
+		ref.offer( roots[k], p + roots[k] * d );
+	return ref;
+}
+
+// the unit cube centred on the origin, face by face
+Reference referenceBox(const vec3f &p, const vec3f &d)
+{
+	Reference ref;
+	for (int a = 0; a < 3; ++a) {
+		if (d[a] == 0.0)
+			continue;
+		for (int side = -1; side <= 1; side += 2) {
+			double t = (0.5 * side - p[a]) / d[a];
+			vec3f P = p + t * d;
+			int b = (a + 1) % 3, c = (a + 2) % 3;
+			if (fabs( P[b] ) <= 0.5 && fabs( P[c] ) <= 0.5) {
+				vec3f n;
+				n[a] = side;
+				ref.offer( t, n );
+			}
+		}
+	}
+	return ref;
+}
+
+// the capped cone along z from radius br at 0 to radius tr at height h;
+// a cylinder is the cone with both radii 1 and height 1
+Reference referenceCone(const vec3f &p, const vec3f &d, double h, double br, double tr)
+{
+	Reference ref;
+
+	// x^2 + y^2 = r(z)^2, where r(z) = br + k z
+	double k = (tr - br) / h;
+	double r0 = br + k * p[2];
+	double r1 = k * d[2];
+	double roots[2];
+	int n = solveQuadratic( d[0] * d[0] + d[1] * d[1] - r1 * r1,
+							2.0 * (p[0] * d[0] + p[1] * d[1] - r0 * r1),
+							p[0] * p[0] + p[1] * p[1] - r0 * r0, roots );
+	for (int j = 0; j < n; ++j) {
+		vec3f P = p + roots[j] * d;
+		if (P[2] >= 0.0 && P[2] <= h)
+			ref.offer( roots[j], vec3f( P[0], P[1], -k * (br + k * P[2]) ) );
+	}
+
+	offerDisc( ref, p, d, 0.0, br, -1.0 );
+	offerDisc( ref, p, d, h, tr, 1.0 );
+	return ref;
+}
+
+// the unit square in the plane z = 0
+Reference referenceSquare(const vec3f &p, const vec3f &d)
+{
+	Reference ref;
+	if (d[2] == 0.0)
+		return ref;
+	double t = -p[2] / d[2];
+	vec3f P = p + t * d;
+	if (fabs( P[0] ) <= 0.5 && fabs( P[1] ) <= 0.5)
+		ref.offer( t, vec3f( 0.0, 0.0, d[2] > 0.0 ? -1.0 : 1.0 ) );
+	return ref;
+}
+
+// the triangle abc, seen only from the side its normal ab x ac is on
+// (Moller and Trumbore)
+Reference referenceTriangle(const vec3f &p, const vec3f &d, const vec3f &a, const vec3f &b, const vec3f &c)
+{
+	Reference ref;
+	vec3f ab = b - a, ac = c - a;
+	vec3f n = ab.cross( ac ).normalize();
+	if (-d.dot( n ) < NORMAL_EPSILON)
+		return ref;
+
+	vec3f q = d.cross( ac );
+	double det = ab.dot( q );
+	vec3f ap = p - a;
+	double u = ap.dot( q ) / det;
+	vec3f r = ap.cross( ab );
+	double v = d.dot( r ) / det;
+	if (u >= 0.0 && v >= 0.0 && u + v <= 1.0)
+		ref.offer( ac.dot( r ) / det, n );
+	return ref;
+}
+
+// ---------------------------------------------------------------------------
+// The shapes, as the scene file would make them, and their kernels.
+
+const vec3f triA( -0.8, -0.6, 0.1 );
+const vec3f triB( 0.9, -0.4, -0.1 );
+const vec3f triC( 0.1, 0.8, 0.05 );
+
+struct Shape
+{
+	const char *name;
+	vec3f lo, hi; // bounds to aim the rays at
+	Reference (*reference)(const vec3f &p, const vec3f &d);
+};
+
+Reference referenceCylinder(const vec3f &p, const vec3f &d) { return referenceCone( p, d, 1.0, 1.0, 1.0 ); }
+Reference referenceFrustum(const vec3f &p, const vec3f &d) { return referenceCone( p, d, 1.5, 1.0, 0.4 ); }
+Reference referenceTri(const vec3f &p, const vec3f &d) { return referenceTriangle( p, d, triA, triB, triC ); }
+
+enum ShapeKind
+{
+	SPHERE,
+	BOX,
+	CYLINDER,
+	CONE,
+	SQUARE,
+	TRIANGLE,
+	SHAPES
+};
+
+const Shape shapes[SHAPES] = {
+	{"sphere", vec3f( -1, -1, -1 ), vec3f( 1, 1, 1 ), referenceSphere},
+	{"box", vec3f( -0.5, -0.5, -0.5 ), vec3f( 0.5, 0.5, 0.5 ), referenceBox},
+	{"cylinder", vec3f( -1, -1, 0 ), vec3f( 1, 1, 1 ), referenceCylinder},
+	{"cone", vec3f( -1, -1, 0 ), vec3f( 1, 1, 1.5 ), referenceFrustum},
+	{"square", vec3f( -0.5, -0.5, -0.1 ), vec3f( 0.5, 0.5, 0.1 ), referenceSquare},
+	{"triangle", vec3f( -0.8, -0.6, -0.1 ), vec3f( 0.9, 0.8, 0.1 ), referenceTri},
+};
+
+// A kernel under test: either an object's intersectLocal, or one of the
+// record tests.
+struct Kernel
+{
+	std::string name;
+	ShapeKind shape;
+	const Geometry *object;
+	int record; // -1 for intersectLocal, else the ShapeKind of the record
+	double tolerance;
+
+	bool intersect(const ray &r, isect &i) const;
+};
+
+SphereRecord sphereRecord;
+BoxRecord boxRecord;
+TriangleRecord triangleRecord;
+
+bool Kernel::intersect(const ray &r, isect &i) const
+{
+	switch (record) {
+		case SPHERE:
+			return intersectSphere( sphereRecord, r, i );
+		case BOX:
+			return intersectBox( boxRecord, r, i );
+		case TRIANGLE:
+			return intersectTriangle( triangleRecord, NULL, r, i );
+		default:
+			return object->intersectLocal( r, i );
+	}
+}
+
+// ---------------------------------------------------------------------------
+
+// Rays at the shape from all round, a tenth of them starting inside its
+// bounds, sorted into hits and misses by the reference until there are
+// rate * count hits and the rest misses.
+std::vector<ray> makeRays(const Shape &shape, double rate, int count, Random &random)
+{
+	int hits = (int)(rate * count + 0.5);
+	int misses = count - hits;
+	vec3f centre = (shape.lo + shape.hi) * 0.5;
+	vec3f size = shape.hi - shape.lo;
+
+	std::vector<ray> rays;
+	rays.reserve( count );
+	for (long long tries = 0; (hits > 0 || misses > 0) && tries < 1000LL * count; ++tries) {
+		vec3f target;
+		for (int a = 0; a < 3; ++a)
+			target[a] = centre[a] + size[a] * random.range( -0.7, 0.7 );
+
+		vec3f start;
+		if (random.next() < 0.1) {
+			for (int a = 0; a < 3; ++a)
+				start[a] = centre[a] + size[a] * random.range( -0.45, 0.45 );
+		} else {
+			// a point on a sphere well outside the bounds
+			double z = random.range( -1.0, 1.0 );
+			double phi = random.range( 0.0, 2.0 * 3.14159265358979323846 );
+			double s = sqrt( 1.0 - z * z );
+			start = centre + 3.0 * size.length() * vec3f( s * cos( phi ), s * sin( phi ), z );
+		}
+
+		vec3f d = target - start;
+		if (d.iszero())
+			continue;
+		d = d.normalize();
+
+		bool hit = shape.reference( start, d ).hit;
+		if (hit && hits > 0) {
+			rays.push_back( ray( start, d ) );
+			--hits;
+		} else if (!hit && misses > 0) {
+			rays.push_back( ray( start, d ) );
+			--misses;
+		}
+	}
+
+	// the order they were found in would put the hits of a high rate
+	// first; shuffle them so that branches are no easier to predict than
+	// in a render
+	for (int k = (int)rays.size() - 1; k > 0; --k)
+		std::swap( rays[k], rays[(int)(random.next() * (k + 1))] );
+	return rays;
+}
+
+// The rays where kernel and reference disagree on whether there is a hit,
+// how far away it is, or which way the surface faces there.
+int check(const Kernel &kernel, const std::vector<ray> &rays)
+{
+	int wrong = 0;
+	for (size_t k = 0; k < rays.size(); ++k) {
+		const ray &r = rays[k];
+		isect i;
+		bool hit = kernel.intersect( r, i );
+		Reference ref = shapes[kernel.shape].reference( r.getPosition(), r.getDirection() );
+
+		bool same = hit == ref.hit;
+		if (same && hit)
+			same = fabs( i.t - ref.t ) <= kernel.tolerance * (1.0 + ref.t) &&
+				   i.N.normalize().dot( ref.N ) >= 1.0 - kernel.tolerance * 100.0;
+		if (!same) {
+			if (wrong < 3) {
+				vec3f p = r.getPosition(), d = r.getDirection();
+				fprintf( stderr, "%s: from (%g, %g, %g) along (%g, %g, %g): ",
+						 kernel.name.c_str(), p[0], p[1], p[2], d[0], d[1], d[2] );
+				if (hit)
+					fprintf( stderr, "t = %.9g, N = (%g, %g, %g)", i.t, i.N[0], i.N[1], i.N[2] );
+				else
+					fprintf( stderr, "no hit" );
+				if (ref.hit)
+					fprintf( stderr, " but the reference has t = %.9g, N = (%g, %g, %g)\n", ref.t, ref.N[0], ref.N[1], ref.N[2] );
+				else
+					fprintf( stderr, " but the reference has no hit\n" );
+			}
+			++wrong;
+		}
+	}
+	return wrong;
+}
+
+// the median nanoseconds per ray of g_repeats passes over the batch
+double timeKernel(const Kernel &kernel, const std::vector<ray> &rays, int &hits)
+{
+	std::vector<double> seconds;
+	for (int pass = 0; pass < g_repeats; ++pass) {
+		hits = 0;
+		Stopwatch watch;
+		for (size_t k = 0; k < rays.size(); ++k) {
+			isect i;
+			hits += kernel.intersect( rays[k], i );
+		}
+		seconds.push_back( watch.seconds() );
+	}
+	std::sort( seconds.begin(), seconds.end() );
+	return seconds[seconds.size() / 2] * 1e9 / rays.size();
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ( (opt = getopt( argc, argv, (char *)"n:i:x:o:" )) != EOF ) {
+		switch ( opt ) {
+			case 'n': g_rays = std::max( 1, atoi( optarg ) ); break;
+			case 'i': g_repeats = std::max( 1, atoi( optarg ) ); break;
+			case 'x': g_seed = (unsigned int)atoi( optarg ); break;
+			case 'o': outName = optarg; break;
+			default:
+				usage( argv[0] );
+				return 1;
+		}
+	}
+
+	// The objects as the parser would make them, without transforms, so
+	// that their local space is world space and the records describe the
+	// same shapes.
+	Scene scene;
+	Sphere *sphere = new Sphere( &scene, new Material );
+	Box *box = new Box( &scene, new Material );
+	Cylinder *cylinder = new Cylinder( &scene, new Material, true );
+	Cone *cone = new Cone( &scene, new Material, 1.5, 1.0, 0.4, true );
+	Square *square = new Square( &scene, new Material );
+	Trimesh *mesh = new Trimesh( &scene, new Material, &scene.transformRoot );
+	mesh->addVertex( triA );
+	mesh->addVertex( triB );
+	mesh->addVertex( triC );
+	mesh->addFace( 0, 1, 2 );
+	const Geometry *face = *(scene.beginObjects());
+
+	Geometry *objects[] = {sphere, box, cylinder, cone, square};
+	for (int k = 0; k < 5; ++k) {
+		objects[k]->setTransform( &scene.transformRoot );
+		scene.add( objects[k] );
+	}
+
+	sphere->getSphere( sphereRecord );
+	box->getBox( boxRecord );
+	vec3g unused[3];
+	face->getTriangle( triangleRecord, unused );
+
+	// triangles may be intersected in float
+	double triangleTolerance = sizeof(geomfloat) < sizeof(double) ? 1e-4 : 1e-7;
+	Kernel kernels[] = {
+		{"Sphere::intersectLocal", SPHERE, sphere, -1, 1e-7},
+		{"intersectSphere", SPHERE, sphere, SPHERE, 1e-7},
+		{"Box::intersectLocal", BOX, box, -1, 1e-7},
+		{"intersectBox", BOX, box, BOX, 1e-7},
+		{"Cylinder::intersectLocal", CYLINDER, cylinder, -1, 1e-7},
+		{"Cone::intersectLocal", CONE, cone, -1, 1e-7},
+		{"Square::intersectLocal", SQUARE, square, -1, 1e-7},
+		{"TrimeshFace::intersectLocal", TRIANGLE, face, -1, triangleTolerance},
+		{"intersectTriangle", TRIANGLE, face, TRIANGLE, triangleTolerance},
+	};
+	int kernelCount = sizeof(kernels) / sizeof(kernels[0]);
+
+	// one batch for each shape and hit rate, shared by its kernels
+	Random random( g_seed );
+	std::vector<ray> batches[SHAPES][HIT_RATES];
+	for (int s = 0; s < SHAPES; ++s)
+		for (int h = 0; h < HIT_RATES; ++h)
+			batches[s][h] = makeRays( shapes[s], hitRates[h], g_rays, random );
+
+	std::string json = "{\n  \"rays\": " + std::to_string( g_rays ) + ",\n  \"kernels\": [\n";
+	int failures = 0;
+	fprintf( stderr, "%-28s %10s %10s %10s %8s\n", "ns/ray at hit rate", "0.1", "0.5", "0.9", "wrong" );
+	for (int k = 0; k < kernelCount; ++k) {
+		const Kernel &kernel = kernels[k];
+		double ns[HIT_RATES];
+		int wrong = 0;
+		for (int h = 0; h < HIT_RATES; ++h) {
+			const std::vector<ray> &rays = batches[kernel.shape][h];
+			wrong += check( kernel, rays );
+			int hits;
+			ns[h] = timeKernel( kernel, rays, hits );
+		}
+		failures += wrong;
+		fprintf( stderr, "%-28s %10.2f %10.2f %10.2f %8d\n", kernel.name.c_str(), ns[0], ns[1], ns[2], wrong );
+
+		char line[256];
+		snprintf( line, sizeof(line), "    {\"kernel\": \"%s\", \"ns_per_ray\": {\"0.1\": %.3f, \"0.5\": %.3f, \"0.9\": %.3f}, \"mismatches\": %d}%s\n",
+				  kernel.name.c_str(), ns[0], ns[1], ns[2], wrong, k + 1 < kernelCount ? "," : "" );
+		json += line;
+	}
+	json += "  ]\n}\n";
+
+	if (outName) {
+		FILE *f = fopen( outName, "w" );
+		if (!f) {
+			fprintf( stderr, "cannot write %s\n", outName );
+			return 1;
+		}
+		fputs( json.c_str(), f );
+		fclose( f );
+	}
+
+	if (failures)
+		fprintf( stderr, "%d rays disagree with the reference\n", failures );
+	return failures ? 1 : 0;
+}
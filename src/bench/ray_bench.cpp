@@ -0,0 +1,303 @@
+//
+// ray_bench.cpp
+//
+// The ray_bench target: a repeatable measurement of how fast the tracer is
+// on the project's own scenes.  Every .ray file in a directory (simpleSamples
+// by default) and a set of generated scenes of growing size are rendered
+// with the same settings several times over, and the median render time,
+// the rays traced per second and the peak memory use of each are written
+// out as JSON.  Given the JSON of an earlier run, each scene is compared
+// with it as well.
+//
+// usage : ray_bench [options] [directory]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <io.h>
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <dirent.h>
+#include <sys/resource.h>
+#endif
+
+#include "../RayTracer.h"
+#include "../parallel.h"
+#include "../timing.h"
+#include "../fileio/generate.h"
+#include "../scene/raystats.h"
+
+extern int getopt(int argc, char **argv, char *optstring);
+extern char *optarg;
+extern int optind;
+
+int g_width = 256;
+int g_depth = 5;
+int g_samples = 1;
+int g_repeats = 5;
+char *baseName = NULL;
+char *outName = NULL;
+char *dirName = (char *)"simpleSamples";
+
+void usage(const char *progname)
+{
+	fprintf( stderr, "usage: %s [options] [directory]\n", progname );
+	fprintf( stderr, "  -w <#>      image width (default %d)\n", g_width );
+	fprintf( stderr, "  -r <#>      recursion depth (default %d)\n", g_depth );
+	fprintf( stderr, "  -s <#>      samples per pixel (default %d)\n", g_samples );
+	fprintf( stderr, "  -n <#>      renders of each scene, of which the median counts (default %d)\n", g_repeats );
+	fprintf( stderr, "  -b <file>   compare with the JSON of an earlier run\n" );
+	fprintf( stderr, "  -o <file>   write the JSON to file rather than to the standard output\n" );
+	fprintf( stderr, "  directory   the .ray files to render (default %s)\n", dirName );
+}
+
+// the .ray files in dir, in name order
+std::vector<std::string> sceneFiles(const char *dir)
+{
+	std::vector<std::string> names;
+#ifdef WIN32
+	std::string pattern = std::string( dir ) + "\\*.ray";
+	struct _finddata_t found;
+	intptr_t h = _findfirst( pattern.c_str(), &found );
+	if (h != -1) {
+		do
+			names.push_back( found.name );
+		while (_findnext( h, &found ) == 0);
+		_findclose( h );
+	}
+#else
+	DIR *d = opendir( dir );
+	if (d) {
+		while (struct dirent *e = readdir( d )) {
+			size_t n = strlen( e->d_name );
+			if (n > 4 && strcmp( e->d_name + n - 4, ".ray" ) == 0)
+				names.push_back( e->d_name );
+		}
+		closedir( d );
+	}
+#endif
+	std::sort( names.begin(), names.end() );
+	return names;
+}
+
+// the most memory the process has held at once so far, in megabytes
+double peakMegabytes()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof(pmc) ))
+		return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+	return 0.0;
+#else
+	struct rusage usage;
+	getrusage( RUSAGE_SELF, &usage );
+#ifdef __APPLE__
+	return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+// The generated scenes, from small to large, and the names they are
+// reported under; see fileio/generate.h.
+const char *generated[][2] = {
+	{ "spheres512", "spheres=512" },
+	{ "spheres4096", "spheres=4096,lights=4" },
+	{ "spheres32768", "spheres=32768,glass=0.2" },
+	{ "mixed", "spheres=2000,boxes=2000,triangles=20000,meshes=4,instances=4,lights=3" },
+	{ "triangles100k", "triangles=100000,meshes=8,lights=3" },
+};
+
+struct Result
+{
+	std::string scene;
+	double median, fastest, build;
+	long long rays;
+	double peak;
+	double baseline; // 0 if the baseline run did not have the scene
+};
+
+// Render the scene that is loaded g_repeats times and keep the times.
+bool measure(RayTracer &tracer, const std::string &name, Result &result)
+{
+	if (!tracer.sceneLoaded()) {
+		fprintf( stderr, "%s: not loaded\n", name.c_str() );
+		return false;
+	}
+
+	int height = (int)(g_width / tracer.aspectRatio() + 0.5);
+	std::vector<double> seconds;
+	long long rays = 0;
+	for (int k = 0; k < g_repeats; ++k) {
+		tracer.traceSetup( g_width, height );
+		RayStats::reset();
+		Stopwatch watch;
+		tracer.traceTiles();
+		seconds.push_back( watch.seconds() );
+		rays = RayStats::total().traced();
+	}
+	std::sort( seconds.begin(), seconds.end() );
+
+	result.scene = name;
+	result.median = seconds[seconds.size() / 2];
+	result.fastest = seconds[0];
+	result.build = tracer.getTimes().seconds[PhaseTimes::BUILD];
+	// without RAY_STATS only the camera rays are known
+	result.rays = RayStats::enabled() ? rays : (long long)g_width * height * tracer.getSamples();
+	result.peak = peakMegabytes();
+	result.baseline = 0.0;
+	return true;
+}
+
+// The median seconds of every scene in a JSON file that this program
+// wrote, which has one scene to a line.
+std::vector<std::pair<std::string, double> > readBaseline(const char *fname)
+{
+	std::vector<std::pair<std::string, double> > times;
+	std::ifstream in( fname );
+	if (!in) {
+		fprintf( stderr, "cannot read %s\n", fname );
+		return times;
+	}
+
+	std::string line;
+	while (std::getline( in, line )) {
+		size_t s = line.find( "\"scene\": \"" );
+		size_t m = line.find( "\"median_seconds\": " );
+		if (s == std::string::npos || m == std::string::npos)
+			continue;
+		s += strlen( "\"scene\": \"" );
+		std::string scene = line.substr( s, line.find( '"', s ) - s );
+		times.push_back( std::make_pair( scene, atof( line.c_str() + m + strlen( "\"median_seconds\": " ) ) ) );
+	}
+	return times;
+}
+
+std::string report(const std::vector<Result> &results)
+{
+	std::string s = "{\n";
+	char line[512];
+	snprintf( line, sizeof(line), "  \"width\": %d,\n  \"depth\": %d,\n  \"samples\": %d,\n  \"repetitions\": %d,\n"
+		"  \"threads\": %d,\n  \"rays_counted\": %s,\n",
+		g_width, g_depth, g_samples, g_repeats, workerCount(), RayStats::enabled() ? "true" : "false" );
+	s += line;
+	s += "  \"scenes\": [\n";
+
+	double logSum = 0.0;
+	int compared = 0;
+	for (size_t k = 0; k < results.size(); ++k) {
+		const Result &r = results[k];
+		snprintf( line, sizeof(line), "    {\"scene\": \"%s\", \"median_seconds\": %.6f, \"min_seconds\": %.6f, "
+			"\"build_seconds\": %.6f, \"rays\": %lld, \"mrays_per_second\": %.3f, \"peak_rss_mb\": %.1f",
+			r.scene.c_str(), r.median, r.fastest, r.build, r.rays, r.rays / r.median / 1e6, r.peak );
+		s += line;
+		if (r.baseline > 0.0) {
+			snprintf( line, sizeof(line), ", \"baseline_seconds\": %.6f, \"speedup\": %.3f", r.baseline, r.baseline / r.median );
+			s += line;
+			logSum += log( r.baseline / r.median );
+			++compared;
+		}
+		s += k + 1 < results.size() ? "},\n" : "}\n";
+	}
+	s += "  ],\n";
+
+	if (compared) {
+		snprintf( line, sizeof(line), "  \"geomean_speedup\": %.3f,\n", exp( logSum / compared ) );
+		s += line;
+	}
+	snprintf( line, sizeof(line), "  \"peak_rss_mb\": %.1f\n}\n", peakMegabytes() );
+	s += line;
+	return s;
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	while ( (i = getopt( argc, argv, (char *)"w:r:s:n:b:o:" )) != EOF ) {
+		switch ( i ) {
+			case 'w': g_width = atoi( optarg ); break;
+			case 'r': g_depth = atoi( optarg ); break;
+			case 's': g_samples = atoi( optarg ); break;
+			case 'n': g_repeats = std::max( 1, atoi( optarg ) ); break;
+			case 'b': baseName = optarg; break;
+			case 'o': outName = optarg; break;
+			default:
+				usage( argv[0] );
+				return 1;
+		}
+	}
+	if (optind < argc)
+		dirName = argv[optind];
+
+	RayTracer tracer;
+	if (!tracer.setSampler( DEFAULT_SAMPLER, g_samples )) {
+		usage( argv[0] );
+		return 1;
+	}
+	tracer.setDepth( g_depth );
+
+	std::vector<Result> results;
+	Result result;
+
+	std::vector<std::string> files = sceneFiles( dirName );
+	if (files.empty())
+		fprintf( stderr, "no .ray files in %s\n", dirName );
+	for (size_t k = 0; k < files.size(); ++k) {
+		std::string path = std::string( dirName ) + "/" + files[k];
+		tracer.loadScene( (char *)path.c_str() );
+		if (measure( tracer, files[k], result ))
+			results.push_back( result );
+	}
+
+	for (size_t k = 0; k < sizeof(generated) / sizeof(generated[0]); ++k) {
+		SceneSpec spec;
+		spec.parse( generated[k][1] );
+		std::istringstream text( generateScene( spec ) );
+		tracer.loadScene( text );
+		if (measure( tracer, generated[k][0], result ))
+			results.push_back( result );
+	}
+
+	if (baseName) {
+		std::vector<std::pair<std::string, double> > base = readBaseline( baseName );
+		for (size_t k = 0; k < results.size(); ++k)
+			for (size_t b = 0; b < base.size(); ++b)
+				if (base[b].first == results[k].scene)
+					results[k].baseline = base[b].second;
+	}
+
+	for (size_t k = 0; k < results.size(); ++k) {
+		const Result &r = results[k];
+		fprintf( stderr, "%-28s %9.4f s %9.2f Mrays/s", r.scene.c_str(), r.median, r.rays / r.median / 1e6 );
+		if (r.baseline > 0.0)
+			fprintf( stderr, "  %6.2fx", r.baseline / r.median );
+		fprintf( stderr, "\n" );
+	}
+
+	std::string json = report( results );
+	if (outName) {
+		FILE *f = fopen( outName, "w" );
+		if (!f) {
+			fprintf( stderr, "cannot write %s\n", outName );
+			return 1;
+		}
+		fputs( json.c_str(), f );
+		fclose( f );
+	} else {
+		fputs( json.c_str(), stdout );
+	}
+	return 0;
+}
@@ -0,0 +1,256 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "generate.h"
+
+static const double PI = 3.14159265358979323846;
+
+SceneSpec::SceneSpec()
+{
+	seed = 1;
+	spheres = 0;
+	boxes = 0;
+	triangles = 0;
+	meshes = 1;
+	instances = 1;
+	lights = 2;
+	glass = 0.1;
+	mirror = 0.2;
+}
+
+bool SceneSpec::parse(const string &text)
+{
+	size_t start = 0;
+	while (start < text.size())
+	{
+		size_t end = text.find(',', start);
+		if (end == string::npos)
+			end = text.size();
+		string item = text.substr(start, end - start);
+		start = end + 1;
+
+		size_t eq = item.find('=');
+		if (eq == string::npos)
+		{
+			fprintf(stderr, "scene spec: %s has no value\n", item.c_str());
+			return false;
+		}
+		string name = item.substr(0, eq);
+		const char *value = item.c_str() + eq + 1;
+		char *rest;
+		double number = strtod(value, &rest);
+		if (rest == value || *rest || number < 0)
+		{
+			fprintf(stderr, "scene spec: bad value for %s\n", name.c_str());
+			return false;
+		}
+
+		if (name == "seed")
+			seed = (unsigned int)number;
+		else if (name == "spheres")
+			spheres = (int)number;
+		else if (name == "boxes")
+			boxes = (int)number;
+		else if (name == "triangles")
+			triangles = (int)number;
+		else if (name == "meshes")
+			meshes = (int)number;
+		else if (name == "instances")
+			instances = (int)number;
+		else if (name == "lights")
+			lights = (int)number;
+		else if (name == "glass")
+			glass = number;
+		else if (name == "mirror")
+			mirror = number;
+		else
+		{
+			fprintf(stderr, "scene spec: no setting called %s\n", name.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+// xorshift, which comes out the same everywhere, unlike rand()
+struct Random
+{
+	unsigned int state;
+
+	Random(unsigned int seed)
+		: state(seed * 2654435761u + 1) { next(); }
+
+	double next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state / 4294967296.0;
+	}
+
+	double range(double lo, double hi) { return lo + (hi - lo) * next(); }
+};
+
+// printf onto the end of s
+static void append(string &s, const char *format, ...)
+{
+	char line[512];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	s += line;
+}
+
+// a glass, mirror or coloured material, in the shares the spec asks for
+static void material(string &s, const SceneSpec &spec, Random &random)
+{
+	double u = random.next();
+	if (u < spec.glass)
+		s += "material = { specular = (0.8, 0.8, 0.8); transmissive = (0.9, 0.9, 0.9); index = 1.5; shininess = 0.9; };";
+	else if (u < spec.glass + spec.mirror)
+		s += "material = { diffuse = (0.1, 0.1, 0.1); specular = (0.8, 0.8, 0.8); reflective = (0.7, 0.7, 0.7); shininess = 0.8; };";
+	else
+		append(s, "material = { diffuse = (%.3f, %.3f, %.3f); specular = (0.3, 0.3, 0.3); shininess = %.3f; };",
+			   random.range(0.1, 0.9), random.range(0.1, 0.9), random.range(0.1, 0.9), random.range(0.1, 0.6));
+}
+
+// A closed bumpy ball of radius about 1 made of close to n triangles, as
+// rings of vertices between two poles.  The poles are closed with fans,
+// so no triangle has two corners in the same place.
+static void mesh(string &s, int n, const SceneSpec &spec, Random &random)
+{
+	int rings = (int)sqrt(n / 4.0);
+	if (rings < 3)
+		rings = 3;
+	int segments = 2 * rings;
+
+	// bumps of a random size and number on each mesh
+	double amount = random.range(0.05, 0.2);
+	int ka = 2 + (int)(random.next() * 5);
+	int kb = 2 + (int)(random.next() * 5);
+	double phase = random.range(0.0, 2 * PI);
+
+	s += "trimesh { gennormals = true;\n\t";
+	material(s, spec, random);
+	s += "\n\tpoints = ((0, 0, 1)";
+	for (int r = 1; r < rings; ++r)
+	{
+		double theta = PI * r / rings;
+		for (int k = 0; k < segments; ++k)
+		{
+			double phi = 2 * PI * k / segments;
+			double radius = 1.0 + amount * sin(ka * theta) * sin(kb * phi + phase);
+			append(s, ", (%.6g, %.6g, %.6g)", radius * sin(theta) * cos(phi),
+				   radius * sin(theta) * sin(phi), radius * cos(theta));
+		}
+	}
+	s += ", (0, 0, -1));\n\tfaces = (";
+
+	// ab x ac has to point out, which is the only side a triangle is hit on
+	int bottom = 1 + (rings - 1) * segments;
+	for (int k = 0; k < segments; ++k)
+	{
+		int next = (k + 1) % segments;
+		append(s, "%s(0, %d, %d)", k ? ", " : "", 1 + k, 1 + next);
+	}
+	for (int r = 1; r + 1 < rings; ++r)
+	{
+		int row = 1 + (r - 1) * segments;
+		int below = row + segments;
+		for (int k = 0; k < segments; ++k)
+		{
+			int next = (k + 1) % segments;
+			append(s, ", (%d, %d, %d), (%d, %d, %d)", row + k, below + k, below + next,
+				   row + k, below + next, row + next);
+		}
+	}
+	int last = 1 + (rings - 2) * segments;
+	for (int k = 0; k < segments; ++k)
+	{
+		int next = (k + 1) % segments;
+		append(s, ", (%d, %d, %d)", bottom, last + next, last + k);
+	}
+	s += "); }";
+}
+
+string generateScene(const SceneSpec &spec)
+{
+	Random random(spec.seed);
+	string s = "SBT-raytracer 1.0\n\n";
+	append(s, "// generated: seed=%u,spheres=%d,boxes=%d,triangles=%d,meshes=%d,instances=%d,lights=%d,glass=%g,mirror=%g\n\n",
+		   spec.seed, spec.spheres, spec.boxes, spec.triangles, spec.meshes, spec.instances,
+		   spec.lights, spec.glass, spec.mirror);
+
+	// the objects fill a cube whose size keeps them about as crowded
+	// however many there are
+	int meshes = spec.triangles > 0 ? (spec.meshes > 0 ? spec.meshes : 1) : 0;
+	int instances = spec.instances > 0 ? spec.instances : 1;
+	double count = spec.spheres + spec.boxes + meshes * instances * 8.0;
+	double size = 2.0 * cbrt(count > 8 ? count : 8);
+	double mid = size / 2;
+
+	append(s, "camera\n{\n\tposition = (%g, %g, %g);\n\tviewdir = (%g, %g, %g);\n\tupdir = (0, 0, 1);\n}\n\n",
+		   mid + 0.9 * size, mid - 1.2 * size, mid + 0.8 * size, -0.9 * size, 1.2 * size, -0.8 * size);
+	s += "ambient_light\n{\n\tcolor = (0.15, 0.15, 0.15);\n}\n\n";
+
+	if (spec.lights > 0)
+		s += "directional_light\n{\n\tdirection = (-0.3, 0.5, -1);\n\tcolor = (0.6, 0.6, 0.6);\n}\n\n";
+	for (int l = 1; l < spec.lights; ++l)
+	{
+		double c = 0.8 / (spec.lights - 1);
+		append(s, "point_light\n{\n\tposition = (%.4g, %.4g, %.4g);\n\tcolor = (%.4g, %.4g, %.4g);\n}\n\n",
+			   random.range(0.0, size), random.range(0.0, size), random.range(1.2 * size, 1.6 * size), c, c, c);
+	}
+
+	// a floor under it all
+	append(s, "translate( %g, %g, -1, scale( %g, %g, 0.2, box { material = { diffuse = (0.6, 0.6, 0.6); } } ) )\n\n",
+		   mid, mid, 4 * size, 4 * size);
+
+	for (int k = 0; k < spec.spheres; ++k)
+	{
+		append(s, "translate( %.4g, %.4g, %.4g, scale( %.3g, sphere { ", random.range(0.0, size),
+			   random.range(0.0, size), random.range(0.0, size), random.range(0.15, 0.45));
+		material(s, spec, random);
+		s += " } ) )\n";
+	}
+
+	for (int k = 0; k < spec.boxes; ++k)
+	{
+		append(s, "translate( %.4g, %.4g, %.4g, ", random.range(0.0, size),
+			   random.range(0.0, size), random.range(0.0, size));
+		bool turned = k % 2 == 1;
+		if (turned)
+			append(s, "rotate( %.3f, %.3f, %.3f, %.3f, ", random.range(-1.0, 1.0),
+				   random.range(-1.0, 1.0), random.range(0.1, 1.0), random.range(0.0, PI));
+		append(s, "scale( %.3g, %.3g, %.3g, box { ", random.range(0.3, 0.9),
+			   random.range(0.3, 0.9), random.range(0.3, 0.9));
+		material(s, spec, random);
+		s += turned ? " } ) ) )\n" : " } ) )\n";
+	}
+
+	// Each mesh is copied onto a grid of cells through the cube, one
+	// after another; there is no instancing, so every copy is a mesh of
+	// its own.
+	int cells = (int)ceil(cbrt((double)meshes * instances) - 1e-9);
+	double cell = size / cells;
+	int place = 0;
+	for (int m = 0; m < meshes; ++m)
+	{
+		string shape;
+		int n = spec.triangles / meshes + (m < spec.triangles % meshes ? 1 : 0);
+		mesh(shape, n, spec, random);
+		for (int k = 0; k < instances; ++k, ++place)
+		{
+			int x = place % cells, y = (place / cells) % cells, z = place / (cells * cells);
+			append(s, "translate( %g, %g, %g, scale( %g,\n", (x + 0.5) * cell, (y + 0.5) * cell,
+				   (z + 0.5) * cell, 0.4 * cell);
+			s += shape;
+			s += " ) )\n";
+		}
+	}
+
+	return s;
+}
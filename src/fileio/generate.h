@@ -0,0 +1,36 @@
+#ifndef __GENERATE_H__
+#define __GENERATE_H__
+
+// Made-up scenes of any size, for seeing how the tracer scales.  A scene is
+// written out as .ray text, which can be saved or read straight back with
+// RayTracer::loadScene(istream &).  Everything in it follows from the spec,
+// so the same spec gives the same scene on every machine.
+
+#include <string>
+
+using namespace std;
+
+struct SceneSpec
+{
+	unsigned int seed;
+	int spheres;   // scattered at random through a cube
+	int boxes;	   // the same, half of them turned
+	int triangles; // in all, shared out between the meshes
+	int meshes;	   // bumpy closed surfaces made of triangles
+	int instances; // copies of each mesh, set out on a grid
+	int lights;	   // the first is the sun and the rest point lights
+	double glass;  // the share of spheres, boxes and meshes that are glass
+	double mirror; // ... and that are mirrors
+
+	SceneSpec();
+
+	// Read name=value settings separated by commas, such as
+	// "spheres=10000,lights=4,seed=7", over the defaults; returns false,
+	// naming the culprit on stderr, for a name it does not know or a
+	// value it cannot read.
+	bool parse(const string &text);
+};
+
+string generateScene(const SceneSpec &spec);
+
+#endif // __GENERATE_H__
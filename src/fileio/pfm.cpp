@@ -0,0 +1,26 @@
+//
+// pfm.cpp
+//
+
+#include <stdio.h>
+
+#include "pfm.h"
+
+bool writePFM(const char *fname, int width, int height, const float *data)
+{
+	FILE *file = fopen( fname, "wb" );
+	if ( !file )
+		return false;
+
+	// a negative scale means the floats are little-endian
+	unsigned int one = 1;
+	bool little = *(unsigned char *)&one == 1;
+	fprintf( file, "Pf\n%d %d\n%s\n", width, height, little ? "-1.0" : "1.0" );
+
+	for ( int j = 0; j < height; ++j )
+		fwrite( data + j * width, sizeof(float), width, file );
+
+	bool ok = !ferror( file );
+	fclose( file );
+	return ok;
+}
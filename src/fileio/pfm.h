@@ -0,0 +1,16 @@
+//
+// pfm.h
+//
+// Portable float map output: a short text header followed by the raw
+// 32-bit floats, one per pixel, bottom row first like a bitmap.  Most
+// image tools and numpy can read it without losing any precision.
+//
+
+#ifndef PFM_H
+#define PFM_H
+
+// data is width * height floats in scanline order; returns false if the
+// file cannot be written
+extern bool writePFM(const char *fname, int width, int height, const float *data);
+
+#endif
@@ -20,6 +20,7 @@
 #include "../SceneObjects/Sphere.h"
 #include "../SceneObjects/Square.h"
 #include "../scene/light.h"
+#include "../scene/animation.h"
 
 typedef map<string, Material *> mmap;
 
@@ -57,11 +58,9 @@ Scene *readScene(const string &filename)
 	}
 }
 
-Scene *readScene(istream &is)
+// Check the file header
+static void readHeader(istream &is)
 {
-	Scene *ret = new Scene;
-
-	// Extract the file header
 	static const int MAXNAME = 80;
 	char buf[MAXNAME];
 	int ct = 0;
@@ -94,6 +93,13 @@ Scene *readScene(istream &is)
 
 		throw ParseError(string(oss.str()));
 	}
+}
+
+Scene *readScene(istream &is)
+{
+	Scene *ret = new Scene;
+
+	readHeader(is);
 
 	// vector<Obj*> result;
 	mmap materials;
@@ -247,7 +253,32 @@ static void verifyTuple(const mytuple &tup, size_t size)
 static void processGeometry(string name, Obj *child, Scene *scene,
 							const mmap &materials, TransformNode *transform)
 {
-	if (name == "translate")
+	// added: node("name", child) names the transform above child, so that
+	// an animation can move child by setting it
+	if (name == "node")
+	{
+		const mytuple &tup = child->getTuple();
+		verifyTuple(tup, 2);
+
+		string nodeName = tup[0]->getTypeName() == "id" ? tup[0]->getID() : tup[0]->getString();
+		TransformNode *node = transform->createChild(mat4f());
+		scene->nameNode(nodeName, node);
+		processGeometry(tup[1], scene, materials, node);
+	}
+	// added: motion(dx, dy, dz, child) moves child by (dx, dy, dz) while
+	// the shutter is open, blurring it when there is more than one sample
+	else if (name == "motion")
+	{
+		const mytuple &tup = child->getTuple();
+		verifyTuple(tup, 4);
+		processGeometry(tup[3],
+						scene,
+						materials,
+						transform->createMovingChild(vec3f(tup[0]->getScalar(),
+														   tup[1]->getScalar(),
+														   tup[2]->getScalar())));
+	}
+	else if (name == "translate")
 	{
 		const mytuple &tup = child->getTuple();
 		verifyTuple(tup, 4);
@@ -558,6 +589,11 @@ processCamera(Obj *child, Scene *scene)
 		scene->getCamera()->setFOV(getField(child, "fov")->getScalar());
 	if (hasField(child, "aspectratio"))
 		scene->getCamera()->setAspectRatio(getField(child, "aspectratio")->getScalar());
+	// added: thin lens depth of field
+	if (hasField(child, "aperture"))
+		scene->getCamera()->setAperture(getField(child, "aperture")->getScalar());
+	if (hasField(child, "focal_distance"))
+		scene->getCamera()->setFocalDistance(getField(child, "focal_distance")->getScalar());
 	if (hasField(child, "viewdir") && hasField(child, "updir"))
 	{
 		scene->getCamera()->setLook(tupleToVec(getField(child, "viewdir")).normalize(),
@@ -657,12 +693,53 @@ static void processObject(Obj *obj, Scene *scene, mmap &materials)
 									 getField(child, "quadratic_attenuation_coeff")->getScalar()));
 		}
 	}
+	// added area lights
+	else if (name == "rect_light" || name == "sphere_light")
+	{
+		if (child == NULL)
+		{
+			throw ParseError("No info for " + name);
+		}
+
+		double samples = 8;
+		maybeExtractField(child, "samples", samples);
+
+		double a = 0.25, b = 0.01, c = 0.01;
+		if (hasField(child, "constant_attenuation_coeff") &&
+			hasField(child, "linear_attenuation_coeff") &&
+			hasField(child, "quadratic_attenuation_coeff"))
+		{
+			a = getField(child, "constant_attenuation_coeff")->getScalar();
+			b = getField(child, "linear_attenuation_coeff")->getScalar();
+			c = getField(child, "quadratic_attenuation_coeff")->getScalar();
+		}
+
+		if (name == "rect_light")
+		{
+			scene->add(new RectangleLight(scene,
+										  tupleToVec(getField(child, "position")),
+										  tupleToVec(getColorField(child)),
+										  tupleToVec(getField(child, "edge1")),
+										  tupleToVec(getField(child, "edge2")),
+										  (int)samples, a, b, c));
+		}
+		else
+		{
+			scene->add(new SphereLight(scene,
+									   tupleToVec(getField(child, "position")),
+									   tupleToVec(getColorField(child)),
+									   getField(child, "radius")->getScalar(),
+									   (int)samples, a, b, c));
+		}
+	}
 	else if (name == "sphere" ||
 			 name == "box" ||
 			 name == "cylinder" ||
 			 name == "cone" ||
 			 name == "square" ||
 			 name == "translate" ||
+			 name == "motion" ||
+			 name == "node" ||
 			 name == "rotate" ||
 			 name == "scale" ||
 			 name == "transform" ||
@@ -685,3 +762,131 @@ static void processObject(Obj *obj, Scene *scene, mmap &materials)
 		throw ParseError(string("Unrecognized object: ") + name);
 	}
 }
+
+// added: keyframe files.  They use the scene file syntax, with one object
+// per key:
+//
+//   frames { count = 120; }
+//   node { name = "turntable"; frame = 0; rotate = (0, 1, 0, 0); }
+//   node { name = "turntable"; frame = 119; rotate = (0, 1, 0, 6.23); }
+//   camera { frame = 0; position = (0, 2, 8); viewdir = (0, 0, -1); updir = (0, 1, 0); }
+//
+// A key sets any of the channels its target has (see Animation).
+
+// Add the key for each channel of target that child has a field for.
+static void processKey(Animation *anim, Obj *child, const string &target,
+					   const char *const *channels, const int *sizes)
+{
+	int frame = (int)getField(child, "frame")->getScalar();
+
+	for (int c = 0; channels[c]; ++c)
+	{
+		if (!hasField(child, channels[c]))
+			continue;
+
+		vector<double> values;
+		Obj *field = getField(child, channels[c]);
+		if (sizes[c] == 1)
+		{
+			values.push_back(field->getScalar());
+		}
+		else
+		{
+			const mytuple &tup = field->getTuple();
+			verifyTuple(tup, sizes[c]);
+			for (int v = 0; v < sizes[c]; ++v)
+				values.push_back(tup[v]->getScalar());
+		}
+
+		anim->addKey(target, channels[c], frame, values);
+	}
+}
+
+static void processAnimationObject(Obj *obj, Animation *anim)
+{
+	static const char *const nodeChannels[] = {"translate", "rotate", "scale", NULL};
+	static const int nodeSizes[] = {3, 4, 3};
+	static const char *const cameraChannels[] = {"position", "viewdir", "updir", "fov",
+												 "aperture", "focal_distance", NULL};
+	static const int cameraSizes[] = {3, 3, 3, 1, 1, 1};
+
+	if (obj->getTypeName() != "named" || obj->getChild() == NULL)
+	{
+		ostrstream oss;
+		oss << "Unknown input object ";
+		obj->printOn(oss);
+
+		throw ParseError(string(oss.str()));
+	}
+
+	string name = obj->getName();
+	Obj *child = obj->getChild();
+
+	if (name == "frames")
+	{
+		anim->setFrameCount((int)getField(child, "count")->getScalar());
+	}
+	else if (name == "node")
+	{
+		Obj *id = getField(child, "name");
+		string target = id->getTypeName() == "id" ? id->getID() : id->getString();
+		if (target == "camera")
+			throw ParseError("A node can't be called camera");
+
+		processKey(anim, child, target, nodeChannels, nodeSizes);
+	}
+	else if (name == "camera")
+	{
+		if (hasField(child, "viewdir") != hasField(child, "updir"))
+			throw ParseError("Camera keys need both viewdir and updir");
+
+		processKey(anim, child, "camera", cameraChannels, cameraSizes);
+	}
+	else
+	{
+		throw ParseError(string("Unrecognized object: ") + name);
+	}
+}
+
+Animation *readAnimation(const string &filename)
+{
+	ifstream ifs(filename.c_str());
+	if (!ifs)
+	{
+		cerr << "Error: couldn't read keyframe file " << filename << endl;
+		return NULL;
+	}
+
+	Animation *anim = new Animation;
+	try
+	{
+		readHeader(ifs);
+
+		while (true)
+		{
+			Obj *cur = readFile(ifs);
+			if (!cur)
+			{
+				break;
+			}
+
+			processAnimationObject(cur, anim);
+			delete cur;
+		}
+	}
+	catch (ParseError &pe)
+	{
+		cout << "Parse error: " << pe << endl;
+		delete anim;
+		return NULL;
+	}
+
+	if (anim->getFrameCount() <= 0)
+	{
+		cerr << "Error: no keys in " << filename << endl;
+		delete anim;
+		return NULL;
+	}
+
+	return anim;
+}
@@ -9,4 +9,8 @@
 Scene *readScene( const string& filename );
 Scene *readScene( istream& is );
 
+// added: read a keyframe file; NULL if it can't be read
+class Animation;
+Animation *readAnimation( const string& filename );
+
 #endif // __READ_H__
@@ -13,14 +13,14 @@
 //  |
 //  +- RayTracer::traceSetup
 //  |
-//  +- RayTracer::traceLines
+//  +- RayTracer::traceTiles
 //        |
 //        +- RayTracer::tracePixel
 //              |
+//              +- Camera::rayThrough
+//              |
 //              +- RayTracer::trace
 //                    |
-//                    +- Camera::rayThrough
-//                    |
 //                    +- RayTracer::traceRay
 //                          |
 //                          +- Scene::intersect
@@ -34,15 +34,16 @@
 //                          +- Material::shade
 //
 // The loadScene and traceSetup methods load a file and set up all the internal
-// buffers necessary to render the scene.  The traceLines method begins the
-// process of actually rendering the image, one scanline at a time.  It does
-// this by calling tracePixel for each pixel in the image.  tracePixel is given
+// buffers necessary to render the scene.  The traceTiles method begins the
+// process of actually rendering the image, one square tile at a time on
+// every processor.  It does this by calling tracePixel for each pixel in the
+// image.  tracePixel is given
 // a coordinate pair which is converted into an (x,y) screen coordinate and
 // passed to trace.  The trace method calculates a ray from the camera position
 // through the (x,y) coordinate and then calls traceRay to see if this ray
 // actually intersects any objects in the scene.  The intersect method in
-// Scene calls intersect on each object in the scene (part of your assignment
-// is an acceleration or culling process that cuts this down significantly).
+// Scene walks a bounding volume hierarchy and calls intersect only on the
+// objects whose boxes the ray passes through.
 // Each object in the scene is a descendant of Geometry and has its own
 // intersectLocal routine (you need to fill this method in for the Box class).
 // The intersect method actually converts the ray into the coordinate frame
@@ -55,7 +56,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+
+#include <sstream>
 
 #include <FL/Fl.h>
 #include <FL/Fl_Window.H>
@@ -65,8 +68,11 @@
 
 #include "ui/TraceUI.h"
 #include "RayTracer.h"
+#include "scene/raystats.h"
 
 #include "fileio/bitmap.h"
+#include "fileio/generate.h"
+#include "fileio/pfm.h"
 
 // ***********************************************************
 // from getopt.cpp 
@@ -86,25 +92,59 @@ TraceUI* traceUI;
 int recursion_depth = 0;
 int g_height;
 int g_width = 150;
+int g_samples = 1;
+const char *samplerName = DEFAULT_SAMPLER;
 bool bReport = false;
+bool bDenoise = false;
+bool bPathTrace = false;
+int g_photons = 0;
+char *animName = NULL;
+char *jsonName = NULL;
+char *costName = NULL;
+char *specText = NULL;
+char *exportName = NULL;
+char *timelineName = NULL;
 char *progname, *rayName, *imgName;
 
+// the tiles of all the frames, and how many of them were traced
+int g_tiles = 0;
+int g_tilesTraced = 0;
+
 void usage()
 {
 #ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+	fl_alert( "usage: %s [-r <#> -w <#> -s <#> -p <sampler> -c <#> -a <keys> -j <file> -m <cost> -G <spec> -e <file> -T <file> -g -d -t] [input.ray output.bmp]\n", progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
 	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
-	fprintf( stderr, "  -t			report time statistics\n" );
+	fprintf( stderr, "  -s <#>      set samples per pixel (default %d)\n", g_samples );
+	fprintf( stderr, "  -p <name>   sample pattern: stratified, sobol or bluenoise (default %s)\n", samplerName );
+	fprintf( stderr, "  -c <#>      trace caustics with this many photons (default none)\n" );
+	fprintf( stderr, "  -a <file>   render every frame of a keyframe file, numbering\n" );
+	fprintf( stderr, "              the output files (or use a %%d in the output name)\n" );
+	fprintf( stderr, "  -g          path traced global illumination\n" );
+	fprintf( stderr, "  -d          denoise the image\n" );
+	fprintf( stderr, "  -m <cost>   also write a heatmap of what each pixel cost, as\n" );
+	fprintf( stderr, "              name.cost.bmp and raw floats in name.cost.pfm: time\n" );
+	fprintf( stderr, "              in nanoseconds, or rays or tests if built with RAY_STATS\n" );
+	fprintf( stderr, "  -G <spec>   trace a generated scene instead of input.ray, made from\n" );
+	fprintf( stderr, "              settings such as spheres=1000,boxes=100,triangles=50000,\n" );
+	fprintf( stderr, "              meshes=4,instances=8,lights=3,glass=0.1,mirror=0.2,seed=1\n" );
+	fprintf( stderr, "  -e <file>   write the generated scene to file; the image is only\n" );
+	fprintf( stderr, "              traced if an output name is given as well\n" );
+	fprintf( stderr, "  -j <file>   write the times and ray statistics to file as JSON\n" );
+	fprintf( stderr, "  -T <file>   write a timeline of every stage and of each thread's\n" );
+	fprintf( stderr, "              tiles, for chrome://tracing or ui.perfetto.dev\n" );
+	fprintf( stderr, "  -t			report time statistics, and ray statistics if built\n" );
+	fprintf( stderr, "              with RAY_STATS\n" );
 #endif
 }
 
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+    while ( (i = getopt( argc, argv, "tdgr:w:h:s:p:c:a:j:m:G:e:T:" )) != EOF )
 	{
 		switch ( i )
 		{
@@ -112,6 +152,14 @@ bool processArgs(int argc, char **argv) {
 			bReport = true;
 			break;
 	    
+			case 'd':
+			bDenoise = true;
+			break;
+
+			case 'g':
+			bPathTrace = true;
+			break;
+
 			case 'r':
 			recursion_depth = atoi( optarg );
 			break;
@@ -124,11 +172,59 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 's':
+			g_samples = atoi( optarg );
+			break;
+
+			case 'p':
+			samplerName = optarg;
+			break;
+
+			case 'c':
+			g_photons = atoi( optarg );
+			break;
+
+			case 'a':
+			animName = optarg;
+			break;
+
+			case 'j':
+			jsonName = optarg;
+			break;
+
+			case 'm':
+			costName = optarg;
+			break;
+
+			case 'G':
+			specText = optarg;
+			break;
+
+			case 'e':
+			exportName = optarg;
+			break;
+
+			case 'T':
+			timelineName = optarg;
+			break;
+
 			default:
 			return false;
 		}
     }
 
+	// a generated scene has no input file, and needs no output file
+	// either when it is only being written out
+	if ( specText ) {
+		rayName = specText;
+		imgName = optind < argc ? argv[optind] : NULL;
+		if ( !imgName && !exportName ) {
+			fprintf( stderr, "no output name.\n" );
+			return false;
+		}
+		return true;
+	}
+
     if ( optind >= argc-1 )
     {
 		fprintf( stderr, "no input and/or output name.\n" );
@@ -141,6 +237,109 @@ bool processArgs(int argc, char **argv) {
 	return true;
 }
 
+// The output file for one frame of an animation: the output name used as a
+// printf format if it has a %d in it, or else with the frame number added
+// before the extension.
+void frameName(char *out, size_t size, int frame)
+{
+	if ( strchr( imgName, '%' ) ) {
+		snprintf( out, size, imgName, frame );
+		return;
+	}
+
+	const char *dot = strrchr( imgName, '.' );
+	int stem = dot ? (int)(dot - imgName) : (int)strlen( imgName );
+	snprintf( out, size, "%.*s%04d%s", stem, imgName, frame, dot ? dot : "" );
+}
+
+// name with suffix put in place of its extension
+void siblingName(char *out, size_t size, const char *name, const char *suffix)
+{
+	const char *dot = strrchr( name, '.' );
+	int stem = dot ? (int)(dot - name) : (int)strlen( name );
+	snprintf( out, size, "%.*s%s", stem, name, suffix );
+}
+
+// The cost map of the image just traced, beside the image called name.
+void writeCostMap(const char *name)
+{
+	char file[1024];
+	std::vector<unsigned char> heat;
+	theRayTracer->getCostImage(heat);
+	siblingName( file, sizeof(file), name, ".cost.bmp" );
+	writeBMP( file, g_width, g_height, &heat[0] );
+
+	siblingName( file, sizeof(file), name, ".cost.pfm" );
+	if (!writePFM( file, g_width, g_height, theRayTracer->getCostBuffer() ))
+		fprintf( stderr, "cannot write %s\n", file );
+}
+
+// Rays traced per second of rendering, or 0 if they were not counted.
+double raysPerSecond(const PhaseTimes &times, const RayStats &stats)
+{
+	double t = times.seconds[PhaseTimes::RENDER];
+	return RayStats::enabled() && t > 0.0 ? stats.traced() / t : 0.0;
+}
+
+// The time each stage took, for -t.
+string timeReport(const PhaseTimes &times, const RayStats &stats)
+{
+	string s;
+	char line[256];
+	for (int p = 0; p < PhaseTimes::PHASES; ++p) {
+		snprintf( line, sizeof(line), "%-8s %9.3f seconds\n", PhaseTimes::name(p), times.seconds[p] );
+		s += line;
+	}
+	snprintf( line, sizeof(line), "total time = %.3f seconds\n", times.total() );
+	s += line;
+	if (g_tilesTraced < g_tiles) {
+		snprintf( line, sizeof(line), "%d of %d tiles traced\n", g_tilesTraced, g_tiles );
+		s += line;
+	}
+	if (RayStats::enabled()) {
+		snprintf( line, sizeof(line), "%.0f rays per second\n", raysPerSecond(times, stats) );
+		s += line + stats.report();
+	}
+	return s;
+}
+
+// s as a JSON string
+string quoted(const char *s)
+{
+	string q = "\"";
+	for ( ; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			q += '\\';
+		q += *s;
+	}
+	return q + "\"";
+}
+
+// Everything about the job that -t reports, as a JSON object for -j.
+string jobReport(const PhaseTimes &times, const RayStats &stats, int frames)
+{
+	string s = "{\n";
+	char line[256];
+	s += "  \"scene\": " + quoted(rayName) + ",\n";
+	s += "  \"image\": " + quoted(imgName) + ",\n";
+	snprintf( line, sizeof(line), "  \"width\": %d,\n  \"height\": %d,\n  \"frames\": %d,\n  \"samples\": %d,\n",
+		g_width, g_height, frames, theRayTracer->getSamples() );
+	s += line;
+	s += "  \"seconds\": {";
+	for (int p = 0; p < PhaseTimes::PHASES; ++p) {
+		snprintf( line, sizeof(line), "\"%s\": %.6f, ", PhaseTimes::name(p), times.seconds[p] );
+		s += line;
+	}
+	snprintf( line, sizeof(line), "\"total\": %.6f},\n", times.total() );
+	s += line;
+	snprintf( line, sizeof(line), "  \"tiles\": %d,\n  \"tiles_traced\": %d,\n", g_tiles, g_tilesTraced );
+	s += line;
+	snprintf( line, sizeof(line), "  \"rays_per_second\": %.0f,\n", raysPerSecond(times, stats) );
+	s += line;
+	s += "  \"stats\": " + stats.json("  ") + "\n}\n";
+	return s;
+}
+
 // usage : ray [option] in.ray out.bmp
 // Simply keying in ray will invoke a graphics mode version.
 // Use "ray --help" to see the detailed usage.
@@ -160,35 +359,110 @@ int main(int argc, char **argv) {
 		}
 		
 		theRayTracer=new RayTracer();
-		theRayTracer->loadScene(rayName);
+		if (!theRayTracer->setSampler(samplerName, g_samples)) {
+			usage();
+			exit(1);
+		}
+		if (costName && !theRayTracer->setCostMetric(costName)) {
+			usage();
+			exit(1);
+		}
+		theRayTracer->setDepth(recursion_depth);
+		theRayTracer->setPathTracing(bPathTrace);
+		if (timelineName)
+			Timeline::start();
+		if (specText) {
+			SceneSpec spec;
+			if (!spec.parse(specText)) {
+				usage();
+				exit(1);
+			}
+			string text = generateScene(spec);
+			if (exportName) {
+				FILE *f = fopen( exportName, "w" );
+				if (!f) {
+					fprintf( stderr, "cannot write %s\n", exportName );
+					exit(1);
+				}
+				fputs( text.c_str(), f );
+				fclose( f );
+			}
+			if (!imgName)
+				return 0;
+			std::istringstream is(text);
+			theRayTracer->loadScene(is);
+		} else {
+			theRayTracer->loadScene(rayName);
+		}
 	
 		if (theRayTracer->sceneLoaded()) {
+			if (animName && !theRayTracer->loadAnimation(animName))
+				exit(1);
+
 			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
 
-			theRayTracer->traceSetup(g_width, g_height);
-		
-			clock_t start, end;
-			start=clock();
+			// The scene stays loaded for the whole animation; each frame
+			// only poses it (see RayTracer::setFrame) and traces again the
+			// tiles of the one before that the new pose changed.
+			theRayTracer->setFrame(0);
+			RayStats::reset();
+			theRayTracer->buildCaustics(g_photons);
 
-			theRayTracer->traceLines(0, g_height);
-		
-			end=clock();
+			PhaseTimes &times = theRayTracer->getTimes();
+			int frames = theRayTracer->getFrameCount();
+			for (int frame = 0; frame < frames; ++frame) {
+				if (frame == 0) {
+					theRayTracer->traceSetup(g_width, g_height);
+					theRayTracer->traceTiles();
+					g_tilesTraced += theRayTracer->tileCount();
+				} else {
+					theRayTracer->setFrame(frame);
+					g_tilesTraced += theRayTracer->traceDirtyTiles();
+				}
+				g_tiles += theRayTracer->tileCount();
+				if (bDenoise)
+					theRayTracer->denoise();
 
-			// save image
-			unsigned char* buf;
+				// save image
+				unsigned char* buf;
 
-			theRayTracer->getBuffer(buf, g_width, g_height);
-			if (buf)
-				writeBMP(imgName, g_width, g_height, buf); 
+				Stopwatch watch;
+				theRayTracer->getBuffer(buf, g_width, g_height);
+				if (buf) {
+					char name[1024];
+					if (animName)
+						frameName(name, sizeof(name), frame);
+					else
+						snprintf(name, sizeof(name), "%s", imgName);
+					writeBMP(name, g_width, g_height, buf);
+					if (theRayTracer->getCostMetric() != COST_NONE)
+						writeCostMap(name);
+				}
+				times.add(PhaseTimes::OUTPUT, watch);
+			}
 
+			RayStats stats = RayStats::total();
 			if (bReport) {
-				double t=(double)(end-start)/CLOCKS_PER_SEC;
+				string report = timeReport(times, stats);
 #ifdef WIN32
-				fl_message( "total time = %.3f seconds\n", t); 
+				fl_message( "%s", report.c_str() ); 
 #else
-				fprintf( stderr, "total time = %.3f seconds\n", t); 
+				fputs( report.c_str(), stderr ); 
 #endif
 			}
+
+			if (jsonName) {
+				FILE *f = fopen( jsonName, "w" );
+				if (f) {
+					fputs( jobReport(times, stats, frames).c_str(), f );
+					fclose( f );
+				} else {
+					fprintf( stderr, "cannot write %s\n", jsonName );
+				}
+			}
+
+			if (timelineName && !Timeline::write( timelineName ))
+				fprintf( stderr, "cannot write %s\n", timelineName );
 		}
 
 		return 1;
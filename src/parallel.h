@@ -0,0 +1,46 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// The number of threads worth starting for parallel work.
+inline int workerCount()
+{
+	int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+// Calls body(i) once for every i in [begin, end), handing the indices out
+// one at a time to workerCount() threads (the calling thread is one of
+// them).  Different calls must not write to the same data.
+template <class Body>
+void parallelFor(int begin, int end, const Body &body)
+{
+	int threads = workerCount();
+	if (end - begin < threads)
+		threads = end - begin;
+
+	if (threads <= 1)
+	{
+		for (int i = begin; i < end; ++i)
+			body(i);
+		return;
+	}
+
+	std::atomic<int> next(begin);
+	auto work = [&]() {
+		for (int i = next++; i < end; i = next++)
+			body(i);
+	};
+
+	std::vector<std::thread> pool;
+	for (int t = 1; t < threads; ++t)
+		pool.push_back(std::thread(work));
+	work();
+	for (size_t t = 0; t < pool.size(); ++t)
+		pool[t].join();
+}
+
+#endif // __PARALLEL_H__
@@ -0,0 +1,161 @@
+#include "animation.h"
+#include "scene.h"
+
+void Animation::addKey(const string &target, const string &channel, int frame, const vector<double> &values)
+{
+	Track *track = NULL;
+	for (size_t t = 0; t < tracks.size(); ++t)
+	{
+		if (tracks[t].target == target && tracks[t].channel == channel)
+			track = &tracks[t];
+	}
+	if (!track)
+	{
+		tracks.push_back(Track());
+		track = &tracks.back();
+		track->target = target;
+		track->channel = channel;
+	}
+
+	Key key;
+	key.frame = frame;
+	key.values = values;
+
+	// keep the keys sorted; a second key at the same frame replaces the first
+	vector<Key>::iterator k = track->keys.begin();
+	while (k != track->keys.end() && k->frame < frame)
+		++k;
+	if (k != track->keys.end() && k->frame == frame)
+		*k = key;
+	else
+		track->keys.insert(k, key);
+}
+
+int Animation::getFrameCount() const
+{
+	if (frames > 0)
+		return frames;
+
+	int last = -1;
+	for (size_t t = 0; t < tracks.size(); ++t)
+		last = max(last, tracks[t].keys.back().frame);
+	return last + 1;
+}
+
+vector<string> Animation::getNodeNames() const
+{
+	vector<string> names;
+	for (size_t t = 0; t < tracks.size(); ++t)
+	{
+		const string &target = tracks[t].target;
+		if (target != "camera" && find(names.begin(), names.end(), target) == names.end())
+			names.push_back(target);
+	}
+	return names;
+}
+
+vector<double> Animation::Track::at(int frame) const
+{
+	if (frame <= keys.front().frame)
+		return keys.front().values;
+	if (frame >= keys.back().frame)
+		return keys.back().values;
+
+	size_t k = 1;
+	while (keys[k].frame < frame)
+		++k;
+
+	const Key &a = keys[k - 1];
+	const Key &b = keys[k];
+	double s = double(frame - a.frame) / double(b.frame - a.frame);
+
+	vector<double> v(a.values.size());
+	for (size_t c = 0; c < v.size(); ++c)
+		v[c] = a.values[c] + s * (b.values[c] - a.values[c]);
+	return v;
+}
+
+const Animation::Track *Animation::findTrack(const string &target, const string &channel) const
+{
+	for (size_t t = 0; t < tracks.size(); ++t)
+	{
+		if (tracks[t].target == target && tracks[t].channel == channel)
+			return &tracks[t];
+	}
+	return NULL;
+}
+
+bool Animation::movesCamera() const
+{
+	for (size_t t = 0; t < tracks.size(); ++t)
+	{
+		if (tracks[t].target == "camera")
+			return true;
+	}
+	return false;
+}
+
+bool Animation::apply(Scene *scene, int frame, vector<TransformNode *> *changed) const
+{
+	bool moved = false;
+
+	vector<string> names = getNodeNames();
+	for (size_t n = 0; n < names.size(); ++n)
+	{
+		const vector<TransformNode *> *nodes = scene->findNodes(names[n]);
+		if (!nodes)
+			continue;
+
+		mat4f xform;
+		const Track *t;
+		if ((t = findTrack(names[n], "translate")) != NULL)
+		{
+			vector<double> v = t->at(frame);
+			xform = xform * mat4f::translate(vec3f(v[0], v[1], v[2]));
+		}
+		if ((t = findTrack(names[n], "rotate")) != NULL)
+		{
+			vector<double> v = t->at(frame);
+			xform = xform * mat4f::rotate(vec3f(v[0], v[1], v[2]), v[3]);
+		}
+		if ((t = findTrack(names[n], "scale")) != NULL)
+		{
+			vector<double> v = t->at(frame);
+			xform = xform * mat4f::scale(vec3f(v[0], v[1], v[2]));
+		}
+
+		for (size_t k = 0; k < nodes->size(); ++k)
+		{
+			if (changed && !((*nodes)[k]->getLocalXform() == xform))
+				changed->push_back((*nodes)[k]);
+			(*nodes)[k]->setLocalXform(xform);
+		}
+		moved = true;
+	}
+
+	Camera *camera = scene->getCamera();
+	const Track *t;
+	if ((t = findTrack("camera", "position")) != NULL)
+	{
+		vector<double> v = t->at(frame);
+		camera->setEye(vec3f(v[0], v[1], v[2]));
+	}
+	if ((t = findTrack("camera", "fov")) != NULL)
+		camera->setFOV(t->at(frame)[0]);
+	if ((t = findTrack("camera", "aperture")) != NULL)
+		camera->setAperture(t->at(frame)[0]);
+	if ((t = findTrack("camera", "focal_distance")) != NULL)
+		camera->setFocalDistance(t->at(frame)[0]);
+
+	// the reader only accepts the view and up directions together
+	const Track *view = findTrack("camera", "viewdir");
+	const Track *up = findTrack("camera", "updir");
+	if (view && up)
+	{
+		vector<double> v = view->at(frame);
+		vector<double> u = up->at(frame);
+		camera->setLook(vec3f(v[0], v[1], v[2]).normalize(), vec3f(u[0], u[1], u[2]).normalize());
+	}
+
+	return moved;
+}
@@ -0,0 +1,75 @@
+//
+// animation.h
+//
+// Keyframed animation of a loaded scene: the transforms of named nodes and
+// the camera, interpolated linearly between keys.
+//
+
+#ifndef __ANIMATION_H__
+#define __ANIMATION_H__
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class Scene;
+class TransformNode;
+
+// Every animated value is a channel of a target.  The targets are named
+// transform nodes, whose channels are "translate" (x, y, z), "rotate"
+// (axis x, y, z, angle in radians) and "scale" (x, y, z), and "camera",
+// whose channels are "position", "viewdir", "updir", "fov", "aperture"
+// and "focal_distance".
+class Animation
+{
+public:
+	Animation()
+		: frames(0) {}
+
+	// Set the given channel of target to values at frame.
+	void addKey(const string &target, const string &channel, int frame, const vector<double> &values);
+
+	// The number of frames to render: as set, or else enough to reach the
+	// last key.
+	void setFrameCount(int n) { frames = n; }
+	int getFrameCount() const;
+
+	// The names of the transform nodes that are animated.
+	vector<string> getNodeNames() const;
+
+	// Pose the scene as it is at frame.  The transform of every node with
+	// an animated name becomes its translation times its rotation times its
+	// scale, with channels that have no keys left as the identity.  Returns
+	// true if any node was moved, in which case the scene has to be
+	// refitted before tracing; the nodes whose transform is not what it
+	// was are added to changed if it is given.
+	bool apply(Scene *scene, int frame, vector<TransformNode *> *changed = NULL) const;
+
+	// does any track move the camera?
+	bool movesCamera() const;
+
+private:
+	struct Key
+	{
+		int frame;
+		vector<double> values;
+	};
+
+	struct Track
+	{
+		string target;
+		string channel;
+		vector<Key> keys; // in frame order
+
+		// the value at frame, holding the first and last keys outside them
+		vector<double> at(int frame) const;
+	};
+
+	const Track *findTrack(const string &target, const string &channel) const;
+
+	vector<Track> tracks;
+	int frames;
+};
+
+#endif // __ANIMATION_H__
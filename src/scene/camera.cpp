@@ -7,6 +7,8 @@ Camera::Camera()
 {
     aspectRatio = 1;
     normalizedHeight = 1;
+    aperture = 0;
+    focalDistance = 1;
     
     eye = vec3f(0,0,0);
     u = vec3f( 1,0,0 );
@@ -15,7 +17,7 @@ Camera::Camera()
 }
 
 void
-Camera::rayThrough( double x, double y, ray &r )
+Camera::rayThrough( double x, double y, ray &r ) const
 // Ray through normalized window point x,y.  In normalized coordinates
 // the camera's x and y vary both vary from 0 to 1.
 {
@@ -25,6 +27,64 @@ Camera::rayThrough( double x, double y, ray &r )
     r = ray( eye, dir.normalize() );
 }
 
+void
+Camera::rayThrough( double x, double y, double lensU, double lensV, ray &r ) const
+// Thin lens version of the above: the ray leaves from the point of the
+// lens picked by lensU,lensV (both in [0,1)) and passes through the point
+// that the pinhole ray hits on the plane in focus.
+{
+    if( aperture <= 0.0 ) {
+        rayThrough( x, y, r );
+        return;
+    }
+
+    x -= 0.5;
+    y -= 0.5;
+    vec3f dir = look + x * u + y * v;
+    vec3f focus = eye + dir * focalDistance;
+
+                                // concentric map of the unit square
+                                // onto the disc, which keeps strata
+    double a = 2 * lensU - 1;
+    double b = 2 * lensV - 1;
+    double radius = 0, phi = 0;
+    if( a * a > b * b ) {
+        radius = a;
+        phi = (PI / 4) * (b / a);
+    } else if( b != 0 ) {
+        radius = b;
+        phi = (PI / 2) - (PI / 4) * (a / b);
+    }
+    radius *= aperture;
+
+    vec3f origin = eye + (radius * cos( phi )) * u.normalize()
+        + (radius * sin( phi )) * v.normalize();
+    r = ray( origin, (focus - origin).normalize() );
+}
+
+bool
+Camera::project( const vec3f &P, double &x, double &y ) const
+// The inverse of rayThrough: find the normalized window point whose ray
+// passes through P.  Returns false if P is behind the eye.  u and v need
+// not be perpendicular to look (an updir that isn't perpendicular to the
+// viewdir gives a skewed frame), so solve for the ray's coefficients
+// instead of projecting onto the axes.
+{
+    vec3f c;
+    try {
+        c = mat3f( look, u, v ).transpose().inverse() * (P - eye);
+    } catch( SingularMatrixException ) {
+        return false;
+    }
+
+    if( c[0] <= RAY_EPSILON )
+        return false;
+
+    x = c[1] / c[0] + 0.5;
+    y = c[2] / c[0] + 0.5;
+    return true;
+}
+
 void
 Camera::setEye( const vec3f &eye )
 {
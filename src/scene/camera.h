@@ -7,18 +7,29 @@ class Camera
 {
 public:
     Camera();
-    void rayThrough( double x, double y, ray &r );
+    void rayThrough( double x, double y, ray &r ) const;
+    void rayThrough( double x, double y, double lensU, double lensV, ray &r ) const;
+    bool project( const vec3f &P, double &x, double &y ) const;
     void setEye( const vec3f &eye );
     void setLook( double, double, double, double );
     void setLook( const vec3f &viewDir, const vec3f &upDir );
     void setFOV( double );
     void setAspectRatio( double );
+    void setAperture( double radius ) { aperture = radius; }
+    void setFocalDistance( double d ) { focalDistance = d; }
 
     double getAspectRatio() { return aspectRatio; }
+    const vec3f &getEye() const { return eye; }
+    const vec3f &getLook() const { return look; }
+    const vec3f &getU() const { return u; }
+    const vec3f &getV() const { return v; }
+    bool hasAperture() const { return aperture > 0.0; }
 private:
     mat3f m;                     // rotation matrix
     double normalizedHeight;    // dimensions of image place at unit dist from eye
     double aspectRatio;
+    double aperture;            // lens radius; 0 is a pinhole
+    double focalDistance;       // distance of the plane in focus
     
     void update();              // using the above three values calculate look,u,v
     
@@ -1,6 +1,9 @@
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 
 #include "light.h"
+#include "raystats.h"
 
 #define PI 3.1415926
 #define max(a, b) ((a) > (b) ? (a) : (b))
@@ -12,39 +15,10 @@ double DirectionalLight::distanceAttenuation(const vec3f &P) const
 	return 1.0;
 }
 
-vec3f DirectionalLight::shadowAttenuation(const vec3f &P) const
+vec3f DirectionalLight::shadowAttenuation(const RayOrigin &from, double time) const
 {
-	// YOUR CODE HERE:
-	// You should implement shadow-handling code here.
-
-	vec3f d = getDirection(P);
-	vec3f attenuation = {1, 1, 1};
-
-	isect i;
-	ray r = ray(P, d);
-
-	vec3f tempP = P;
-	ray tempr(r);
-
-	// recursively to find intersection
-	while (scene->intersect(tempr, i))
-	{
-		// If the shadow ray intersects an object in the scene
-
-		// If the material is opaque, return zero attenuation (full shadow)
-		if (i.getMaterial().kt.iszero())
-			return vec3f(0, 0, 0);
-
-		// Speed up the process by setting a threshold
-		double threshold = 4e-2;
-		if (attenuation[0] < threshold && attenuation[1] < threshold && attenuation[2] < threshold)
-			return vec3f(0, 0, 0);
-
-		tempP = tempr.at(i.t);
-		tempr = ray(tempP, d);
-		attenuation = attenuation.elementwiseMultiply(i.getMaterial().kt);
-	}
-	return attenuation;
+	// the light is infinitely far away, so anything along the ray is in front of it
+	return transmission(from, getDirection(from.P), DBL_MAX, time);
 }
 
 vec3f DirectionalLight::getColor(const vec3f &P) const
@@ -58,6 +32,13 @@ vec3f DirectionalLight::getDirection(const vec3f &P) const
 	return -orientation;
 }
 
+void DirectionalLight::compile(LightRecord &rec) const
+{
+	Light::compile(rec);
+	rec.type = LightRecord::DIRECTIONAL;
+	rec.position = -orientation;
+}
+
 double PointLight::distanceAttenuation(const vec3f &P) const
 {
 	// YOUR CODE HERE
@@ -80,37 +61,31 @@ vec3f PointLight::getDirection(const vec3f &P) const
 	return (position - P).normalize();
 }
 
-vec3f PointLight::shadowAttenuation(const vec3f &P) const
+void PointLight::compile(LightRecord &rec) const
+{
+	Light::compile(rec);
+	rec.type = LightRecord::POINT;
+	rec.position = position;
+	rec.a = constant_attenuation_coeff;
+	rec.b = linear_attenuation_coeff;
+	rec.c = quadratic_attenuation_coeff;
+}
+
+vec3f PointLight::shadowAttenuation(const RayOrigin &from, double time) const
 {
 	// YOUR CODE HERE:
 	// You should implement shadow-handling code here.
 
+	const vec3f &P = from.P;
 	double distance = (position - P).length();
 	vec3f d = getDirection(P).normalize();
-	ray r = ray(P, d);
-	vec3f attenuation = {1, 1, 1};
-
-	isect i;
-
-	vec3f tempP = P;
-	ray tempr(r);
-
-	while (scene->intersect(tempr, i))
-	{
-		// intersection behind the light
-		if ((distance -= i.t) < RAY_EPSILON)
-			return attenuation;
-		// if the material is not transparent, return black
-		if (i.getMaterial().kt.iszero())
-			return vec3f(0, 0, 0);
-		tempP = tempr.at(i.t);
-		tempr = ray(tempP, d);
-		attenuation = attenuation.elementwiseMultiply(i.getMaterial().kt);
-	}
-	return attenuation;
+	return transmission(from, d, distance, time);
 }
 
 // add spot light here
+SpotLight::SpotLight(Scene *scene, const vec3f &pos, const vec3f &color, const vec3f &orien, double theta, double p, double a, double b, double c)
+	: Light(scene, color), position(pos), orientation(orien), constant_attenuation_coeff(a), linear_attenuation_coeff(b), quadratic_attenuation_coeff(c), coneangle(theta), focus_constant(p), cosCone(cos(theta * PI / 180.0)) {}
+
 vec3f SpotLight::getColor(const vec3f &P) const
 {
 	return color;
@@ -121,56 +96,443 @@ vec3f SpotLight::getDirection(const vec3f &P) const
 	return (position - P).normalize();
 }
 
-vec3f SpotLight::shadowAttenuation(const vec3f &P) const
+// The cone and the Warn model are worked out where shading does them.
+vec3f SpotLight::shadowAttenuation(const RayOrigin &from, double time) const
 {
-	vec3f L = (P - position).normalize();
-	double coslambda = max(0, L.dot(orientation));
-	double boundary = cos(coneangle * PI / 180.0);
-	// outside the focus of the spotlight, no shadow cast at all
-	if (coslambda < boundary)
-		return vec3f(1, 1, 1);
-	double distance = (position - P).length();
-	vec3f d = (position - P).normalize();
-	ray r(P, d);
+	LightRecord rec;
+	compile(rec);
+	LightSample s;
+	evaluateLight(rec, from.P, s);
+	return shadowLight(rec, from, s, time);
+}
+
+double SpotLight::distanceAttenuation(const vec3f &P) const
+{
+	LightRecord rec;
+	compile(rec);
+	LightSample s;
+	evaluateLight(rec, P, s);
+	return s.atten;
+}
+
+void SpotLight::compile(LightRecord &rec) const
+{
+	Light::compile(rec);
+	rec.type = LightRecord::SPOT;
+	rec.position = position;
+	rec.orientation = orientation;
+	rec.a = constant_attenuation_coeff;
+	rec.b = linear_attenuation_coeff;
+	rec.c = quadratic_attenuation_coeff;
+	rec.cosCone = cosCone;
+	rec.focus = focus_constant;
+}
+
+void Light::compile(LightRecord &rec) const
+{
+	rec.type = LightRecord::OTHER;
+	rec.position = rec.orientation = vec3f(0, 0, 0);
+	rec.color = color;
+	rec.a = 1.0;
+	rec.b = rec.c = 0.0;
+	rec.cosCone = -1.0;
+	rec.focus = 0.0;
+	rec.light = this;
+}
+
+vec3f Light::transmission(const RayOrigin &from, const vec3f &d, double distance, double time) const
+{
+	// Each ray stops short of the light, so nothing beyond it is tested.
 	vec3f atten = {1, 1, 1};
-	vec3f tempP = P;
 	isect i;
-	ray tempr(r);
-	// recursively find intersection
-	while (scene->intersect(tempr, i))
+	ray r = spawnRay(from, d, time);
+	r.setMaxT(distance - RAY_EPSILON);
+	RAY_STAT(rays[RayStats::SHADOW]);
+	while (scene->intersect(r, i))
 	{
-		//  intersection is not before light
-		if ((distance -= i.t) < RAY_EPSILON)
-		{
-			return atten;
-		}
-		// a totally un-transparent object
 		if (i.getMaterial().kt.iszero())
 			return {0, 0, 0};
-		tempP = tempr.at(i.t);
-		tempr = ray(tempP, d);
+		distance -= i.t;
+		r = spawnRay(RayOrigin(r.at(i.t), i.N, i.obj), d, time);
+		r.setMaxT(distance - RAY_EPSILON);
+		RAY_STAT(rays[RayStats::SHADOW]);
 		atten = atten.elementwiseMultiply(i.getMaterial().kt);
 	}
 	return atten;
 }
 
-double SpotLight::distanceAttenuation(const vec3f &P) const
+vec3f Light::segmentAttenuation(const RayOrigin &from, const vec3f &Q, double time) const
+{
+	double distance = (Q - from.P).length();
+	return transmission(from, (Q - from.P) / distance, distance, time);
+}
+
+// add area lights
+// A cheap, deterministic random number in [0,1) for sample k at point P.
+// Hashing the point keeps the jitter different from one point to the next
+// without any shared state, so neighbouring pixels do not band.
+static double jitter(const vec3f &P, unsigned int k)
+{
+	unsigned int h = k * 0x9e3779b9u;
+	for (int n = 0; n < 3; n++)
+	{
+		float f = (float)P[n];
+		unsigned int bits;
+		memcpy(&bits, &f, sizeof(bits));
+		h ^= bits + 0x7f4a7c15u + (h << 6) + (h >> 2);
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return (h >> 8) * (1.0 / 16777216.0);
+}
+
+vec3f AreaLight::shadowAttenuation(const RayOrigin &from, double time) const
+{
+	const vec3f &P = from.P;
+	int n = samples;
+	int m = min(n, 3);
+	vec3f sum;
+	vec3f first;
+	bool agree = true;
+
+	// an m x m grid over the whole surface first, with jitter of its own
+	for (int ti = 0; ti < m; ti++)
+	{
+		for (int si = 0; si < m; si++)
+		{
+			unsigned int k = 2 * (n * n + si + ti * m);
+			vec3f Q = surfacePoint(P, (si + jitter(P, k)) / m, (ti + jitter(P, k + 1)) / m);
+			vec3f a = segmentAttenuation(from, Q, time);
+			if (si == 0 && ti == 0)
+				first = a;
+			else if ((a - first).length_squared() > 1e-6)
+				agree = false;
+			sum += a;
+		}
+	}
+	if (m == n)
+		return sum / (n * n);
+	if (agree)
+		return first;
+
+	// penumbra: the whole n x n grid, averaged with the rays already sent
+	for (int ti = 0; ti < n; ti++)
+	{
+		for (int si = 0; si < n; si++)
+		{
+			unsigned int k = 2 * (si + ti * n);
+			vec3f Q = surfacePoint(P, (si + jitter(P, k)) / n, (ti + jitter(P, k + 1)) / n);
+			sum += segmentAttenuation(from, Q, time);
+		}
+	}
+	return sum / (m * m + n * n);
+}
+
+double AreaLight::distanceAttenuation(const vec3f &P) const
+{
+	double distance = (position - P).length();
+	return min(1.0, 1.0 / (constant_attenuation_coeff + linear_attenuation_coeff * distance + quadratic_attenuation_coeff * distance * distance));
+}
+
+vec3f AreaLight::getColor(const vec3f &P) const
+{
+	return color;
+}
+
+vec3f AreaLight::getDirection(const vec3f &P) const
+{
+	return (position - P).normalize();
+}
+
+// The attenuation goes by the distance to the centre, whatever the shape,
+// but shadows need the whole surface.
+void AreaLight::compile(LightRecord &rec) const
+{
+	Light::compile(rec);
+	rec.type = LightRecord::AREA;
+	rec.position = position;
+	rec.a = constant_attenuation_coeff;
+	rec.b = linear_attenuation_coeff;
+	rec.c = quadratic_attenuation_coeff;
+}
+
+vec3f RectangleLight::surfacePoint(const vec3f &P, double s, double t) const
+{
+	return position + (s - 0.5) * edge1 + (t - 0.5) * edge2;
+}
+
+vec3f SphereLight::surfacePoint(const vec3f &P, double s, double t) const
+{
+	// build a frame around the direction from the light to P
+	vec3f w = (P - position).normalize();
+	vec3f a = fabs(w[0]) > 0.9 ? vec3f(0, 1, 0) : vec3f(1, 0, 0);
+	vec3f u = w.cross(a).normalize();
+	vec3f v = w.cross(u);
+
+	// map the unit square onto the disc, keeping strata equal in area
+	double r = radius * sqrt(s);
+	double phi = 2 * PI * t;
+	return position + r * cos(phi) * u + r * sin(phi) * v;
+}
+
+// The same sums, in the same order, as the lights' own functions.
+void evaluateLight(const LightRecord &rec, const vec3f &P, LightSample &s)
+{
+	s.color = rec.color;
+	switch (rec.type)
+	{
+	case LightRecord::DIRECTIONAL:
+		s.L = rec.position;
+		s.distance = 0.0;
+		s.atten = 1.0;
+		break;
+
+	case LightRecord::POINT:
+	case LightRecord::AREA:
+	{
+		vec3f v = rec.position - P;
+		s.distance = v.length();
+		s.L = v / s.distance;
+		s.atten = min(1.0, 1.0 / (rec.a + rec.b * s.distance + rec.c * s.distance * s.distance));
+		break;
+	}
+
+	case LightRecord::SPOT:
+	{
+		// the Warn model: zero outside the cone, a power of the cosine
+		// inside it
+		vec3f v = P - rec.position;
+		s.distance = v.length();
+		vec3f L = v / s.distance;
+		s.L = -L;
+		double distance_atten = min(1, 1.0 / (rec.a + rec.b * s.distance + rec.c * s.distance * s.distance));
+		double coslambda = max(0, L.dot(rec.orientation));
+		s.atten = distance_atten * (coslambda < rec.cosCone ? 0.0 : pow(coslambda, rec.focus));
+		break;
+	}
+
+	default:
+		s.L = rec.light->getDirection(P);
+		s.distance = 0.0;
+		s.atten = rec.light->distanceAttenuation(P);
+		s.color = rec.light->getColor(P);
+		break;
+	}
+}
+
+vec3f shadowLight(const LightRecord &rec, const RayOrigin &from, const LightSample &s, double time)
+{
+	switch (rec.type)
+	{
+	case LightRecord::DIRECTIONAL:
+		return rec.light->transmission(from, s.L, DBL_MAX, time);
+
+	case LightRecord::POINT:
+		return rec.light->transmission(from, s.L.normalize(), s.distance, time);
+
+	case LightRecord::SPOT:
+	{
+		// outside the focus of the spotlight, no shadow cast at all
+		double coslambda = max(0, (-s.L).dot(rec.orientation));
+		if (coslambda < rec.cosCone)
+			return vec3f(1, 1, 1);
+		return rec.light->transmission(from, s.L, s.distance, time);
+	}
+
+	default:
+		return rec.light->shadowAttenuation(from, time);
+	}
+}
+
+// The brightest channel of a light's colour.
+static double power(const LightRecord &rec)
+{
+	return max(rec.color[0], max(rec.color[1], rec.color[2]));
+}
+
+void LightTree::build(const vector<LightRecord> &all)
+{
+	lights = all.empty() ? NULL : &all[0];
+	nodes.clear();
+	unbounded.clear();
+
+	// a leaf for every light with a position
+	vector<Node> leaves;
+	vector<int> index;
+	for (int k = 0; k < (int)all.size(); k++)
+	{
+		const LightRecord &rec = all[k];
+		if (rec.type == LightRecord::DIRECTIONAL || rec.type == LightRecord::OTHER)
+		{
+			unbounded.push_back(k);
+			continue;
+		}
+
+		// The Warn term is at most 1, so a spot light falls off no
+		// slower than a point light.  Negative coefficients would let the
+		// bound fall with distance.
+		Node leaf;
+		leaf.a = max(rec.a, 0.0);
+		leaf.b = max(rec.b, 0.0);
+		leaf.c = max(rec.c, 0.0);
+		leaf.box.min = leaf.box.max = rec.position;
+		leaf.power = max(power(rec), 0.0);
+		leaf.light = leaf.rep = k;
+		leaf.second = 0;
+		index.push_back((int)leaves.size());
+		leaves.push_back(leaf);
+	}
+
+	if (!leaves.empty())
+	{
+		nodes.reserve(2 * leaves.size());
+		buildNode(0, (int)leaves.size(), index, leaves);
+	}
+}
+
+int LightTree::buildNode(int start, int end, vector<int> &index, const vector<Node> &leaves)
+{
+	int me = (int)nodes.size();
+	if (end - start == 1)
+	{
+		nodes.push_back(leaves[index[start]]);
+		return me;
+	}
+	nodes.push_back(Node());
+
+	vec3f lo = leaves[index[start]].box.min;
+	vec3f hi = lo;
+	for (int k = start + 1; k < end; k++)
+	{
+		lo = minimum(lo, leaves[index[k]].box.min);
+		hi = maximum(hi, leaves[index[k]].box.max);
+	}
+
+	int axis = 0;
+	if (hi[1] - lo[1] > hi[axis] - lo[axis])
+		axis = 1;
+	if (hi[2] - lo[2] > hi[axis] - lo[axis])
+		axis = 2;
+
+	int mid = start + (end - start) / 2;
+	nth_element(index.begin() + start, index.begin() + mid, index.begin() + end,
+				[&](int x, int y) { return leaves[x].box.min[axis] < leaves[y].box.min[axis]; });
+
+	buildNode(start, mid, index, leaves);
+	int second = buildNode(mid, end, index, leaves);
+
+	const Node &first = nodes[me + 1];
+	const Node &other = nodes[second];
+	Node &node = nodes[me];
+	node.box.min = lo;
+	node.box.max = hi;
+	node.power = first.power + other.power;
+	node.a = min(first.a, other.a);
+	node.b = min(first.b, other.b);
+	node.c = min(first.c, other.c);
+	node.light = -1;
+	node.rep = power(lights[first.rep]) >= power(lights[other.rep]) ? first.rep : other.rep;
+	node.second = second;
+	return me;
+}
+
+LightTree::Cut LightTree::cutAt(int n, const vec3f &P, const vec3f &N, double scale) const
+{
+	const Node &node = nodes[n];
+
+	// the distance from P to the node's box
+	double d2 = 0.0;
+	for (int k = 0; k < 3; k++)
+	{
+		double e = max(node.box.min[k] - P[k], P[k] - node.box.max[k]);
+		if (e > 0.0)
+			d2 += e * e;
+	}
+	double d = sqrt(d2);
+	double falloff = node.a + node.b * d + node.c * d2;
+
+	// the representative as a diffuse light, without shadows
+	LightSample rep;
+	evaluateLight(lights[node.rep], P, rep);
+	double cosine = max(0.0, N.dot(rep.L));
+
+	Cut cut;
+	cut.node = n;
+	cut.bound = scale * node.power * (falloff > 1.0 ? 1.0 / falloff : 1.0);
+	cut.estimate = scale * node.power * rep.atten * cosine;
+	return cut;
+}
+
+void LightTree::select(const vec3f &P, const vec3f &N, double scale, double cutoff, double error,
+					   vector<LightChoice> &selected) const
 {
-	// distance attenuation here contains the Warn Model as well
-	double d = (P - position).length();
-	double distance_atten = min(1, 1.0 / (constant_attenuation_coeff + linear_attenuation_coeff * d + quadratic_attenuation_coeff * d * d));
-	vec3f L = (P - position).normalize();
-	double warn_atten = 1.0;
-	double coslambda = max(0, L.dot(orientation));
-	double boundary = cos(coneangle * PI / 180.0);
-	if (coslambda < boundary)
+	selected.clear();
+	for (size_t k = 0; k < unbounded.size(); k++)
 	{
-		// the particle is outside boundary
-		warn_atten = 0.0;
+		LightChoice choice = {unbounded[k], 1.0};
+		selected.push_back(choice);
 	}
-	else
+	if (nodes.empty())
+		return;
+
+	// what may still be left out at P, and the light found there so far
+	double budget = cutoff;
+	double total = 0.0;
+
+	// a heap with the biggest bound on top
+	static thread_local vector<Cut> cut;
+	cut.clear();
+	cut.push_back(cutAt(0, P, N, scale));
+	total = cut[0].estimate;
+
+	while (!cut.empty())
 	{
-		warn_atten = pow(coslambda, focus_constant);
+		pop_heap(cut.begin(), cut.end());
+		Cut top = cut.back();
+		cut.pop_back();
+		const Node &node = nodes[top.node];
+
+		if (top.bound <= budget)
+		{
+			budget -= top.bound;
+			total -= top.estimate;
+			continue;
+		}
+
+		if (node.light >= 0)
+		{
+			// a spot light cannot reach outside its cone
+			const LightRecord &rec = lights[node.light];
+			LightSample s;
+			if (rec.type == LightRecord::SPOT)
+				evaluateLight(rec, P, s);
+			if (rec.type != LightRecord::SPOT || s.atten != 0.0)
+			{
+				LightChoice choice = {node.light, 1.0};
+				selected.push_back(choice);
+			}
+			continue;
+		}
+
+		if (top.bound <= error * total)
+		{
+			LightChoice choice = {node.rep, node.power / power(lights[node.rep])};
+			selected.push_back(choice);
+			continue;
+		}
+
+		Cut first = cutAt(top.node + 1, P, N, scale);
+		Cut second = cutAt(node.second, P, N, scale);
+		total += first.estimate + second.estimate - top.estimate;
+		cut.push_back(first);
+		push_heap(cut.begin(), cut.end());
+		cut.push_back(second);
+		push_heap(cut.begin(), cut.end());
 	}
-	return distance_atten * warn_atten;
-}
\ No newline at end of file
+
+	sort(selected.begin(), selected.end(),
+		 [](const LightChoice &x, const LightChoice &y) { return x.light < y.light; });
+}
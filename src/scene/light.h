@@ -7,15 +7,30 @@ class Light
 	: public SceneElement
 {
 public:
-	virtual vec3f shadowAttenuation(const vec3f &P) const = 0;
+	virtual vec3f shadowAttenuation(const RayOrigin &from, double time) const = 0;
 	virtual double distanceAttenuation(const vec3f &P) const = 0;
 	virtual vec3f getColor(const vec3f &P) const = 0;
 	virtual vec3f getDirection(const vec3f &P) const = 0;
 
+	// added for photon mapping: where the light's photons leave from;
+	// returns false for a light at infinity
+	virtual bool getPosition(vec3f &pos) const { return false; }
+
+	// Describe the light for shading; see LightRecord.  By default it is
+	// one of the OTHER lights.
+	virtual void compile(LightRecord &rec) const;
+
+	// how much light gets through from from.P along the unit direction d to
+	// a distance of at most distance
+	vec3f transmission(const RayOrigin &from, const vec3f &d, double distance, double time) const;
+
 protected:
 	Light(Scene *scene, const vec3f &col)
 		: SceneElement(scene), color(col) {}
 
+	// how much light gets from Q to from.P through whatever lies between them
+	vec3f segmentAttenuation(const RayOrigin &from, const vec3f &Q, double time) const;
+
 	vec3f color;
 };
 
@@ -25,10 +40,11 @@ class DirectionalLight
 public:
 	DirectionalLight(Scene *scene, const vec3f &orien, const vec3f &color)
 		: Light(scene, color), orientation(orien) {}
-	virtual vec3f shadowAttenuation(const vec3f &P) const;
+	virtual vec3f shadowAttenuation(const RayOrigin &from, double time) const;
 	virtual double distanceAttenuation(const vec3f &P) const;
 	virtual vec3f getColor(const vec3f &P) const;
 	virtual vec3f getDirection(const vec3f &P) const;
+	virtual void compile(LightRecord &rec) const;
 
 protected:
 	vec3f orientation;
@@ -40,10 +56,16 @@ class PointLight
 public:
 	PointLight(Scene *scene, const vec3f &pos, const vec3f &color, double a = 0.25, double b = 0.01, double c = 0.01)
 		: Light(scene, color), position(pos), constant_attenuation_coeff(a), linear_attenuation_coeff(b), quadratic_attenuation_coeff(c) {}
-	virtual vec3f shadowAttenuation(const vec3f &P) const;
+	virtual vec3f shadowAttenuation(const RayOrigin &from, double time) const;
 	virtual double distanceAttenuation(const vec3f &P) const;
 	virtual vec3f getColor(const vec3f &P) const;
 	virtual vec3f getDirection(const vec3f &P) const;
+	virtual void compile(LightRecord &rec) const;
+	virtual bool getPosition(vec3f &pos) const
+	{
+		pos = position;
+		return true;
+	}
 
 protected:
 	vec3f position;
@@ -55,17 +77,88 @@ class SpotLight
 	: public Light
 {
 public:
-	SpotLight(Scene *scene, const vec3f &pos, const vec3f &color, const vec3f &orien, double theta, double p, double a = 0.25, double b = 0.01, double c = 0.01)
-		: Light(scene, color), position(pos), orientation(orien), coneangle(theta), focus_constant(p), constant_attenuation_coeff(a), linear_attenuation_coeff(b), quadratic_attenuation_coeff(c) {}
-	virtual vec3f shadowAttenuation(const vec3f &P) const;
+	SpotLight(Scene *scene, const vec3f &pos, const vec3f &color, const vec3f &orien, double theta, double p, double a = 0.25, double b = 0.01, double c = 0.01);
+	virtual vec3f shadowAttenuation(const RayOrigin &from, double time) const;
 	virtual double distanceAttenuation(const vec3f &P) const;
 	virtual vec3f getColor(const vec3f &P) const;
 	virtual vec3f getDirection(const vec3f &P) const;
+	virtual void compile(LightRecord &rec) const;
+	virtual bool getPosition(vec3f &pos) const
+	{
+		pos = position;
+		return true;
+	}
 
 protected:
 	vec3f position, orientation;
 	double constant_attenuation_coeff, linear_attenuation_coeff, quadratic_attenuation_coeff;
 	double coneangle, focus_constant;
+	double cosCone; // the cosine of coneangle, which is in degrees
+};
+
+// add area lights
+// An area light shades like a point light at its centre, but its shadows
+// are soft: shadowAttenuation is the fraction of the light's surface that
+// can be seen from P.  The surface is divided into samples x samples
+// strata and one jittered shadow ray is sent into each.  A coarse grid of
+// at most 3 x 3 strata spread over the whole surface is tried first, and
+// if its rays all agree P is taken to be fully lit (or fully shadowed)
+// without paying for the rest; only points in the penumbra get the whole
+// grid too.  One sample is a single ray.
+class AreaLight
+	: public Light
+{
+public:
+	virtual vec3f shadowAttenuation(const RayOrigin &from, double time) const;
+	virtual double distanceAttenuation(const vec3f &P) const;
+	virtual vec3f getColor(const vec3f &P) const;
+	virtual vec3f getDirection(const vec3f &P) const;
+	virtual void compile(LightRecord &rec) const;
+	virtual bool getPosition(vec3f &pos) const
+	{
+		pos = position;
+		return true;
+	}
+
+protected:
+	AreaLight(Scene *scene, const vec3f &pos, const vec3f &color, int samples, double a, double b, double c)
+		: Light(scene, color), position(pos), samples(samples < 1 ? 1 : samples), constant_attenuation_coeff(a), linear_attenuation_coeff(b), quadratic_attenuation_coeff(c) {}
+
+	// the point of the light's surface at (s,t) in the unit square, as seen from P
+	virtual vec3f surfacePoint(const vec3f &P, double s, double t) const = 0;
+
+	vec3f position;
+	int samples;
+	double constant_attenuation_coeff, linear_attenuation_coeff, quadratic_attenuation_coeff;
+};
+
+// A parallelogram centred on pos, spanned by the two edge vectors.
+class RectangleLight
+	: public AreaLight
+{
+public:
+	RectangleLight(Scene *scene, const vec3f &pos, const vec3f &color, const vec3f &edge1, const vec3f &edge2, int samples = 8, double a = 0.25, double b = 0.01, double c = 0.01)
+		: AreaLight(scene, pos, color, samples, a, b, c), edge1(edge1), edge2(edge2) {}
+
+protected:
+	virtual vec3f surfacePoint(const vec3f &P, double s, double t) const;
+
+	vec3f edge1, edge2;
+};
+
+// A ball of the given radius centred on pos.  From any point it looks like
+// a disc facing that point, so that is what gets sampled.
+class SphereLight
+	: public AreaLight
+{
+public:
+	SphereLight(Scene *scene, const vec3f &pos, const vec3f &color, double radius, int samples = 8, double a = 0.25, double b = 0.01, double c = 0.01)
+		: AreaLight(scene, pos, color, samples, a, b, c), radius(radius) {}
+
+protected:
+	virtual vec3f surfacePoint(const vec3f &P, double s, double t) const;
+
+	double radius;
 };
 
 #endif // __LIGHT_H__
@@ -1,9 +1,7 @@
 #include "ray.h"
 #include "material.h"
 #include "light.h"
-
-typedef list<Light *>::iterator liter;
-typedef list<Light *>::const_iterator const_liter;
+#include "photonmap.h"
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
@@ -21,26 +19,60 @@ vec3f Material::shade(Scene *scene, const ray &r, const isect &i) const
 	// You will need to call both distanceAttenuation() and shadowAttenuation()
 	// somewhere in your code in order to compute shadows and bum?light falloff.
 
-	vec3f I = ke + ka.elementwiseMultiply(scene->ambient_light);
+	return shade(scene, r, i, directLight(scene, r, i));
+}
+
+vec3f Material::shade(Scene *scene, const ray &r, const isect &i, const vec3f &direct) const
+{
+	return ke + ka.elementwiseMultiply(scene->ambient_light) + direct + causticLight(scene, r, i);
+}
+
+vec3f Material::directLight(Scene *scene, const ray &r, const isect &i) const
+{
+	vec3f I;
 	vec3f P = r.at(i.t);
 	vec3f N = i.N;
 	vec3f V = -r.getDirection();
 
-	for (const_liter it = scene->beginLights(); it != scene->endLights(); ++it)
+	// only the lights that can make a visible difference at P
+	static thread_local vector<LightChoice> selected;
+	double scale = max(kd[0] + ks[0], max(kd[1] + ks[1], kd[2] + ks[2]));
+	scene->selectLights(P, N, scale, selected);
+
+	for (size_t k = 0; k < selected.size(); ++k)
 	{
-		vec3f shadow_attenuation = (*it)->shadowAttenuation(P);
-		double distance_attenuation = (*it)->distanceAttenuation(P);
-		vec3f all_attentuation = distance_attenuation * shadow_attenuation;
+		const LightRecord &light = scene->getLightRecord(selected[k].light);
+		LightSample s;
+		evaluateLight(light, P, s);
 
-		vec3f L = (*it)->getDirection(P);
+		vec3f L = s.L;
 		vec3f R = (2 * (N.dot(L)) * N - L).normalize();
 
 		vec3f diffuse = kd * max(0.0, N.dot(L));
 		// refer to https://course.cse.ust.hk/comp4411/Password_Only/projects/trace02/morehelp.html, multiply the shininess by 128
 		vec3f specular = ks * pow(max(0.0, R.dot(V)), shininess * 128);
 
-		I += all_attentuation.elementwiseMultiply((*it)->getColor(P)).elementwiseMultiply(diffuse + specular);
+		// no shadow ray where the light would add nothing anyway
+		double distance_attenuation = selected[k].weight * s.atten;
+		vec3f weight = s.color.elementwiseMultiply(diffuse + specular);
+		if (distance_attenuation == 0.0 || weight.iszero())
+			continue;
+
+		vec3f shadow_attenuation = shadowLight(light, RayOrigin(P, N, i.obj), s, r.getTime());
+		vec3f all_attentuation = distance_attenuation * shadow_attenuation;
+
+		I += all_attentuation.elementwiseMultiply(s.color).elementwiseMultiply(diffuse + specular);
 	}
 
 	return I;
 }
+
+vec3f Material::causticLight(Scene *scene, const ray &r, const isect &i) const
+{
+	const PhotonMap *caustics = scene->getCaustics();
+	if (!caustics || kd.iszero())
+		return vec3f(0.0, 0.0, 0.0);
+
+	Scene::noteGather();
+	return kd.elementwiseMultiply(caustics->irradiance(r.at(i.t), i.N));
+}
@@ -32,6 +32,17 @@ public:
 
 	virtual vec3f shade( Scene *scene, const ray& r, const isect& i ) const;
 
+    // shade() for a point whose directLight() is already known
+    vec3f shade( Scene *scene, const ray& r, const isect& i, const vec3f& direct ) const;
+
+    // the diffuse and specular light that reaches i straight from the
+    // scene's lights (shade() without the emissive and ambient terms)
+    vec3f directLight( Scene *scene, const ray& r, const isect& i ) const;
+
+    // the diffuse reflection of the caustic light gathered from the
+    // scene's photon map at i (zero if it has none)
+    vec3f causticLight( Scene *scene, const ray& r, const isect& i ) const;
+
     vec3f ke;                    // emissive
     vec3f ka;                    // ambient
     vec3f ks;                    // specular
@@ -0,0 +1,509 @@
+#include <math.h>
+#include <algorithm>
+#include <thread>
+
+#include "photonmap.h"
+#include "scene.h"
+#include "light.h"
+#include "raystats.h"
+#include "../parallel.h"
+
+#define PI 3.14159265358979323846
+
+// photons are emitted, and the tree below this size is built, by one thread
+static const int CHUNK = 4096;
+
+// a photon that has bounced this often is dropped
+static const int MAX_PHOTON_BOUNCES = 16;
+
+void Photon::setPower(const vec3f &p)
+{
+	// Ward's RGBE: three mantissas sharing the exponent of the largest
+	double v = max(p[0], max(p[1], p[2]));
+	if (v < 1e-32)
+	{
+		power[0] = power[1] = power[2] = power[3] = 0;
+		return;
+	}
+
+	int e;
+	double m = frexp(v, &e) * 256.0 / v;
+	power[0] = (unsigned char)(max(p[0], 0.0) * m);
+	power[1] = (unsigned char)(max(p[1], 0.0) * m);
+	power[2] = (unsigned char)(max(p[2], 0.0) * m);
+	power[3] = (unsigned char)(e + 128);
+}
+
+vec3f Photon::getPower() const
+{
+	if (power[3] == 0)
+		return vec3f(0, 0, 0);
+
+	double f = ldexp(1.0, power[3] - (128 + 8));
+	return vec3f((power[0] + 0.5) * f, (power[1] + 0.5) * f, (power[2] + 0.5) * f);
+}
+
+void Photon::setDirection(const vec3f &d)
+{
+	int t = (int)(acos(max(-1.0, min(d[2], 1.0))) * (256.0 / PI));
+	int p = (int)(atan2(d[1], d[0]) * (256.0 / (2.0 * PI)));
+	theta = (unsigned char)min(t, 255);
+	phi = (unsigned char)(p & 255);
+}
+
+// sines and cosines of the 256 quantized angles
+struct AngleTables
+{
+	double sinTheta[256], cosTheta[256], sinPhi[256], cosPhi[256];
+
+	AngleTables()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			double t = (i + 0.5) * (PI / 256.0);
+			double p = i * (2.0 * PI / 256.0);
+			sinTheta[i] = sin(t);
+			cosTheta[i] = cos(t);
+			sinPhi[i] = sin(p);
+			cosPhi[i] = cos(p);
+		}
+	}
+};
+
+static const AngleTables &angles()
+{
+	static const AngleTables tables;
+	return tables;
+}
+
+vec3f Photon::getDirection() const
+{
+	const AngleTables &a = angles();
+	return vec3f(a.sinTheta[theta] * a.cosPhi[phi],
+				 a.sinTheta[theta] * a.sinPhi[phi],
+				 a.cosTheta[theta]);
+}
+
+PhotonMap::PhotonMap(int k, double maxDistance)
+	: heap(1), k(k), maxDistance(maxDistance)
+{
+}
+
+// A small xorshift generator; each photon gets its own, seeded from its
+// number, so that the result does not depend on which thread traced it.
+class PhotonRandom
+{
+public:
+	PhotonRandom(unsigned int seed)
+	{
+		state = seed * 0x9e3779b9u + 0x7f4a7c15u;
+		if (state == 0)
+			state = 1;
+		for (int i = 0; i < 4; ++i)
+			next();
+	}
+
+	double next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state / 4294967296.0;
+	}
+
+private:
+	unsigned int state;
+};
+
+// Photons from one light aimed at one mirror or refractive object: each
+// leaves towards the object's bounding sphere, and only those that hit
+// that object first are followed, so that no part of the scene is covered
+// by two groups.
+struct PhotonGroup
+{
+	const Light *light;
+	const SceneObject *target;
+	vec3f center;
+	double radius;
+};
+
+static vec3f perpendicular(const vec3f &w)
+{
+	vec3f a = fabs(w[0]) > 0.9 ? vec3f(0, 1, 0) : vec3f(1, 0, 0);
+	return w.cross(a).normalize();
+}
+
+static bool refractDir(const vec3f &d, const vec3f &N, double eta, vec3f &t)
+{
+	// N faces the incoming ray; eta is n_i / n_t
+	double c = -N.dot(d);
+	double k = 1.0 - eta * eta * (1.0 - c * c);
+	if (k < 0.0)
+		return false;
+	t = (eta * d + (eta * c - sqrt(k)) * N).normalize();
+	return true;
+}
+
+// Follow one photon of group g and append what it leaves on diffuse
+// surfaces to out.
+static void tracePhoton(Scene *scene, const PhotonGroup &g, double groupPhotons,
+						unsigned int seed, vector<Photon> &out)
+{
+	PhotonRandom rnd(seed);
+
+	vec3f origin, dir, power;
+	bool positional = g.light->getPosition(origin);
+	if (positional)
+	{
+		// uniformly inside the cone that holds the bounding sphere
+		vec3f w = g.center - origin;
+		double d = w.length();
+		w /= d;
+		double cosMax = d > g.radius ? sqrt(1.0 - (g.radius * g.radius) / (d * d)) : -1.0;
+
+		double cosT = 1.0 - rnd.next() * (1.0 - cosMax);
+		double sinT = sqrt(max(0.0, 1.0 - cosT * cosT));
+		double phi = 2.0 * PI * rnd.next();
+		vec3f u = perpendicular(w);
+		vec3f v = w.cross(u);
+		dir = (cosT * w + (sinT * cos(phi)) * u + (sinT * sin(phi)) * v).normalize();
+
+		power = g.light->getColor(origin + dir) * (2.0 * PI * (1.0 - cosMax) / groupPhotons);
+	}
+	else
+	{
+		// a disc across the bounding sphere, facing the light
+		dir = -g.light->getDirection(g.center).normalize();
+		vec3f u = perpendicular(dir);
+		vec3f v = dir.cross(u);
+		double r = g.radius * sqrt(rnd.next());
+		double phi = 2.0 * PI * rnd.next();
+		origin = g.center + (r * cos(phi)) * u + (r * sin(phi)) * v - dir * (2.0 * g.radius + 1.0);
+
+		power = g.light->getColor(g.center) * (PI * g.radius * g.radius / groupPhotons);
+	}
+
+	vec3f start = origin;
+	vec3f startDir = dir;
+	ray r(origin, dir);
+	double length = 0.0;
+	bool specular = false;
+
+	for (int bounce = 0; bounce < MAX_PHOTON_BOUNCES; ++bounce)
+	{
+		RAY_STAT(rays[RayStats::PHOTON]);
+		isect i;
+		if (!scene->intersect(r, i))
+			break;
+		if (bounce == 0 && i.obj != g.target)
+			break;
+
+		length += i.t;
+		const Material &m = i.getMaterial();
+		vec3f P = r.at(i.t);
+
+		if (specular && !m.kd.iszero())
+		{
+			// the light's falloff over the whole path, as if the photon
+			// had come straight from the light
+			double falloff = positional
+								 ? g.light->distanceAttenuation(start + startDir * length) * length * length
+								 : 1.0;
+
+			Photon p;
+			p.pos[0] = (float)P[0];
+			p.pos[1] = (float)P[1];
+			p.pos[2] = (float)P[2];
+			p.setPower(power * falloff);
+			p.setDirection(r.getDirection());
+			p.plane = 0;
+			out.push_back(p);
+		}
+
+		// Carry on by mirror reflection or refraction, or be absorbed.  As in
+		// the path tracer, materials with kr + kt > 1 are scaled down to pass
+		// on all of the light rather than gain some at every bounce, which
+		// leaves the photon's power divided by its chance of being followed
+		// the same for either way out.
+		double wr = (m.kr[0] + m.kr[1] + m.kr[2]) / 3;
+		double wt = (m.kt[0] + m.kt[1] + m.kt[2]) / 3;
+		double x = rnd.next() * max(1.0, wr + wt);
+
+		bool entering = r.getDirection().dot(i.N) < 0;
+		vec3f N = entering ? i.N : -i.N;
+		vec3f d = r.getDirection();
+		vec3f next;
+
+		if (x < wr)
+		{
+			next = (d - 2 * d.dot(N) * N).normalize();
+			power = power.elementwiseMultiply(m.kr / wr);
+		}
+		else if (x < wr + wt)
+		{
+			double eta = entering ? 1.0 / m.index : m.index;
+			if (!refractDir(d, N, eta, next))
+				next = (d - 2 * d.dot(N) * N).normalize();
+			power = power.elementwiseMultiply(m.kt / wt);
+		}
+		else
+		{
+			break;
+		}
+
+		specular = true;
+		r = spawnRay(RayOrigin(P, i.N, i.obj), next, 0.0);
+	}
+}
+
+void PhotonMap::build(Scene *scene, int count)
+{
+	vector<PhotonGroup> groups;
+	for (Scene::cliter l = scene->beginLights(); l != scene->endLights(); ++l)
+	{
+		for (Scene::cgiter o = scene->beginObjects(); o != scene->endObjects(); ++o)
+		{
+			const SceneObject *obj = dynamic_cast<const SceneObject *>(*o);
+			if (!obj || !obj->hasBoundingBoxCapability())
+				continue;
+
+			const Material &m = obj->getMaterial();
+			if (m.kr.iszero() && m.kt.iszero())
+				continue;
+
+			PhotonGroup g;
+			g.light = *l;
+			g.target = obj;
+			const BoundingBox &b = obj->getBoundingBox();
+			g.center = (b.min + b.max) * 0.5;
+			g.radius = (b.max - b.min).length() * 0.5 + RAY_EPSILON;
+			groups.push_back(g);
+		}
+	}
+
+	vector<Photon> photons;
+	if (!groups.empty() && count > 0)
+	{
+		int perGroup = max(1, count / (int)groups.size());
+		int chunksPerGroup = (perGroup + CHUNK - 1) / CHUNK;
+		int chunks = chunksPerGroup * (int)groups.size();
+
+		vector<vector<Photon>> found(chunks);
+		parallelFor(0, chunks, [&](int c) {
+			const PhotonGroup &g = groups[c / chunksPerGroup];
+			int first = (c % chunksPerGroup) * CHUNK;
+			int last = min(first + CHUNK, perGroup);
+			for (int n = first; n < last; ++n)
+				tracePhoton(scene, g, perGroup, (unsigned int)(c / chunksPerGroup * perGroup + n), found[c]);
+		});
+
+		size_t total = 0;
+		for (int c = 0; c < chunks; ++c)
+			total += found[c].size();
+		photons.reserve(total);
+		for (int c = 0; c < chunks; ++c)
+		{
+			photons.insert(photons.end(), found[c].begin(), found[c].end());
+			vector<Photon>().swap(found[c]);
+		}
+	}
+
+	build(photons);
+}
+
+void PhotonMap::build(vector<Photon> &photons)
+{
+	int n = (int)photons.size();
+	heap.assign(n + 1, Photon());
+	if (n == 0)
+		return;
+
+	float lo[3] = {photons[0].pos[0], photons[0].pos[1], photons[0].pos[2]};
+	float hi[3] = {lo[0], lo[1], lo[2]};
+	for (int i = 1; i < n; ++i)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			lo[a] = min(lo[a], photons[i].pos[a]);
+			hi[a] = max(hi[a], photons[i].pos[a]);
+		}
+	}
+
+	balance(&photons[0], 1, 0, n, lo, hi, workerCount());
+}
+
+// The size of the left subtree of a left-balanced tree of n nodes: every
+// level is full except the last, which is filled from the left.
+static int leftSubtreeSize(int n)
+{
+	if (n <= 1)
+		return 0;
+
+	int m = 1; // capacity of the last level
+	while (2 * m <= n)
+		m *= 2;
+
+	int last = n - (m - 1);
+	return (m / 2 - 1) + min(last, m / 2);
+}
+
+// Put the photons in [start,end) into the subtree rooted at heap[index]:
+// the median along the box's longest axis becomes the root, and the two
+// halves are balanced below it, on their own threads while there are
+// threads to spare.
+void PhotonMap::balance(Photon *photons, int index, int start, int end, const float *lo, const float *hi, int threads)
+{
+	int n = end - start;
+	if (n <= 0)
+		return;
+
+	int axis = 0;
+	if (hi[1] - lo[1] > hi[axis] - lo[axis])
+		axis = 1;
+	if (hi[2] - lo[2] > hi[axis] - lo[axis])
+		axis = 2;
+
+	int median = start + leftSubtreeSize(n);
+	std::nth_element(photons + start, photons + median, photons + end,
+					 [axis](const Photon &a, const Photon &b) { return a.pos[axis] < b.pos[axis]; });
+
+	heap[index] = photons[median];
+	heap[index].plane = (short)axis;
+
+	float split = photons[median].pos[axis];
+	float leftHi[3] = {hi[0], hi[1], hi[2]};
+	float rightLo[3] = {lo[0], lo[1], lo[2]};
+	leftHi[axis] = split;
+	rightLo[axis] = split;
+
+	if (threads > 1 && n > CHUNK)
+	{
+		std::thread left([=]() { balance(photons, 2 * index, start, median, lo, leftHi, threads / 2); });
+		balance(photons, 2 * index + 1, median + 1, end, rightLo, hi, threads - threads / 2);
+		left.join();
+	}
+	else
+	{
+		balance(photons, 2 * index, start, median, lo, leftHi, 1);
+		balance(photons, 2 * index + 1, median + 1, end, rightLo, hi, 1);
+	}
+}
+
+int PhotonMap::nearest(const vec3f &P, int k, double maxDistance, int *found, float &maxDist2) const
+{
+	// found[] is a max-heap on distance once it holds k photons, so the
+	// farthest is always at found[0] and can be swapped out
+	float dist[256];
+	if (k > 256)
+		k = 256;
+
+	int count = 0;
+	maxDist2 = (float)(maxDistance * maxDistance);
+	float p[3] = {(float)P[0], (float)P[1], (float)P[2]};
+	int n = size();
+
+	struct Pending
+	{
+		int node;
+		float d2;
+	} stack[64];
+	int top = 0;
+	stack[top].node = 1;
+	stack[top].d2 = 0.0f;
+	++top;
+
+	while (top > 0)
+	{
+		--top;
+		if (stack[top].d2 >= maxDist2)
+			continue;
+
+		for (int node = stack[top].node; node <= n;)
+		{
+			const Photon &ph = heap[node];
+			float dx = p[0] - ph.pos[0], dy = p[1] - ph.pos[1], dz = p[2] - ph.pos[2];
+			float d2 = dx * dx + dy * dy + dz * dz;
+
+			if (d2 < maxDist2)
+			{
+				if (count < k)
+				{
+					// sift up
+					int c = count++;
+					while (c > 0 && dist[(c - 1) / 2] < d2)
+					{
+						dist[c] = dist[(c - 1) / 2];
+						found[c] = found[(c - 1) / 2];
+						c = (c - 1) / 2;
+					}
+					dist[c] = d2;
+					found[c] = node;
+					if (count == k)
+						maxDist2 = dist[0];
+				}
+				else
+				{
+					// replace the farthest and sift down
+					int c = 0;
+					for (;;)
+					{
+						int child = 2 * c + 1;
+						if (child >= k)
+							break;
+						if (child + 1 < k && dist[child + 1] > dist[child])
+							++child;
+						if (dist[child] <= d2)
+							break;
+						dist[c] = dist[child];
+						found[c] = found[child];
+						c = child;
+					}
+					dist[c] = d2;
+					found[c] = node;
+					maxDist2 = dist[0];
+				}
+			}
+
+			// go down the near side, and come back for the far side if the
+			// splitting plane is close enough
+			float delta = p[ph.plane] - ph.pos[ph.plane];
+			int nearChild = delta < 0 ? 2 * node : 2 * node + 1;
+			int farChild = delta < 0 ? 2 * node + 1 : 2 * node;
+			if (farChild <= n && delta * delta < maxDist2 && top < 64)
+			{
+				stack[top].node = farChild;
+				stack[top].d2 = delta * delta;
+				++top;
+			}
+			node = nearChild;
+		}
+	}
+
+	return count;
+}
+
+vec3f PhotonMap::irradiance(const vec3f &P, const vec3f &N) const
+{
+	vec3f E;
+	if (size() == 0)
+		return E;
+
+	int found[256];
+	float maxDist2;
+	int count = nearest(P, k, maxDistance, found, maxDist2);
+	if (count == 0)
+		return E;
+
+	// only photons arriving at the front of the surface count
+	for (int i = 0; i < count; ++i)
+	{
+		const Photon &ph = heap[found[i]];
+		if (ph.getDirection().dot(N) < 0)
+			E += ph.getPower();
+	}
+
+	// with fewer than k photons in reach, they are spread over the whole
+	// search disc rather than the (possibly tiny) one they span
+	double r2 = count < k ? maxDistance * maxDistance : maxDist2;
+	return E / (PI * r2);
+}
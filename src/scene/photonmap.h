@@ -0,0 +1,75 @@
+//
+// photonmap.h
+//
+// A photon map for caustics: light that reaches a diffuse surface after
+// one or more mirror or refracted bounces, which the ray tracer itself
+// cannot find because it only looks for lights along straight lines.
+//
+
+#ifndef __PHOTONMAP_H__
+#define __PHOTONMAP_H__
+
+#include <vector>
+
+#include "../vecmath/vecmath.h"
+
+class Scene;
+
+// One stored photon, packed into 20 bytes so that a lookup touches as few
+// cache lines as possible.  The power is in Ward's shared-exponent RGBE
+// format and the incoming direction as quantized spherical angles.
+struct Photon
+{
+	float pos[3];
+	unsigned char power[4];
+	unsigned char theta, phi;
+	short plane; // splitting axis in the kd-tree
+
+	void setPower(const vec3f &p);
+	vec3f getPower() const;
+	void setDirection(const vec3f &d);
+	vec3f getDirection() const;
+};
+
+// The photons are kept in a left-balanced kd-tree stored as an implicit
+// binary heap: the root is element 1 and the children of element i are
+// 2i and 2i + 1, so the tree needs no pointers and the top levels that
+// every lookup visits sit together at the start of the array.
+class PhotonMap
+{
+public:
+	// Gathers use the k nearest photons within maxDistance of the point.
+	PhotonMap(int k, double maxDistance);
+
+	// Send count photons from the scene's lights towards its mirror and
+	// refractive objects, keep the ones that land on a diffuse surface
+	// after at least one such bounce, and build the tree.  Emission and the
+	// tree build are spread over all hardware threads.
+	void build(Scene *scene, int count);
+
+	// Store photons directly and build the tree over them.
+	void build(std::vector<Photon> &photons);
+
+	// The caustic irradiance at P on a surface with normal N, in the same
+	// units as the light colours (so kd times this is directly comparable
+	// to the diffuse term of the Phong model).
+	vec3f irradiance(const vec3f &P, const vec3f &N) const;
+
+	int size() const { return (int)heap.size() - 1; }
+
+	// The indices (into the tree, from 1) of the k nearest photons to P
+	// within maxDistance, and the squared distance of the farthest of them.
+	// Returns the number found.
+	int nearest(const vec3f &P, int k, double maxDistance, int *found, float &maxDist2) const;
+
+	const Photon &operator[](int i) const { return heap[i]; }
+
+private:
+	void balance(Photon *photons, int index, int start, int end, const float *lo, const float *hi, int threads);
+
+	std::vector<Photon> heap;
+	int k;
+	double maxDistance;
+};
+
+#endif // __PHOTONMAP_H__
@@ -7,34 +7,82 @@
 #ifndef __RAY_H__
 #define __RAY_H__
 
+#include <float.h>
+
 #include "../vecmath/vecmath.h"
 #include "material.h"
 
 class SceneObject;
 
 // A ray has a position where the ray starts, and a direction (which should
-// always be normalized!)
+// always be normalized!), and the time within the shutter interval, from 0
+// (shutter opens) to 1 (shutter closes), at which it samples the scene.
+// Only hits with t in [tMin, tMax] count; bounding volume tests narrow
+// tMax to the closest hit found so far.  For those tests the ray also keeps
+// the reciprocal of its direction, and which way it points along each axis.
+// A ray that leaves a surface where it cannot meet that surface again can
+// name the object to skip, so that nothing has to be tested against it.
 
 class ray {
 public:
-	ray( const vec3f& pp, const vec3f& dd )
-		: p( pp ), d( dd ) {}
+	ray( const vec3f& pp, const vec3f& dd, double tt = 0.0 )
+		: p( pp ), d( dd ), time( tt ), tMin( 0.0 ), tMax( DBL_MAX ), skip( NULL ) { setup(); }
 	ray( const ray& other ) 
-		: p( other.p ), d( other.d ) {}
+		: p( other.p ), d( other.d ), time( other.time ), inv( other.inv ),
+		  tMin( other.tMin ), tMax( other.tMax ), skip( other.skip )
+	{ sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2]; }
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; return *this; }
+	{
+		p = other.p; d = other.d; time = other.time; inv = other.inv;
+		sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2];
+		tMin = other.tMin; tMax = other.tMax;
+		skip = other.skip;
+		return *this;
+	}
 
 	vec3f at( double t ) const
 	{ return p + (t*d); }
 
 	vec3f getPosition() const { return p; }
 	vec3f getDirection() const { return d; }
+	double getTime() const { return time; }
+
+	// 1/d for each axis (infinite where d is zero), and 1 where d is
+	// negative, 0 where it is not
+	const vec3f& getInverseDirection() const { return inv; }
+	int getSign( int axis ) const { return sign[axis]; }
+
+	double getMinT() const { return tMin; }
+	double getMaxT() const { return tMax; }
+	void setInterval( double lo, double hi ) { tMin = lo; tMax = hi; }
+	void setMaxT( double t ) { tMax = t; }
+
+	// start the same ray from somewhere else
+	void setPosition( const vec3f& pp ) { p = pp; }
+
+	// the object the ray cannot hit, or NULL
+	const SceneObject* getSkip() const { return skip; }
+	void setSkip( const SceneObject* obj ) { skip = obj; }
 
 protected:
+	void setup()
+	{
+		for( int a = 0; a < 3; ++a ) {
+			inv[a] = 1.0 / d[a];
+			sign[a] = inv[a] < 0.0;
+		}
+	}
+
 	vec3f p;
 	vec3f d;
+	double time;
+
+	vec3f inv;
+	int sign[3];
+	double tMin, tMax;
+	const SceneObject* skip;
 };
 
 // The description of an intersection point.
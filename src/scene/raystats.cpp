@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <mutex>
+
+#include "raystats.h"
+
+static const char *rayNames[RayStats::RAY_KINDS] = {
+	"primary", "reflection", "refraction", "diffuse", "shadow", "photon"};
+static const char *primitiveNames[RayStats::PRIMITIVE_KINDS] = {
+	"sphere", "box", "triangle", "other"};
+
+// The totals of the threads that have ended.  Both are made on first use,
+// so that they are still there when the last threads end.
+static std::mutex &endedLock()
+{
+	static std::mutex lock;
+	return lock;
+}
+
+static RayStats &ended()
+{
+	static RayStats stats;
+	return stats;
+}
+
+namespace
+{
+	struct Block
+	{
+		RayStats stats;
+
+		~Block()
+		{
+			std::lock_guard<std::mutex> hold(endedLock());
+			ended().add(stats);
+		}
+	};
+
+	thread_local Block block;
+}
+
+void RayStats::clear()
+{
+	memset(this, 0, sizeof(*this));
+}
+
+void RayStats::add(const RayStats &other)
+{
+	for (int k = 0; k < RAY_KINDS; ++k)
+		rays[k] += other.rays[k];
+	hits += other.hits;
+	boxTests += other.boxTests;
+	for (int k = 0; k < PRIMITIVE_KINDS; ++k)
+	{
+		primitiveTests[k] += other.primitiveTests[k];
+		primitiveHits[k] += other.primitiveHits[k];
+	}
+	for (int d = 0; d < DEPTHS; ++d)
+		depth[d] += other.depth[d];
+	depthStops += other.depthStops;
+	thresholdStops += other.thresholdStops;
+	rouletteStops += other.rouletteStops;
+}
+
+long long RayStats::traced() const
+{
+	long long sum = 0;
+	for (int k = 0; k < RAY_KINDS; ++k)
+	{
+		if (k != PHOTON)
+			sum += rays[k];
+	}
+	return sum - depthStops - thresholdStops;
+}
+
+RayStats &RayStats::local()
+{
+	return block.stats;
+}
+
+RayStats RayStats::total()
+{
+	std::lock_guard<std::mutex> hold(endedLock());
+	RayStats sum = ended();
+	sum.add(block.stats);
+	return sum;
+}
+
+void RayStats::reset()
+{
+	std::lock_guard<std::mutex> hold(endedLock());
+	ended().clear();
+	block.stats.clear();
+}
+
+bool RayStats::enabled()
+{
+#ifdef RAY_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+// printf onto the end of s
+static void append(string &s, const char *format, ...)
+{
+	char line[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	s += line;
+}
+
+// the last depth with any rays, so that the histogram stops there
+static int deepest(const RayStats &stats)
+{
+	int last = 0;
+	for (int d = 0; d < RayStats::DEPTHS; ++d)
+	{
+		if (stats.depth[d])
+			last = d;
+	}
+	return last;
+}
+
+string RayStats::report() const
+{
+	string s;
+	long long all = 0;
+	for (int k = 0; k < RAY_KINDS; ++k)
+	{
+		append(s, "%-12s rays %14lld\n", rayNames[k], rays[k]);
+		all += rays[k];
+	}
+	append(s, "%-12s rays %14lld\n", "all", all);
+	append(s, "hits              %14lld\n", hits);
+	append(s, "bvh box tests     %14lld\n", boxTests);
+	for (int k = 0; k < PRIMITIVE_KINDS; ++k)
+		append(s, "%-8s tests %14lld  hits %14lld\n", primitiveNames[k], primitiveTests[k], primitiveHits[k]);
+	append(s, "depth stops       %14lld\n", depthStops);
+	append(s, "threshold stops   %14lld\n", thresholdStops);
+	append(s, "roulette stops    %14lld\n", rouletteStops);
+	append(s, "rays traced after each bounce:\n");
+	int last = deepest(*this);
+	for (int d = 0; d <= last; ++d)
+		append(s, "  %2d%s %14lld\n", d, d == DEPTHS - 1 ? "+" : " ", depth[d]);
+	return s;
+}
+
+string RayStats::json(const string &indent) const
+{
+	string in = indent + "  ";
+	string s = "{\n";
+	append(s, "%s\"enabled\": %s,\n", in.c_str(), enabled() ? "true" : "false");
+	s += in + "\"rays\": {";
+	for (int k = 0; k < RAY_KINDS; ++k)
+		append(s, "%s\"%s\": %lld", k ? ", " : "", rayNames[k], rays[k]);
+	s += "},\n";
+	append(s, "%s\"hits\": %lld,\n", in.c_str(), hits);
+	append(s, "%s\"box_tests\": %lld,\n", in.c_str(), boxTests);
+	s += in + "\"primitives\": {";
+	for (int k = 0; k < PRIMITIVE_KINDS; ++k)
+		append(s, "%s\"%s\": {\"tests\": %lld, \"hits\": %lld}", k ? ", " : "", primitiveNames[k], primitiveTests[k], primitiveHits[k]);
+	s += "},\n";
+	s += in + "\"depth\": [";
+	int last = deepest(*this);
+	for (int d = 0; d <= last; ++d)
+		append(s, "%s%lld", d ? ", " : "", depth[d]);
+	s += "],\n";
+	append(s, "%s\"stops\": {\"depth\": %lld, \"threshold\": %lld, \"roulette\": %lld}\n", in.c_str(), depthStops, thresholdStops, rouletteStops);
+	s += indent + "}";
+	return s;
+}
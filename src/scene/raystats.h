@@ -0,0 +1,82 @@
+//
+// raystats.h
+//
+// Counts of the work that goes into an image: the rays of each kind, the
+// bounding box and primitive tests they make, how many bounces deep they
+// go and why they stop.  Counting is built in only when RAY_STATS is
+// defined; otherwise RAY_STAT compiles to nothing and every count stays 0.
+//
+// Each thread counts into a block of its own without any locking, and the
+// block is added to the totals when the thread ends.
+//
+
+#ifndef __RAYSTATS_H__
+#define __RAYSTATS_H__
+
+#include <string>
+
+using namespace std;
+
+struct RayStats
+{
+	enum RayKind
+	{
+		PRIMARY,
+		REFLECTION,
+		REFRACTION,
+		DIFFUSE, // the path tracer's diffuse bounces
+		SHADOW,	 // each stretch between transparent objects counts
+		PHOTON,
+		RAY_KINDS
+	};
+
+	enum PrimitiveKind
+	{
+		SPHERE,
+		BOX,
+		TRIANGLE,
+		OTHER, // anything tested through Geometry::intersect
+		PRIMITIVE_KINDS
+	};
+
+	// the depth histogram's last entry takes in all deeper rays
+	static const int DEPTHS = 16;
+
+	long long rays[RAY_KINDS];					// rays made
+	long long hits;								// Scene::intersect calls that hit
+	long long boxTests;							// BVH nodes tested
+	long long primitiveTests[PRIMITIVE_KINDS];
+	long long primitiveHits[PRIMITIVE_KINDS];	// including hits beyond a nearer one
+	long long depth[DEPTHS];					// rays traced after this many bounces
+	long long depthStops;						// rays dropped at the depth limit
+	long long thresholdStops;					// ... as too faint to matter
+	long long rouletteStops;					// paths ended by Russian roulette
+
+	RayStats() { clear(); }
+	void clear();
+	void add(const RayStats &other);
+
+	// A table for people, and the same as a JSON object.  The lines of the
+	// object after the first start with indent, for nesting it in another.
+	string report() const;
+	string json(const string &indent = "") const;
+
+	// the rays that went out into the scene, photons aside
+	long long traced() const;
+
+	// The calling thread's block, and everything counted since the last
+	// reset: the blocks of threads that have ended plus the caller's own.
+	static RayStats &local();
+	static RayStats total();
+	static void reset();
+
+	static bool enabled();
+};
+
+#ifdef RAY_STATS
+#define RAY_STAT(counter) (++RayStats::local().counter)
+#else
+#define RAY_STAT(counter) ((void)0)
+#endif
+
+#endif // __RAYSTATS_H__
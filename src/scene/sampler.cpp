@@ -0,0 +1,210 @@
+#include <cmath>
+#include <vector>
+
+#include "sampler.h"
+
+// mixes the bits of a few integers into one; used to seed the per-pixel
+// scrambles
+static unsigned int mix( unsigned int a, unsigned int b, unsigned int c )
+{
+	unsigned int h = a * 0x8da6b343u ^ b * 0xd8163841u ^ c * 0xcb1ab31fu;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+static double toUnit( unsigned int x )
+{
+	return x / 4294967296.0;
+}
+
+// A pseudo-random permutation of [0,l) selected by p, evaluated one index
+// at a time (Kensler, "Correlated Multi-Jittered Sampling").
+static unsigned int permute( unsigned int i, unsigned int l, unsigned int p )
+{
+	unsigned int w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p; i *= 0xe170893du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8; i *= 0x0929eb3fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1; i *= 1 | p >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11; i *= 0x74dcb303u;
+		i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while( i >= l );
+	return (i + p) % l;
+}
+
+Sampler *Sampler::create( const string &name, int spp )
+{
+	if( name == "stratified" ) {
+		return new StratifiedSampler( spp );
+	} else if( name == "sobol" ) {
+		return new SobolSampler( spp );
+	} else if( name == "bluenoise" ) {
+		return new BlueNoiseSampler( spp );
+	}
+	return NULL;
+}
+
+StratifiedSampler::StratifiedSampler( int spp )
+	: Sampler( spp )
+{
+	n = 1;
+	while( n * n < this->spp ) {
+		++n;
+	}
+}
+
+void StratifiedSampler::sample2D( int px, int py, int index, int dim, double &u, double &v ) const
+{
+	// every further n * n samples cover the strata again in a new order
+	unsigned int cells = n * n;
+	unsigned int seed = mix( px, py, dim ) ^ mix( index / cells, 0, 0 );
+	unsigned int stratum = permute( index % cells, cells, seed );
+	unsigned int jitter = mix( seed, index, 1 );
+
+	u = ( stratum % n + toUnit( jitter ) ) / n;
+	v = ( stratum / n + toUnit( mix( jitter, index, 2 ) ) ) / n;
+}
+
+// the first two dimensions of the Sobol sequence: the base-2 radical
+// inverse, and its companion generated by x + 1
+static unsigned int sobol0( unsigned int i )
+{
+	i = (i << 16) | (i >> 16);
+	i = ((i & 0x00ff00ffu) << 8) | ((i & 0xff00ff00u) >> 8);
+	i = ((i & 0x0f0f0f0fu) << 4) | ((i & 0xf0f0f0f0u) >> 4);
+	i = ((i & 0x33333333u) << 2) | ((i & 0xccccccccu) >> 2);
+	i = ((i & 0x55555555u) << 1) | ((i & 0xaaaaaaaau) >> 1);
+	return i;
+}
+
+static unsigned int sobol1( unsigned int i )
+{
+	unsigned int r = 0;
+	for( unsigned int v = 1u << 31; i; i >>= 1, v ^= v >> 1 ) {
+		if( i & 1 ) {
+			r ^= v;
+		}
+	}
+	return r;
+}
+
+// Owen's nested uniform scramble of the bits of x, most significant
+// first: each bit is flipped or not by a hash of seed and the bits above
+// it.  Unlike XOR with a constant this is not linear, so two scrambles
+// with different seeds leave nothing in common, yet every elementary
+// interval of a net still holds the same number of points.  Hashed as in
+// Burley, "Practical Hash-based Owen Scrambling".
+static unsigned int owen( unsigned int x, unsigned int seed )
+{
+	x = sobol0( x );
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return sobol0( x );
+}
+
+// The index is scrambled too, which shuffles the order of the points
+// separately in each dimension; a run of a power of two of them, from a
+// multiple of that power, is sent to another such run, so it still makes a
+// whole net.
+static void scrambledSobol( unsigned int index, unsigned int seed, double &u, double &v )
+{
+	unsigned int i = owen( index, mix( seed, 0, 1 ) );
+	u = toUnit( owen( sobol0( i ), mix( seed, 1, 1 ) ) );
+	v = toUnit( owen( sobol1( i ), mix( seed, 2, 1 ) ) );
+}
+
+void SobolSampler::sample2D( int px, int py, int index, int dim, double &u, double &v ) const
+{
+	scrambledSobol( index, mix( px, py, dim ), u, v );
+}
+
+static const int BLUE_NOISE_SIZE = 64;
+
+// Builds a BLUE_NOISE_SIZE^2 rank table by void filling: every step ranks
+// the pixel farthest from those already ranked, measured by a Gaussian
+// energy on the torus, so that any threshold of the table gives evenly
+// spread points.  Values are in (0,1).
+static vector<double> makeBlueNoise()
+{
+	const int n = BLUE_NOISE_SIZE;
+	const int count = n * n;
+	const double sigma = 1.5;
+
+	vector<double> kernel( count );
+	for( int y = 0; y < n; ++y ) {
+		for( int x = 0; x < n; ++x ) {
+			int dx = x < n / 2 ? x : n - x;
+			int dy = y < n / 2 ? y : n - y;
+			kernel[y * n + x] = exp( -(dx * dx + dy * dy) / (2 * sigma * sigma) );
+		}
+	}
+
+	// a tiny random energy breaks the ties of the empty table
+	vector<double> energy( count );
+	vector<bool> ranked( count, false );
+	vector<double> table( count );
+	for( int k = 0; k < count; ++k ) {
+		energy[k] = 1e-6 * toUnit( mix( k, 0, 0 ) );
+	}
+
+	for( int r = 0; r < count; ++r ) {
+		int best = -1;
+		for( int k = 0; k < count; ++k ) {
+			if( !ranked[k] && ( best < 0 || energy[k] < energy[best] ) ) {
+				best = k;
+			}
+		}
+
+		ranked[best] = true;
+		table[best] = ( r + 0.5 ) / count;
+
+		int bx = best % n;
+		int by = best / n;
+		for( int y = 0; y < n; ++y ) {
+			const double *row = &kernel[( ( y - by ) & ( n - 1 ) ) * n];
+			for( int x = 0; x < n; ++x ) {
+				energy[y * n + x] += row[( x - bx ) & ( n - 1 )];
+			}
+		}
+	}
+
+	return table;
+}
+
+static double blueNoise( int x, int y )
+{
+	static const vector<double> table = makeBlueNoise();
+	return table[( y & ( BLUE_NOISE_SIZE - 1 ) ) * BLUE_NOISE_SIZE + ( x & ( BLUE_NOISE_SIZE - 1 ) )];
+}
+
+void BlueNoiseSampler::sample2D( int px, int py, int index, int dim, double &u, double &v ) const
+{
+	// the same points for every pixel (only the dimension picks the
+	// scramble), rotated by the pixel's blue-noise offsets
+	unsigned int seed = mix( dim, 0x5eed, 0 );
+	scrambledSobol( index, seed, u, v );
+
+	u += blueNoise( px + ( mix( seed, 1, 2 ) & 63 ), py + ( mix( seed, 1, 3 ) & 63 ) );
+	v += blueNoise( px + ( mix( seed, 2, 2 ) & 63 ), py + ( mix( seed, 2, 3 ) & 63 ) );
+	u -= floor( u );
+	v -= floor( v );
+}
@@ -0,0 +1,90 @@
+//
+// sampler.h
+//
+// Sample patterns for the effects that have to be integrated over a pixel:
+// antialiasing, depth of field and motion blur.
+//
+
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <string>
+
+using namespace std;
+
+// A Sampler hands out the 2D points used by the samples of a pixel.  Each
+// effect draws from its own dimension pair (see the SAMPLE_* constants), so
+// that, say, the lens position is not correlated with the position in the
+// pixel.  Patterns are scrambled per pixel so that neighbouring pixels do
+// not repeat the same error.  Samplers hold no per-pixel state and may be
+// shared between threads.
+class Sampler
+{
+public:
+	Sampler(int spp)
+		: spp(spp < 1 ? 1 : spp) {}
+	virtual ~Sampler() {}
+
+	// Sample number index of pixel (px,py) in dimension pair dim; u and v
+	// are in [0,1).  The first getSampleCount() indices are the best spread;
+	// later ones carry on with further sets of that many.
+	virtual void sample2D(int px, int py, int index, int dim, double &u, double &v) const = 0;
+
+	int getSampleCount() const { return spp; }
+
+	// "stratified", "sobol" or "bluenoise"; NULL for anything else
+	static Sampler *create(const string &name, int spp);
+
+protected:
+	int spp;
+};
+
+// the pattern the command line, the UI and ray_bench start with
+const char *const DEFAULT_SAMPLER = "sobol";
+
+// dimension pairs used by the renderer
+const int SAMPLE_PIXEL = 0;
+const int SAMPLE_LENS = 1;
+const int SAMPLE_TIME = 2;
+const int SAMPLE_BOUNCE = 3; // and up: two pairs for each bounce of a path
+
+// Jittered strata on a grid just big enough for the sample count, visited
+// in a different random order for every pixel and dimension.
+class StratifiedSampler
+	: public Sampler
+{
+public:
+	StratifiedSampler(int spp);
+	virtual void sample2D(int px, int py, int index, int dim, double &u, double &v) const;
+
+private:
+	int n; // the grid is n x n
+};
+
+// The 2D Sobol (0,2)-sequence.  Each pixel and dimension gets its own Owen
+// scramble of the points (which keeps the sequence's stratification) and
+// its own shuffle of the sample indices, so that no two dimensions are
+// correlated.
+class SobolSampler
+	: public Sampler
+{
+public:
+	SobolSampler(int spp)
+		: Sampler(spp) {}
+	virtual void sample2D(int px, int py, int index, int dim, double &u, double &v) const;
+};
+
+// The same Sobol points as above, but shifted (Cranley-Patterson rotation)
+// by offsets read from a blue-noise table that tiles the image.  The error
+// left in each pixel is then spread as high-frequency noise, which reads as
+// less noisy at a given sample count.
+class BlueNoiseSampler
+	: public SobolSampler
+{
+public:
+	BlueNoiseSampler(int spp)
+		: SobolSampler(spp) {}
+	virtual void sample2D(int px, int py, int index, int dim, double &u, double &v) const;
+};
+
+#endif // __SAMPLER_H__
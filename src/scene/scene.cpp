@@ -2,9 +2,14 @@
 
 #include "scene.h"
 #include "light.h"
+#include "photonmap.h"
+#include "raystats.h"
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
 
+// the hit record that the current thread's rays are noted in, if any
+static thread_local HitRecord *s_pHitRecord = NULL;
+
 void BoundingBox::operator=(const BoundingBox& target)
 {
 	min = target.min;
@@ -26,63 +31,109 @@ bool BoundingBox::intersects(const vec3f& point) const
 		 (point[0] - RAY_EPSILON <= max[0]) && (point[1] - RAY_EPSILON <= max[1]) && (point[2] - RAY_EPSILON <= max[2]));
 }
 
-// if the ray hits the box, put the "t" value of the intersection
-// closest to the origin in tMin and the "t" value of the far intersection
-// in tMax and return true, else return false.
-// Using Kay/Kajiya algorithm.
+// if the ray hits the box within its [tMin, tMax] interval, put the "t"
+// values where it enters and leaves the box, clipped to that interval, in
+// tMin and tMax and return true, else return false.
+// Using Kay/Kajiya slabs, with the ray's reciprocal direction: the sign of
+// the direction picks each slab's near and far planes, so there is no
+// divide and no swap.  A slab parallel to the ray gives infinite t values,
+// or NaN if the ray lies in one of its planes, and the comparisons are
+// written so that a NaN leaves the interval alone.
 bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 {
 	vec3f R0 = r.getPosition();
-	vec3f Rd = r.getDirection();
+	const vec3f& inv = r.getInverseDirection();
+
+	tMin = r.getMinT();
+	tMax = r.getMaxT();
 
-	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
-	tMax = 1.0e308;
-	double ttemp;
-	
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
 	{
-		double vd = Rd[currentaxis];
-		
-		// if the ray is parallel to the face's plane (=0.0)
-		if( vd == 0.0 )
-			continue;
+		bool negative = r.getSign(currentaxis) != 0;
+		double t1 = ((negative ? max : min)[currentaxis] - R0[currentaxis]) * inv[currentaxis];
+		double t2 = ((negative ? min : max)[currentaxis] - R0[currentaxis]) * inv[currentaxis];
 
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
-
-		// two slab intersections
-		double t1 = v1/vd;
-		double t2 = v2/vd;
-		
-		if ( t1 > t2 ) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
-		}
-
-		if (t1 > tMin)
-			tMin = t1;
-		if (t2 < tMax)
-			tMax = t2;
-
-		if (tMin > tMax) // box is missed
-			return false;
-		if (tMax < 0.0) // box is behind ray
-			return false;
+		tMin = t1 > tMin ? t1 : tMin;
+		tMax = t2 < tMax ? t2 : tMax;
 	}
-	return true; // it made it past all 3 axes.
+
+	return tMin <= tMax;
 }
 
 
 bool Geometry::intersect(const ray&r, isect&i) const
 {
-    // Transform the ray into the object's local coordinate space
-    vec3f pos = transform->globalToLocalCoords(r.getPosition());
-    vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+    // Transform the ray into the object's local coordinate space.  A moving
+    // object has travelled by the ray's share of its motion, so move the
+    // ray back by that much instead.
+    vec3f start = r.getPosition();
+    if (transform->isMoving())
+        start -= transform->getMotion() * r.getTime();
+
+    // Transformations that only move, scale or turn the object need much
+    // less than the general path at the bottom.
+    switch (transform->getKind())
+    {
+    case TransformNode::IDENTITY:
+    case TransformNode::TRANSLATE:
+    {
+        // the direction, and with it t and the normal, is unchanged
+        ray localRay( r );
+        localRay.setPosition( start - transform->getOrigin() );
+        return intersectLocal(localRay, i);
+    }
+
+    case TransformNode::SCALE:
+    {
+        const vec3f &s = transform->getScale();
+        vec3f o = transform->getOrigin();
+        vec3f d = r.getDirection();
+
+        vec3f pos( (start[0] - o[0]) / s[0], (start[1] - o[1]) / s[1], (start[2] - o[2]) / s[2] );
+        vec3f dir( d[0] / s[0], d[1] / s[1], d[2] / s[2] );
+        double length = dir.length();
+        dir /= length;
+
+        ray localRay( pos, dir, r.getTime() );
+        localRay.setInterval( r.getMinT() * length, r.getMaxT() * length );
+
+        if (!intersectLocal(localRay, i))
+            return false;
+        i.N = vec3f( i.N[0] / s[0], i.N[1] / s[1], i.N[2] / s[2] ).normalize();
+        i.t /= length;
+        return true;
+    }
+
+    case TransformNode::SIMILARITY:
+    {
+        // the inverse rotation is its transpose and keeps the direction
+        // normalized; every length shrinks by the same scale
+        double s = transform->getScale()[0];
+        const mat3f &rotation = transform->getRotation();
+        vec3f pos = ((start - transform->getOrigin()) * rotation) / s;
+        vec3f dir = r.getDirection() * rotation;
+
+        ray localRay( pos, dir, r.getTime() );
+        localRay.setInterval( r.getMinT() / s, r.getMaxT() / s );
+
+        if (!intersectLocal(localRay, i))
+            return false;
+        i.N = rotation * i.N;
+        i.t *= s;
+        return true;
+    }
+
+    default:
+        break;
+    }
+
+    vec3f pos = transform->globalToLocalCoords(start);
+    vec3f dir = transform->globalToLocalCoords(start + r.getDirection()) - pos;
     double length = dir.length();
     dir /= length;
 
-    ray localRay( pos, dir );
+    ray localRay( pos, dir, r.getTime() );
+    localRay.setInterval( r.getMinT() * length, r.getMaxT() * length );
 
     if (intersectLocal(localRay, i)) {
         // Transform the intersection point & normal returned back into global space.
@@ -95,12 +146,134 @@ bool Geometry::intersect(const ray&r, isect&i) const
     }
     
 }
-
 bool Geometry::intersectLocal( const ray& r, isect& i ) const
 {
 	return false;
 }
 
+// Sphere::intersectLocal with every length scaled by the radius, including
+// the epsilon, which is a local distance.
+bool intersectSphere( const SphereRecord& rec, const ray& r, isect& i )
+{
+	vec3f center = rec.center + rec.motion * r.getTime();
+	vec3f v = center - r.getPosition();
+	double b = v.dot(r.getDirection());
+	double discriminant = b*b - v.dot(v) + rec.radius*rec.radius;
+
+	if( discriminant < 0.0 ) {
+		return false;
+	}
+
+	discriminant = sqrt( discriminant );
+	double t2 = b + discriminant;
+	double epsilon = RAY_EPSILON * rec.radius;
+
+	if( t2 <= epsilon || t2 < r.getMinT() ) {
+		return false;
+	}
+
+	double t1 = b - discriminant;
+	double t = t1 > epsilon && t1 >= r.getMinT() ? t1 : t2;
+
+	if( t > r.getMaxT() ) {
+		return false;
+	}
+
+	i.obj = rec.obj;
+	i.t = t;
+	i.N = (r.at( t ) - center).normalize();
+
+	return true;
+}
+
+// Box::intersectLocal for a box of any size; the epsilon is a distance
+// along the local ray, which is longer than the world one by the length
+// of the direction divided by the box's size.
+bool intersectBox( const BoxRecord& rec, const ray& r, isect& i )
+{
+	vec3f ray_o = r.getPosition() - rec.motion * r.getTime();
+	const vec3f& inv = r.getInverseDirection();
+
+	double t_far = DBL_MAX;
+	double t_near = -DBL_MAX;
+	int axis_near = 0;
+	int axis_far = 0;
+
+	for( int a = 0; a < 3; a++ ) {
+		double face = r.getSign(a) ? rec.half[a] : -rec.half[a];
+		double t1 = (rec.center[a] + face - ray_o[a]) * inv[a];
+		double t2 = (rec.center[a] - face - ray_o[a]) * inv[a];
+
+		if( t1 > t_near ) {
+			t_near = t1;
+			axis_near = a;
+		}
+		if( t2 < t_far ) {
+			t_far = t2;
+			axis_far = a;
+		}
+	}
+
+	if( t_near > t_far || t_near > r.getMaxT() || t_far < r.getMinT() )
+		return false;
+
+	vec3f d = r.getDirection();
+	vec3f local( d[0] / rec.half[0], d[1] / rec.half[1], d[2] / rec.half[2] );
+	double scale = local.length() * 0.5;
+	if( t_far * scale < RAY_EPSILON )
+		return false;
+
+	vec3f n;
+	i.obj = rec.obj;
+	if( t_near * scale < RAY_EPSILON || t_near < r.getMinT() ) {
+		if( t_far > r.getMaxT() )
+			return false;
+		n[axis_far] = r.getSign(axis_far) ? -1.0 : 1.0;
+		i.t = t_far;
+	} else {
+		n[axis_near] = r.getSign(axis_near) ? 1.0 : -1.0;
+		i.t = t_near;
+	}
+	i.N = n;
+	return true;
+}
+
+// TrimeshFace::intersectLocal, with the normal, its largest component and
+// the denominator of the barycentric coordinates worked out in advance.
+bool intersectTriangle( const TriangleRecord& rec, const vec3g *normals, const ray& r, isect& i )
+{
+	// the start is taken relative to the corner before any precision is
+	// given up
+	vec3g v( r.getDirection() );
+	vec3g ap( r.getPosition() - vec3f( rec.motion ) * r.getTime() - vec3f( rec.a ) );
+
+	geomfloat vdotn = v * rec.n;
+	if( -vdotn < NORMAL_EPSILON )
+		return false;
+
+	geomfloat t = -(ap * rec.n) / vdotn;
+	if( t < rec.epsilon || t < r.getMinT() || t > r.getMaxT() )
+		return false;
+
+	vec3g am = ap + t * v;
+	int k = rec.k;
+
+	vec3g bary;
+	bary[1] = (am.cross(rec.ac))[k] * rec.invCross;
+	bary[2] = (rec.ab.cross(am))[k] * rec.invCross;
+	bary[0] = 1 - bary[1] - bary[2];
+	if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
+		return false;
+
+	i.obj = rec.obj;
+	i.t = t;
+	if( normals )
+		i.N = vec3f( bary[0] * normals[0] + bary[1] * normals[1] + bary[2] * normals[2] ).normalize();
+	else
+		i.N = vec3f( rec.n );
+	return true;
+}
+
 bool Geometry::hasBoundingBoxCapability() const
 {
 	// by default, primitives do not have to specify a bounding box.
@@ -120,36 +293,57 @@ Scene::~Scene()
     giter g;
     liter l;
     
+	// boundedobjects and nonboundedobjects only sort the same objects
 	for( g = objects.begin(); g != objects.end(); ++g ) {
 		delete (*g);
 	}
 
-	for( g = boundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
-	}
-
-	for( g = nonboundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
-	}
-
 	for( l = lights.begin(); l != lights.end(); ++l ) {
 		delete (*l);
 	}
+
+	delete caustics;
+}
+
+void Scene::setCaustics( PhotonMap *map )
+{
+	delete caustics;
+	caustics = map;
+}
+
+ray spawnRay( const RayOrigin& from, const vec3f& d, double time )
+{
+	if( !from.obj )
+		return ray( from.P, d, time );
+
+	const vec3f& P = from.P;
+	double size = max( fabs( P[0] ), max( fabs( P[1] ), fabs( P[2] ) ) );
+	double offset = (NORMAL_EPSILON + SPAWN_ERROR * size) / from.N.length();
+	if( from.N.dot( d ) < 0.0 )
+		offset = -offset;
+
+	ray r( P + from.N * offset, d, time );
+	if( !from.obj->mayRehit( from.N, d ) )
+		r.setSkip( from.obj );
+	return r;
 }
 
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
 bool Scene::intersect( const ray& r, isect& i ) const
 {
-	typedef list<Geometry*>::const_iterator iter;
-	iter j;
+	cgiter j;
 
 	isect cur;
 	bool have_one = false;
 
 	// try the non-bounded objects
 	for( j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+		if( *j == r.getSkip() )
+			continue;
+		RAY_STAT( primitiveTests[RayStats::OTHER] );
 		if( (*j)->intersect( r, cur ) ) {
+			RAY_STAT( primitiveHits[RayStats::OTHER] );
 			if( !have_one || (cur.t < i.t) ) {
 				i = cur;
 				have_one = true;
@@ -158,17 +352,181 @@ bool Scene::intersect( const ray& r, isect& i ) const
 	}
 
 	// try the bounded objects
-	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
-			if( !have_one || (cur.t < i.t) ) {
-				i = cur;
-				have_one = true;
-			}
+	if( bvh.intersect( r, i, have_one ) )
+		have_one = true;
+
+	if( s_pHitRecord )
+		s_pHitRecord->add( r, have_one ? i.obj : NULL, i.t, sceneBounds );
+	if( have_one )
+		RAY_STAT( hits );
+
+	return have_one;
+}
+
+void Scene::setHitRecord( HitRecord *rec )
+{
+	s_pHitRecord = rec;
+}
+
+void Scene::noteGather()
+{
+	if( s_pHitRecord )
+		s_pHitRecord->addGather();
+}
+
+const vector<TransformNode*> *Scene::findNodes( const string& name ) const
+{
+	map<string, vector<TransformNode*> >::const_iterator n = namedNodes.find( name );
+	return n == namedNodes.end() ? NULL : &n->second;
+}
+
+void HitRecord::clear()
+{
+	objects.clear();
+	compactAt = 64;
+	last = NULL;
+	swept = 0;
+	gathered = false;
+}
+
+void HitRecord::add( const ray& r, const Geometry *obj, double t, const BoundingBox& sceneBounds )
+{
+	if( obj && obj != last ) {
+		objects.push_back( obj );
+		last = obj;
+		if( objects.size() >= compactAt )
+			compact();
+	}
+
+	// Only the part of the ray inside the scene bounds matters; an object
+	// that is moved outside of them invalidates everything anyway.
+	double tMin, tMax;
+	if( !sceneBounds.intersect( r, tMin, tMax ) )
+		return;
+	if( tMin < 0.0 )
+		tMin = 0.0;
+	if( obj && t < tMax )
+		tMax = t;
+	if( tMin > tMax )
+		return;
+
+	// A ray's box grows with the square of its length, so a long ray goes
+	// in as pieces no longer than the scene's diagonal over PIECES.
+	double diagonal = (sceneBounds.max - sceneBounds.min).length();
+	int pieces = 1;
+	if( diagonal > 0.0 )
+		pieces = (int)ceil( PIECES * (tMax - tMin) / diagonal );
+	if( pieces < 1 )
+		pieces = 1;
+	if( pieces > PIECES )
+		pieces = PIECES;
+
+	vec3f a = r.at( tMin );
+	if( pieces > 1 && contains( a, r.at( tMax ) ) )
+		return;
+	for( int k = 1; k <= pieces; ++k ) {
+		vec3f b = r.at( tMin + (tMax - tMin) * k / pieces );
+		addPiece( a, b );
+		a = b;
+	}
+}
+
+// is the segment ab inside one of the boxes?
+bool HitRecord::contains( const vec3f& a, const vec3f& b ) const
+{
+	vec3f lo = minimum( a, b );
+	vec3f hi = maximum( a, b );
+	for( int k = 0; k < swept; ++k ) {
+		const BoundingBox& s = sweep[k];
+		if( lo[0] >= s.min[0] && lo[1] >= s.min[1] && lo[2] >= s.min[2] &&
+			hi[0] <= s.max[0] && hi[1] <= s.max[1] && hi[2] <= s.max[2] )
+			return true;
+	}
+	return false;
+}
+
+// half the surface area of a box, which is what a box's chance of being
+// crossed by a line goes by
+static double halfArea( const vec3f& lo, const vec3f& hi )
+{
+	vec3f e = hi - lo;
+	return e[0] * e[1] + e[1] * e[2] + e[2] * e[0];
+}
+
+// Put the segment ab into the box it makes grow the least, or into a box of
+// its own while there are boxes to spare and it fits in none of them.
+void HitRecord::addPiece( const vec3f& a, const vec3f& b )
+{
+	// most pieces lie inside a box already
+	if( contains( a, b ) )
+		return;
+
+	vec3f lo = minimum( a, b );
+	vec3f hi = maximum( a, b );
+
+	int best = -1;
+	double growth = 0.0;
+	for( int k = 0; k < swept; ++k ) {
+		vec3f mlo = minimum( sweep[k].min, lo );
+		vec3f mhi = maximum( sweep[k].max, hi );
+		double g = halfArea( mlo, mhi ) - halfArea( sweep[k].min, sweep[k].max );
+		if( best < 0 || g < growth ) {
+			best = k;
+			growth = g;
 		}
 	}
 
+	if( best < 0 || swept < SWEEPS ) {
+		sweep[swept].min = lo;
+		sweep[swept].max = hi;
+		++swept;
+		return;
+	}
+	sweep[best].min = minimum( sweep[best].min, lo );
+	sweep[best].max = maximum( sweep[best].max, hi );
+}
 
-	return have_one;
+// sort and remove duplicates, so that lookups can use a binary search
+void HitRecord::compact()
+{
+	sort( objects.begin(), objects.end() );
+	objects.erase( unique( objects.begin(), objects.end() ), objects.end() );
+	compactAt = objects.size() * 2 > 64 ? objects.size() * 2 : 64;
+}
+
+bool HitRecord::touched( const Geometry *obj )
+{
+	compact();
+	return binary_search( objects.begin(), objects.end(), obj );
+}
+
+bool HitRecord::sweeps( Geometry *obj ) const
+{
+	for( int k = 0; k < swept; ++k ) {
+		if( obj->mayOccupy( sweep[k] ) )
+			return true;
+	}
+	return false;
+}
+
+bool Geometry::mayOccupy( const BoundingBox& box )
+{
+	if( !bounds.intersects( box ) )
+		return false;
+	if( !hasBoundingBoxCapability() || transform->isMoving() )
+		return true;
+
+	// box the corners of box again in the object's own space
+	BoundingBox b;
+	for( int k = 0; k < 8; ++k ) {
+		vec3f c( (k & 1) ? box.max[0] : box.min[0],
+				 (k & 2) ? box.max[1] : box.min[1],
+				 (k & 4) ? box.max[2] : box.min[2] );
+		vec3f p = transform->globalToLocalCoords( c );
+		b.min = k ? minimum( b.min, p ) : p;
+		b.max = k ? maximum( b.max, p ) : p;
+	}
+	return ComputeLocalBoundingBox().intersects( b );
 }
 
 void Scene::initScene()
@@ -176,7 +534,7 @@ void Scene::initScene()
 	bool first_boundedobject = true;
 	BoundingBox b;
 	
-	typedef list<Geometry*>::const_iterator iter;
+	typedef vector<Geometry*>::const_iterator iter;
 	// split the objects into two categories: bounded and non-bounded
 	for( iter j = objects.begin(); j != objects.end(); ++j ) {
 		if( (*j)->hasBoundingBoxCapability() )
@@ -198,4 +556,378 @@ void Scene::initScene()
 		else
 			nonboundedobjects.push_back(*j);
 	}
+
+	bvh.build( boundedobjects );
+
+	lightRecords.resize( lights.size() );
+	for( size_t k = 0; k < lights.size(); ++k )
+		lights[k]->compile( lightRecords[k] );
+	lightTree.build( lightRecords );
+}
+
+void Scene::refit()
+{
+	bool first_boundedobject = true;
+	BoundingBox b;
+
+	typedef vector<Geometry*>::const_iterator iter;
+	for( iter j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+		(*j)->ComputeBoundingBox();
+
+		b = (*j)->getBoundingBox();
+		if (first_boundedobject) {
+			sceneBounds = b;
+			first_boundedobject = false;
+		}
+		else
+		{
+			sceneBounds.max = maximum(sceneBounds.max, b.max);
+			sceneBounds.min = minimum(sceneBounds.min, b.min);
+		}
+	}
+
+	bvh.refit();
+}
+
+// The most objects a leaf of the BVH holds, and the number of bins object
+// centres are sorted into when looking for the cheapest split.  Nodes
+// deeper than BVH_MAX_DEPTH are split at their median instead, which
+// bounds the depth of the tree (and so the traversal stack) whatever the
+// scene.
+static const int BVH_LEAF_SIZE = 4;
+static const int BVH_BINS = 16;
+static const int BVH_MAX_DEPTH = 64;
+
+static double surfaceArea( const BoundingBox& b )
+{
+	vec3f d = b.max - b.min;
+	return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+void BVH::build( const vector<Geometry*>& objs )
+{
+	objects = objs;
+	nodes.clear();
+
+	int n = (int)objects.size();
+	vector<int> index( n );
+	vector<vec3f> centers( n );
+	vector<BoundingBox> boxes( n );
+	for( int k = 0; k < n; ++k ) {
+		index[k] = k;
+		boxes[k] = objects[k]->getBoundingBox();
+		centers[k] = (boxes[k].min + boxes[k].max) * 0.5;
+	}
+
+	if( n > 0 ) {
+		nodes.reserve( 2 * (n / BVH_LEAF_SIZE + 1) );
+		buildNode( 0, n, 0, index, centers, boxes );
+	}
+
+	// put each leaf's objects next to each other
+	vector<Geometry*> sorted( n );
+	order.resize( n );
+	for( int k = 0; k < n; ++k ) {
+		sorted[k] = objects[index[k]];
+		order[k] = index[k];
+	}
+	objects.swap( sorted );
+
+	refit();
+}
+
+// Build the subtree over index[start,end) and return its node.  Inner
+// nodes are split where the surface area heuristic says rays will test
+// the fewest objects, choosing among the boundaries of BVH_BINS equal bins
+// along the longest axis of the objects' centres.
+int BVH::buildNode( int start, int end, int depth, vector<int>& index,
+					const vector<vec3f>& centers, const vector<BoundingBox>& boxes )
+{
+	int me = (int)nodes.size();
+	nodes.push_back( Node() );
+	nodes[me].start = start;
+	nodes[me].count = end - start;
+	nodes[me].second = 0;
+	nodes[me].axis = 0;
+
+	int n = end - start;
+	if( n <= BVH_LEAF_SIZE )
+		return me;
+
+	vec3f lo = centers[index[start]];
+	vec3f hi = lo;
+	for( int k = start + 1; k < end; ++k ) {
+		lo = minimum( lo, centers[index[k]] );
+		hi = maximum( hi, centers[index[k]] );
+	}
+
+	int axis = 0;
+	if( hi[1] - lo[1] > hi[axis] - lo[axis] )
+		axis = 1;
+	if( hi[2] - lo[2] > hi[axis] - lo[axis] )
+		axis = 2;
+	double extent = hi[axis] - lo[axis];
+
+	int mid = start + n / 2;
+	if( extent > 0.0 && depth < BVH_MAX_DEPTH ) {
+		BoundingBox binBox[BVH_BINS];
+		int binCount[BVH_BINS];
+		for( int b = 0; b < BVH_BINS; ++b )
+			binCount[b] = 0;
+
+		double scale = BVH_BINS / extent;
+		for( int k = start; k < end; ++k ) {
+			int b = min( (int)((centers[index[k]][axis] - lo[axis]) * scale), BVH_BINS - 1 );
+			const BoundingBox& box = boxes[index[k]];
+			if( binCount[b]++ == 0 ) {
+				binBox[b] = box;
+			} else {
+				binBox[b].min = minimum( binBox[b].min, box.min );
+				binBox[b].max = maximum( binBox[b].max, box.max );
+			}
+		}
+
+		// the cost of the objects left of each boundary, then of the
+		// objects right of it, sweeping in from either end
+		double cost[BVH_BINS - 1];
+		BoundingBox acc;
+		int count = 0;
+		for( int b = 0; b < BVH_BINS - 1; ++b ) {
+			if( binCount[b] > 0 ) {
+				if( count == 0 ) {
+					acc = binBox[b];
+				} else {
+					acc.min = minimum( acc.min, binBox[b].min );
+					acc.max = maximum( acc.max, binBox[b].max );
+				}
+				count += binCount[b];
+			}
+			cost[b] = count * (count > 0 ? surfaceArea( acc ) : 0.0);
+		}
+		count = 0;
+		for( int b = BVH_BINS - 1; b > 0; --b ) {
+			if( binCount[b] > 0 ) {
+				if( count == 0 ) {
+					acc = binBox[b];
+				} else {
+					acc.min = minimum( acc.min, binBox[b].min );
+					acc.max = maximum( acc.max, binBox[b].max );
+				}
+				count += binCount[b];
+			}
+			cost[b - 1] += count * (count > 0 ? surfaceArea( acc ) : 0.0);
+		}
+
+		int split = 0;
+		for( int b = 1; b < BVH_BINS - 1; ++b ) {
+			if( cost[b] < cost[split] )
+				split = b;
+		}
+
+		int *first = &index[0] + start;
+		int *last = &index[0] + end;
+		mid = (int)(partition( first, last, [&]( int k ) {
+			return min( (int)((centers[k][axis] - lo[axis]) * scale), BVH_BINS - 1 ) <= split;
+		} ) - &index[0]);
+	}
+
+	// an empty side (all centres in one place, or too deep) is split at
+	// the median instead
+	if( mid == start || mid == end || extent <= 0.0 || depth >= BVH_MAX_DEPTH ) {
+		mid = start + n / 2;
+		nth_element( &index[0] + start, &index[0] + mid, &index[0] + end, [&]( int a, int b ) {
+			return centers[a][axis] < centers[b][axis];
+		} );
+	}
+
+	nodes[me].count = 0;
+	nodes[me].axis = axis;
+	buildNode( start, mid, depth + 1, index, centers, boxes );
+	int second = buildNode( mid, end, depth + 1, index, centers, boxes );
+	nodes[me].second = second;
+
+	return me;
+}
+
+// A leaf's box takes in its objects' boxes, padded by RAY_EPSILON so that
+// flat objects (squares, triangles) still have some thickness to hit.
+void BVH::fitLeaf( Node& node ) const
+{
+	node.box = objects[node.start]->getBoundingBox();
+	for( int k = node.start + 1; k < node.start + node.count; ++k ) {
+		const BoundingBox& b = objects[k]->getBoundingBox();
+		node.box.min = minimum( node.box.min, b.min );
+		node.box.max = maximum( node.box.max, b.max );
+	}
+
+	vec3f pad( RAY_EPSILON, RAY_EPSILON, RAY_EPSILON );
+	node.box.min -= pad;
+	node.box.max += pad;
+}
+
+void BVH::refit()
+{
+	// children always come after their parents
+	for( int k = (int)nodes.size() - 1; k >= 0; --k ) {
+		Node& node = nodes[k];
+		if( node.count > 0 ) {
+			fitLeaf( node );
+		} else {
+			const BoundingBox& a = nodes[k + 1].box;
+			const BoundingBox& b = nodes[node.second].box;
+			node.box.min = minimum( a.min, b.min );
+			node.box.max = maximum( a.max, b.max );
+		}
+	}
+
+	fillRecords();
+}
+
+// Sort each leaf's objects into the arrays of records by type, as their
+// transforms now stand.  A change of transform can move an object from one
+// type to another, so this is redone from scratch on every refit.
+void BVH::fillRecords()
+{
+	leaves.clear();
+	spheres.clear();
+	boxes.clear();
+	triangles.clear();
+	normals.clear();
+	others.clear();
+
+	for( size_t k = 0; k < nodes.size(); ++k ) {
+		Node& node = nodes[k];
+		if( node.count == 0 )
+			continue;
+
+		Leaf leaf = { (int)spheres.size(), (int)boxes.size(), (int)triangles.size(), (int)others.size() };
+		node.second = (int)leaves.size();
+		leaves.push_back( leaf );
+
+		for( int j = node.start; j < node.start + node.count; ++j ) {
+			const Geometry *g = objects[j];
+			SphereRecord sphere;
+			BoxRecord box;
+			TriangleRecord triangle;
+			vec3g n[3];
+
+			if( g->getSphere( sphere ) ) {
+				sphere.order = order[j];
+				spheres.push_back( sphere );
+			} else if( g->getBox( box ) ) {
+				box.order = order[j];
+				boxes.push_back( box );
+			} else if( g->getTriangle( triangle, n ) ) {
+				triangle.order = order[j];
+				if( triangle.normals >= 0 ) {
+					triangle.normals = (int)normals.size();
+					normals.insert( normals.end(), n, n + 3 );
+				}
+				triangles.push_back( triangle );
+			} else {
+				Other other = { g, order[j] };
+				others.push_back( other );
+			}
+		}
+	}
+
+	Leaf end = { (int)spheres.size(), (int)boxes.size(), (int)triangles.size(), (int)others.size() };
+	leaves.push_back( end );
+}
+
+bool BVH::intersect( const ray& r, isect& i, bool have_one ) const
+{
+	if( nodes.empty() )
+		return false;
+
+	isect cur;
+	bool found = false;
+	int best = 0; // order[] of the object found
+
+	// the ray with its interval cut off at the closest hit so far, so that
+	// the slab tests reject the boxes beyond it
+	ray clipped( r );
+	if( have_one )
+		clipped.setMaxT( i.t );
+
+	// the object the ray leaves and cannot meet again
+	const Geometry* skip = r.getSkip();
+
+	// take cur as the hit if it is the closest so far
+	auto keep = [&]( int o ) {
+		if( !have_one || cur.t < i.t || (found && cur.t == i.t && o < best) ) {
+			i = cur;
+			have_one = true;
+			found = true;
+			best = o;
+			clipped.setMaxT( i.t );
+		}
+	};
+
+	int stack[2 * BVH_MAX_DEPTH];
+	int top = 0;
+	stack[top++] = 0;
+
+	while( top > 0 ) {
+		int k = stack[--top];
+		const Node& node = nodes[k];
+
+		double tMin, tMax;
+		RAY_STAT( boxTests );
+		if( !node.box.intersect( clipped, tMin, tMax ) )
+			continue;
+
+		if( node.count > 0 ) {
+			// each type in turn, straight from its array
+			const Leaf& first = leaves[node.second];
+			const Leaf& last = leaves[node.second + 1];
+			for( int j = first.spheres; j < last.spheres; ++j ) {
+				if( spheres[j].obj == skip )
+					continue;
+				RAY_STAT( primitiveTests[RayStats::SPHERE] );
+				if( intersectSphere( spheres[j], clipped, cur ) ) {
+					RAY_STAT( primitiveHits[RayStats::SPHERE] );
+					keep( spheres[j].order );
+				}
+			}
+			for( int j = first.boxes; j < last.boxes; ++j ) {
+				if( boxes[j].obj == skip )
+					continue;
+				RAY_STAT( primitiveTests[RayStats::BOX] );
+				if( intersectBox( boxes[j], clipped, cur ) ) {
+					RAY_STAT( primitiveHits[RayStats::BOX] );
+					keep( boxes[j].order );
+				}
+			}
+			for( int j = first.triangles; j < last.triangles; ++j ) {
+				const TriangleRecord& rec = triangles[j];
+				if( rec.obj == skip )
+					continue;
+				RAY_STAT( primitiveTests[RayStats::TRIANGLE] );
+				if( intersectTriangle( rec, rec.normals < 0 ? NULL : &normals[rec.normals], clipped, cur ) ) {
+					RAY_STAT( primitiveHits[RayStats::TRIANGLE] );
+					keep( rec.order );
+				}
+			}
+			for( int j = first.others; j < last.others; ++j ) {
+				if( others[j].obj == skip )
+					continue;
+				RAY_STAT( primitiveTests[RayStats::OTHER] );
+				if( others[j].obj->intersect( clipped, cur ) ) {
+					RAY_STAT( primitiveHits[RayStats::OTHER] );
+					keep( others[j].order );
+				}
+			}
+		} else {
+			// visit the child on the near side of the split first
+			int nearChild = k + 1;
+			int farChild = node.second;
+			if( r.getSign( node.axis ) )
+				swap( nearChild, farChild );
+			stack[top++] = farChild;
+			stack[top++] = nearChild;
+		}
+	}
+
+	return found;
 }
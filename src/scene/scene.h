@@ -8,6 +8,9 @@
 #define __SCENE_H__
 
 #include <list>
+#include <map>
+#include <string>
+#include <vector>
 #include <algorithm>
 
 using namespace std;
@@ -19,6 +22,7 @@ using namespace std;
 
 class Light;
 class Scene;
+class PhotonMap;
 
 class SceneElement
 {
@@ -48,20 +52,47 @@ public:
 	// does the box contain this point?
 	bool intersects(const vec3f &point) const;
 
-	// if the ray hits the box, put the "t" value of the intersection
-	// closest to the origin in tMin and the "t" value of the far intersection
-	// in tMax and return true, else return false.
+	// if the ray hits the box within its [tMin, tMax] interval, put the "t"
+	// values where it enters and leaves the box, clipped to that interval,
+	// in tMin and tMax and return true, else return false.
 	bool intersect(const ray &r, double &tMin, double &tMax) const;
 };
 
 class TransformNode
 {
+public:
+	// Transformations that only move, scale or turn an object let
+	// Geometry::intersect skip parts of the general matrix path.
+	enum Kind
+	{
+		IDENTITY,	// no transformation at all
+		TRANSLATE,	// a translation only
+		SCALE,		// positive scales along the axes, then a translation
+		SIMILARITY,	// a rotation and one uniform scale, then a translation
+		GENERAL		// any other affine transformation
+	};
+
 protected:
 	// information about this node's transformation
+	mat4f local;
 	mat4f xform;
 	mat4f inverse;
 	mat3f normi;
 
+	// which Kind xform is, where it puts the local
+	// origin, its scale along each local axis and, for a SIMILARITY, its
+	// rotation without the scale
+	Kind kind;
+	vec3f origin;
+	vec3f scale;
+	mat3f rotation;
+
+	// how far this node moves while the shutter is open, relative to its
+	// parent (localMotion) and in world space, including the motion of
+	// every ancestor (motion)
+	vec3f localMotion;
+	vec3f motion;
+
 	// information about parent & children
 	TransformNode *parent;
 	list<TransformNode *> children;
@@ -83,6 +114,24 @@ public:
 		return child;
 	}
 
+	// A child that travels by the parent-space offset delta between the
+	// opening (time 0) and closing (time 1) of the shutter.
+	TransformNode *createMovingChild(const vec3f &delta)
+	{
+		TransformNode *child = new TransformNode(this, mat4f(), delta);
+		children.push_back(child);
+		return child;
+	}
+
+	bool isMoving() const { return !(motion[0] == 0.0 && motion[1] == 0.0 && motion[2] == 0.0); }
+	const vec3f &getMotion() const { return motion; }
+
+	Kind getKind() const { return kind; }
+	const vec3f &getOrigin() const { return origin; }
+	const vec3f &getScale() const { return scale; }
+	const mat3f &getRotation() const { return rotation; }
+	const mat3f &getNormalXform() const { return normi; }
+
 	// Coordinate-Space transformation
 	vec3f globalToLocalCoords(const vec3f &v)
 	{
@@ -104,21 +153,101 @@ public:
 		return (normi * v).normalize();
 	}
 
+	const mat4f &getLocalXform() const { return local; }
+
+	// is node this one or one of its ancestors?
+	bool isUnder(const TransformNode *node) const
+	{
+		for (const TransformNode *n = this; n; n = n->parent)
+			if (n == node)
+				return true;
+		return false;
+	}
+
+	// Replace this node's transformation relative to its parent.  The
+	// cached global matrices of this node and all of its descendants are
+	// recomputed; bounding boxes of the attached objects are not.
+	void setLocalXform(const mat4f &xform)
+	{
+		local = xform;
+		update();
+	}
+
 protected:
+	void update()
+	{
+		if (parent == NULL) {
+			xform = local;
+			motion = localMotion;
+		} else {
+			xform = parent->xform * local;
+			motion = parent->motion + parent->xform.upper33() * localMotion;
+		}
+
+		inverse = xform.inverse();
+		normi = xform.upper33().inverse().transpose();
+		classify();
+
+		for (child_iter c = children.begin(); c != children.end(); ++c)
+			(*c)->update();
+	}
+
+	void classify()
+	{
+		mat3f m = xform.upper33();
+		origin = vec3f(xform[0][3], xform[1][3], xform[2][3]);
+		scale = vec3f(1.0, 1.0, 1.0);
+		rotation = mat3f();
+
+		if (xform[3][0] != 0.0 || xform[3][1] != 0.0 || xform[3][2] != 0.0 || xform[3][3] != 1.0)
+		{
+			kind = GENERAL;
+			return;
+		}
+
+		if (m[0][1] == 0.0 && m[0][2] == 0.0 && m[1][0] == 0.0 &&
+			m[1][2] == 0.0 && m[2][0] == 0.0 && m[2][1] == 0.0 &&
+			m[0][0] > 0.0 && m[1][1] > 0.0 && m[2][2] > 0.0)
+		{
+			scale = vec3f(m[0][0], m[1][1], m[2][2]);
+			if (scale[0] != 1.0 || scale[1] != 1.0 || scale[2] != 1.0)
+				kind = SCALE;
+			else
+				kind = origin.iszero() ? IDENTITY : TRANSLATE;
+			return;
+		}
+
+		// a similarity maps the local axes to vectors of one length at
+		// right angles to each other; allow for rounding in the rotation
+		vec3f x(m[0][0], m[1][0], m[2][0]);
+		vec3f y(m[0][1], m[1][1], m[2][1]);
+		vec3f z(m[0][2], m[1][2], m[2][2]);
+		double s2 = x * x;
+		double tolerance = 1e-9 * s2;
+		if (s2 == 0.0 ||
+			fabs(y * y - s2) > tolerance || fabs(z * z - s2) > tolerance ||
+			fabs(x * y) > tolerance || fabs(y * z) > tolerance || fabs(z * x) > tolerance)
+		{
+			kind = GENERAL;
+			return;
+		}
+
+		double s = sqrt(s2);
+		kind = SIMILARITY;
+		scale = vec3f(s, s, s);
+		rotation = m / s;
+	}
+
 	// protected so that users can't directly construct one of these...
 	// force them to use the createChild() method.  Note that they CAN
 	// directly create a TransformRoot object.
-	TransformNode(TransformNode *parent, const mat4f &xform)
+	TransformNode(TransformNode *parent, const mat4f &xform, const vec3f &delta = vec3f())
 		: children()
 	{
 		this->parent = parent;
-		if (parent == NULL)
-			this->xform = xform;
-		else
-			this->xform = parent->xform * xform;
-
-		inverse = this->xform.inverse();
-		normi = this->xform.upper33().inverse().transpose();
+		local = xform;
+		localMotion = delta;
+		update();
 	}
 };
 
@@ -129,6 +258,135 @@ public:
 		: TransformNode(NULL, mat4f()) {}
 };
 
+class SceneObject;
+
+// Meshes and the triangle records below are stored, and triangles are
+// intersected, in this precision.  Building with RAY_FLOAT_GEOMETRY halves
+// their size; transforms and their inverses, spheres and boxes (few, and
+// the sphere's quadratic loses too much in float) and shading stay in
+// double either way.
+#ifdef RAY_FLOAT_GEOMETRY
+typedef float geomfloat;
+#else
+typedef double geomfloat;
+#endif
+typedef vec3<geomfloat> vec3g;
+
+// Compact world-space descriptions of the commonest primitives.  The BVH
+// keeps one contiguous array of each kind and tests them directly, with no
+// virtual call and no transformation of the ray; everything else goes
+// through Geometry::intersect.  Each record points back at its object and
+// carries how far the object moves while the shutter is open.  The BVH
+// fills in order, for breaking ties between equally near hits.
+struct SphereRecord
+{
+	vec3f center;
+	vec3f motion;
+	double radius;
+	const SceneObject *obj;
+	int order;
+};
+
+struct BoxRecord
+{
+	vec3f center;
+	vec3f half; // half the size along each axis
+	vec3f motion;
+	const SceneObject *obj;
+	int order;
+};
+
+struct TriangleRecord
+{
+	vec3g a, ab, ac;	// a corner and the two edges from it
+	vec3g n;			// the unit face normal, on the side that is hit
+	vec3g motion;
+	geomfloat epsilon;	// the nearest hit that counts, in world units
+	geomfloat invCross; // 1 / (ab x ac)[k]
+	int k;			 // the largest component of n
+	int normals;	 // where its vertex normals are, or -1 for none
+	const SceneObject *obj;
+	int order;
+};
+
+// The closest hit with the primitive beyond the record's epsilon, in the
+// same form as Geometry::intersect.  normals are a triangle's vertex
+// normals, or NULL to use its face normal.
+bool intersectSphere(const SphereRecord &rec, const ray &r, isect &i);
+bool intersectBox(const BoxRecord &rec, const ray &r, isect &i);
+bool intersectTriangle(const TriangleRecord &rec, const vec3g *normals, const ray &r, isect &i);
+
+// Where a secondary ray starts: P, on the surface of obj with normal N
+// there (either way round), or anywhere at all for a NULL obj.
+struct RayOrigin
+{
+	RayOrigin(const vec3f &p)
+		: P(p), N(), obj(NULL) {}
+	RayOrigin(const vec3f &p, const vec3f &n, const SceneObject *o)
+		: P(p), N(n), obj(o) {}
+
+	vec3f P;
+	vec3f N;
+	const SceneObject *obj;
+};
+
+// A hit point is only known to within a few rounding errors of its largest
+// coordinate, more of them in the precision triangles are intersected in.
+#ifdef RAY_FLOAT_GEOMETRY
+const double SPAWN_ERROR = 32 * FLT_EPSILON;
+#else
+const double SPAWN_ERROR = 32 * DBL_EPSILON;
+#endif
+
+// The ray from a surface in the unit direction d.  It starts off the
+// surface on the side d goes to, by NORMAL_EPSILON plus the error in P, so
+// that it cannot find the surface it left; where the object cannot be met
+// again on that side (see Geometry::mayRehit) the ray skips it altogether.
+ray spawnRay(const RayOrigin &from, const vec3f &d, double time);
+
+// A light as shading sees it, compiled by Light::compile when the scene is
+// set up.  The type picks the formulas, and whatever in them does not
+// depend on the point being shaded is worked out once.  OTHER covers
+// lights with no formula here, which are asked through their virtual
+// functions.
+struct LightRecord
+{
+	enum Type
+	{
+		DIRECTIONAL,
+		POINT,
+		SPOT,
+		AREA,
+		OTHER
+	};
+
+	Type type;
+	vec3f position;	   // for a DIRECTIONAL light, the direction to it
+	vec3f orientation; // the axis of a SPOT light's cone
+	vec3f color;
+	double a, b, c; // the attenuation is min(1, 1 / (a + b d + c d^2))
+	double cosCone; // the cosine of a SPOT light's cone angle
+	double focus;	// the exponent of its Warn falloff
+	const Light *light;
+};
+
+// What a light gives a point: the unit direction to the light, how far
+// away it is (0 for a light at infinity), its distance attenuation and its
+// colour.
+struct LightSample
+{
+	vec3f L;
+	double distance;
+	double atten;
+	vec3f color;
+};
+
+// Everything that Light::getDirection, distanceAttenuation and getColor
+// give for P, in one go.  shadowLight is Light::shadowAttenuation, given
+// what evaluateLight found at from.P.
+void evaluateLight(const LightRecord &rec, const vec3f &P, LightSample &s);
+vec3f shadowLight(const LightRecord &rec, const RayOrigin &from, const LightSample &s, double time);
+
 // A Geometry object is anything that has extent in three dimensions.
 // It may not be an actual visible scene object.  For example, hierarchical
 // spatial subdivision could be expressed in terms of Geometry instances.
@@ -145,6 +403,25 @@ public:
 
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox &getBoundingBox() const { return bounds; }
+
+	// Could any of this object lie inside box?  The box is tested against
+	// the object's local bounds too, in the object's own space, which is
+	// much tighter than its world bounds for a turned or long, thin object.
+	bool mayOccupy(const BoundingBox &box);
+
+	// Can a ray leaving the surface at a point with normal N, in the
+	// direction d, hit this object again?  Anything may, unless it says
+	// otherwise: a flat surface never can, and a closed convex one cannot
+	// once d points out of it (N is the outward normal for those).
+	virtual bool mayRehit(const vec3f &N, const vec3f &d) const { return true; }
+
+	// If this object can be described by one of the records above as its
+	// transform stands, fill it in and return true.  A triangle with
+	// vertex normals also puts them in world space in normals and sets
+	// rec.normals to 0.
+	virtual bool getSphere(SphereRecord &rec) const { return false; }
+	virtual bool getBox(BoxRecord &rec) const { return false; }
+	virtual bool getTriangle(TriangleRecord &rec, vec3g *normals) const { return false; }
 	virtual void ComputeBoundingBox()
 	{
 		// take the object's local bounding box, transform all 8 points on it,
@@ -184,6 +461,13 @@ public:
 
 		bounds.max = vec3f(newMax);
 		bounds.min = vec3f(newMin);
+
+		// a moving object has to be found at any time during the shutter,
+		// so take in the box at the end of its motion as well
+		if (transform->isMoving()) {
+			bounds.max = maximum(bounds.max, bounds.max + transform->getMotion());
+			bounds.min = minimum(bounds.min, bounds.min + transform->getMotion());
+		}
 	}
 
 	// default method for ComputeLocalBoundingBox returns a bogus bounding box;
@@ -191,6 +475,7 @@ public:
 	virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
 	void setTransform(TransformNode *transform) { this->transform = transform; };
+	const TransformNode *getTransform() const { return transform; }
 
 	Geometry(Scene *scene)
 		: SceneElement(scene) {}
@@ -240,14 +525,188 @@ protected:
 	Material *material;
 };
 
+// Everything that the rays traced for one region of the image touched:
+// the objects they hit, a few boxes around the parts of those rays that lie
+// inside the scene bounds, and whether any of their shading gathered from
+// the caustic photon map.  The renderer keeps one of these per tile so that
+// an edit to a single object only forces the tiles that could see it to be
+// traced again.
+class HitRecord
+{
+public:
+	HitRecord() { clear(); }
+
+	void clear();
+
+	// note that ray r was traced and first hit obj at t (obj is NULL for a miss)
+	void add(const ray &r, const Geometry *obj, double t, const BoundingBox &sceneBounds);
+
+	// did any recorded ray hit obj?
+	bool touched(const Geometry *obj);
+
+	// could any recorded ray pass through obj where it is now?
+	bool sweeps(Geometry *obj) const;
+
+	// note a lookup in the photon map, and ask if there was one
+	void addGather() { gathered = true; }
+	bool usedCaustics() const { return gathered; }
+
+	// the most boxes kept, and the most pieces a ray across the whole
+	// scene is cut into
+	static const int SWEEPS = 8;
+	static const int PIECES = 8;
+
+private:
+	void compact();
+	bool contains(const vec3f &a, const vec3f &b) const;
+	void addPiece(const vec3f &a, const vec3f &b);
+
+	vector<const Geometry *> objects;
+	size_t compactAt;
+	const Geometry *last;
+
+	BoundingBox sweep[SWEEPS];
+	int swept;
+	bool gathered;
+};
+
+// A bounding volume hierarchy over the scene's bounded objects.  The nodes
+// are kept in one array in depth-first order: a node's first child follows
+// it directly and the second is at 'second', so every child comes after its
+// parent and the tree can be refitted in a single backwards sweep.
+class BVH
+{
+public:
+	// Build the tree over objs, whose bounding boxes must be up to date.
+	void build(const vector<Geometry *> &objs);
+
+	// Recompute every node's box from the current boxes of its objects,
+	// and their records from their current transforms, keeping the shape
+	// of the tree.  Much cheaper than a rebuild, and
+	// still tight as long as the objects have not moved far relative to
+	// each other.
+	void refit();
+
+	// Find the closest hit among the objects.  If have_one is true, i
+	// already holds a hit, which is only replaced by a strictly closer one.
+	// Objects hit at the same distance are resolved in the order they were
+	// given to build(), as in a plain linear search.
+	bool intersect(const ray &r, isect &i, bool have_one) const;
+
+private:
+	struct Node
+	{
+		BoundingBox box;
+		int start, count; // a leaf's objects; count is 0 for an inner node
+		int second;		  // the second child of an inner node, or a leaf's number
+		int axis;		  // the axis an inner node was split along
+	};
+
+	// Where each leaf's records start in the arrays below; a leaf's records
+	// end where the next leaf's start.
+	struct Leaf
+	{
+		int spheres, boxes, triangles, others;
+	};
+
+	struct Other
+	{
+		const Geometry *obj;
+		int order;
+	};
+
+	int buildNode(int start, int end, int depth, vector<int> &index,
+				  const vector<vec3f> &centers, const vector<BoundingBox> &boxes);
+	void fitLeaf(Node &node) const;
+	void fillRecords();
+
+	vector<Node> nodes;
+	vector<Geometry *> objects; // in leaf order
+	vector<int> order;			// where each of them was in the list given to build()
+
+	// the leaves' objects by type, in leaf order
+	vector<Leaf> leaves;
+	vector<SphereRecord> spheres;
+	vector<BoxRecord> boxes;
+	vector<TriangleRecord> triangles;
+	vector<vec3g> normals; // three per triangle that has vertex normals
+	vector<Other> others;
+};
+
+// Shading leaves out lights that cannot add more than this to any channel
+// at a point, counting all the lights left out there together: under half
+// of one step of an 8-bit pixel.
+const double LIGHT_CUTOFF = 0.5 / 255.0;
+
+// A group of lights is shaded as its brightest light, turned up to the
+// power of the whole group, where the group can add no more than this
+// fraction of the light that reaches the point altogether.
+const double LIGHT_ERROR = 0.02;
+
+// A light to shade a point with, and what to scale its light by: 1 for a
+// light of its own, more for one that stands for a group.
+struct LightChoice
+{
+	int light;
+	double weight;
+};
+
+// A bounding volume hierarchy over the scene's lights, laid out like the
+// BVH.  Every node has a bound on the light that all of its lights
+// together can send to a point at a given distance from its box.  Shading
+// takes a cut through the tree, as in Walter et al.'s lightcuts: nodes are
+// opened, biggest bound first, until what is left is either negligible
+// or small next to the light already found.  Lights at infinity are never
+// grouped or left out.
+class LightTree
+{
+public:
+	void build(const vector<LightRecord> &lights);
+
+	// Put in selected, in increasing order of light, the lights to look at
+	// to shade P, with normal N, on a surface whose diffuse and specular
+	// colours add up to no more than scale in any channel.  The lights left
+	// out add no more than cutoff to P between them, and each group is
+	// within error of the total.
+	void select(const vec3f &P, const vec3f &N, double scale, double cutoff, double error,
+				vector<LightChoice> &selected) const;
+
+private:
+	struct Node
+	{
+		BoundingBox box;
+		double power;	// the sum of the lights' brightest colour channels
+		double a, b, c; // the smallest of each attenuation coefficient
+		int light;		// a leaf's light, or -1 for an inner node
+		int rep;		// the brightest light under the node
+		int second;		// the second child of an inner node
+	};
+
+	// a node on the cut, with a bound on its light at the point and a
+	// guess at it from its representative
+	struct Cut
+	{
+		int node;
+		double bound, estimate;
+		bool operator<(const Cut &other) const { return bound < other.bound; }
+	};
+
+	int buildNode(int start, int end, vector<int> &index, const vector<Node> &leaves);
+	Cut cutAt(int node, const vec3f &P, const vec3f &N, double scale) const;
+
+	vector<Node> nodes;
+	vector<int> unbounded; // the lights at infinity
+	const LightRecord *lights;
+};
+
 class Scene
 {
 public:
-	typedef list<Light *>::iterator liter;
-	typedef list<Light *>::const_iterator cliter;
+	typedef vector<Light *>::iterator liter;
+	typedef vector<Light *>::const_iterator cliter;
 
-	typedef list<Geometry *>::iterator giter;
-	typedef list<Geometry *>::const_iterator cgiter;
+	typedef vector<Geometry *>::iterator giter;
+	typedef vector<Geometry *>::const_iterator cgiter;
 
 	TransformRoot transformRoot;
 
@@ -255,7 +714,7 @@ public:
 
 public:
 	Scene()
-		: transformRoot(), objects(), lights()
+		: transformRoot(), objects(), lights(), caustics(NULL), lightCutoff(LIGHT_CUTOFF), lightError(LIGHT_ERROR)
 	{
 		ambient_light = vec3f(0.0, 0.0, 0.0);
 	}
@@ -274,17 +733,66 @@ public:
 	bool intersect(const ray &r, isect &i) const;
 	void initScene();
 
-	list<Light *>::const_iterator beginLights() const { return lights.begin(); }
-	list<Light *>::const_iterator endLights() const { return lights.end(); }
+	// Bring the bounds of every object, the BVH and the scene bounds up to
+	// date after transform nodes have been changed.  The objects stay where
+	// they are in the BVH, so this is much cheaper than building it again.
+	void refit();
+
+	const BoundingBox &getBounds() const { return sceneBounds; }
+
+	// All rays traced by the calling thread are noted in rec until it is
+	// reset to NULL, and so are its lookups in the caustic photon map,
+	// which shading reports with noteGather.
+	static void setHitRecord(HitRecord *rec);
+	static void noteGather();
+
+	cliter beginLights() const { return lights.begin(); }
+	cliter endLights() const { return lights.end(); }
+	const Light *getLight(int k) const { return lights[k]; }
+	const LightRecord &getLightRecord(int k) const { return lightRecords[k]; }
+
+	// The lights to look at when shading P; see LightTree::select.  A
+	// cutoff and error of 0 keep every light that can make any difference
+	// as a light of its own.
+	void selectLights(const vec3f &P, const vec3f &N, double scale, vector<LightChoice> &selected) const
+	{
+		lightTree.select(P, N, scale, lightCutoff, lightError, selected);
+	}
+	void setLightCutoff(double cutoff, double error)
+	{
+		lightCutoff = cutoff;
+		lightError = error;
+	}
+
+	cgiter beginObjects() const { return objects.begin(); }
+	cgiter endObjects() const { return objects.end(); }
+
+	// The caustic photon map that shading gathers from, if one has been
+	// built.  The scene takes ownership of it.
+	void setCaustics(PhotonMap *map);
+	const PhotonMap *getCaustics() const { return caustics; }
 
 	Camera *getCamera() { return &camera; }
 
+	// Transform nodes given a name in the scene file, so that animations
+	// can refer to them.  Several nodes can share a name (the scene file
+	// has no groups, so a turntable with three objects on it is three
+	// nodes); findNodes returns them all, or NULL for an unknown name.
+	void nameNode(const string &name, TransformNode *node) { namedNodes[name].push_back(node); }
+	const vector<TransformNode *> *findNodes(const string &name) const;
+
 private:
-	list<Geometry *> objects;
-	list<Geometry *> nonboundedobjects;
-	list<Geometry *> boundedobjects;
-	list<Light *> lights;
+	vector<Geometry *> objects;
+	vector<Geometry *> nonboundedobjects;
+	vector<Geometry *> boundedobjects;
+	vector<Light *> lights;
+	vector<LightRecord> lightRecords; // compiled by initScene
 	Camera camera;
+	PhotonMap *caustics;
+	BVH bvh;
+	LightTree lightTree;
+	double lightCutoff, lightError;
+	map<string, vector<TransformNode *>> namedNodes;
 
 	// Each object in the scene, provided that it has hasBoundingBoxCapability(),
 	// must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
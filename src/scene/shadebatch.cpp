@@ -0,0 +1,269 @@
+#include <math.h>
+#include <algorithm>
+
+#include "shadebatch.h"
+#include "scene.h"
+#include "light.h"
+#include "material.h"
+#include "ray.h"
+
+int ShadeBatch::add(const ray &r, const isect &i)
+{
+	const Material &m = i.getMaterial();
+	vec3f p = r.at(i.t);
+	vec3f d = r.getDirection();
+
+	for (int c = 0; c < 3; ++c)
+	{
+		P[c].push_back(p[c]);
+		N[c].push_back(i.N[c]);
+		V[c].push_back(-d[c]);
+		kd[c].push_back(m.kd[c]);
+		ks[c].push_back(m.ks[c]);
+	}
+	exponent.push_back(m.shininess * 128);
+	time.push_back(r.getTime());
+	objects.push_back(i.obj);
+	return size() - 1;
+}
+
+void ShadeBatch::clear()
+{
+	for (int c = 0; c < 3; ++c)
+	{
+		P[c].clear();
+		N[c].clear();
+		V[c].clear();
+		kd[c].clear();
+		ks[c].clear();
+	}
+	exponent.clear();
+	time.clear();
+	objects.clear();
+}
+
+// The terms are the ones in Material::directLight, worked out in the same
+// order so that the sums come out the same to the last bit.
+void ShadeBatch::light(Scene *scene)
+{
+	int n = size();
+	for (int c = 0; c < 3; ++c)
+	{
+		I[c].assign(n, 0.0);
+		L[c].resize(n);
+		color[c].resize(n);
+		weight[c].resize(n);
+		shadow[c].resize(n);
+	}
+	distance.resize(n);
+	atten.resize(n);
+	diffuse.resize(n);
+	specular.resize(n);
+	share.assign(n, 0.0);
+
+	// Ask the scene which lights each point needs, and turn that round
+	// into the points each light is needed for, in order.
+	int lights = (int)(scene->endLights() - scene->beginLights());
+	vector<LightChoice> selected;
+	first.assign(lights + 1, 0);
+	for (int k = 0; k < n; ++k)
+	{
+		double scale = max(kd[0][k] + ks[0][k], max(kd[1][k] + ks[1][k], kd[2][k] + ks[2][k]));
+		vec3f normal(N[0][k], N[1][k], N[2][k]);
+		scene->selectLights(point(k), normal, scale, selected);
+		for (size_t j = 0; j < selected.size(); ++j)
+			++first[selected[j].light + 1];
+		picks.insert(picks.end(), selected.begin(), selected.end());
+		LightChoice end = {-1, 0.0};
+		picks.push_back(end);
+	}
+	for (int l = 0; l < lights; ++l)
+		first[l + 1] += first[l];
+	users.resize(first[lights]);
+	weights.resize(first[lights]);
+	vector<int> next(first.begin(), first.end() - 1);
+	for (int k = 0, j = 0; k < n; ++k, ++j)
+	{
+		for (; picks[j].light >= 0; ++j)
+		{
+			int u = next[picks[j].light]++;
+			users[u] = k;
+			weights[u] = picks[j].weight;
+		}
+	}
+	picks.clear();
+
+	for (int l = 0; l < lights; ++l)
+	{
+		if (first[l] == first[l + 1])
+			continue;
+
+		// from the first point that needs this light to the last
+		int begin = users[first[l]];
+		int end = users[first[l + 1] - 1] + 1;
+		for (int j = first[l]; j < first[l + 1]; ++j)
+			share[users[j]] = weights[j];
+
+		// the points in between that did not choose the light get no
+		// light from it
+		const LightRecord &light = scene->getLightRecord(l);
+		illuminate(light, begin, end);
+		for (int k = begin; k < end; ++k)
+			atten[k] = share[k] * atten[k];
+
+		// the cosines for the diffuse and specular terms
+		for (int k = begin; k < end; ++k)
+		{
+			double NdotL = N[0][k] * L[0][k] + N[1][k] * L[1][k] + N[2][k] * L[2][k];
+			double s = 2 * NdotL;
+			double R0 = s * N[0][k] - L[0][k];
+			double R1 = s * N[1][k] - L[1][k];
+			double R2 = s * N[2][k] - L[2][k];
+			double length = sqrt(R0 * R0 + R1 * R1 + R2 * R2);
+			R0 /= length;
+			R1 /= length;
+			R2 /= length;
+
+			diffuse[k] = max(0.0, NdotL);
+			specular[k] = max(0.0, R0 * V[0][k] + R1 * V[1][k] + R2 * V[2][k]);
+		}
+
+		// pow has no vector form, but most points face away from the
+		// highlight and need no call at all
+		for (int k = begin; k < end; ++k)
+		{
+			if (specular[k] != 0.0 || exponent[k] <= 0.0)
+				specular[k] = pow(specular[k], exponent[k]);
+		}
+
+		for (int c = 0; c < 3; ++c)
+		{
+			for (int k = begin; k < end; ++k)
+				weight[c][k] = kd[c][k] * diffuse[k] + ks[c][k] * specular[k];
+		}
+
+		// Shadow rays, one after the other from neighbouring points to the
+		// same light.  A point that the light would not brighten anyway
+		// does not need one.
+		for (int k = begin; k < end; ++k)
+		{
+			bool lit = atten[k] != 0.0 &&
+					   (weight[0][k] * color[0][k] != 0.0 ||
+						weight[1][k] * color[1][k] != 0.0 ||
+						weight[2][k] * color[2][k] != 0.0);
+			vec3f a;
+			if (lit)
+				a = shadowLight(light, origin(k), sample(k), time[k]);
+			shadow[0][k] = a[0];
+			shadow[1][k] = a[1];
+			shadow[2][k] = a[2];
+		}
+
+		for (int c = 0; c < 3; ++c)
+		{
+			for (int k = begin; k < end; ++k)
+				I[c][k] += atten[k] * shadow[c][k] * color[c][k] * weight[c][k];
+		}
+
+		for (int j = first[l]; j < first[l + 1]; ++j)
+			share[users[j]] = 0.0;
+	}
+}
+
+RayOrigin ShadeBatch::origin(int k) const
+{
+	return RayOrigin(point(k), vec3f(N[0][k], N[1][k], N[2][k]), objects[k]);
+}
+
+LightSample ShadeBatch::sample(int k) const
+{
+	LightSample s;
+	s.L = vec3f(L[0][k], L[1][k], L[2][k]);
+	s.distance = distance[k];
+	s.atten = atten[k];
+	s.color = vec3f(color[0][k], color[1][k], color[2][k]);
+	return s;
+}
+
+// The switch on the type of light is taken once for the whole run.  The comparisons are written out as
+// the lights write them, so that a NaN or a signed zero comes out the same.
+void ShadeBatch::illuminate(const LightRecord &rec, int begin, int end)
+{
+	switch (rec.type)
+	{
+	case LightRecord::DIRECTIONAL:
+		for (int k = begin; k < end; ++k)
+		{
+			L[0][k] = rec.position[0];
+			L[1][k] = rec.position[1];
+			L[2][k] = rec.position[2];
+			distance[k] = 0.0;
+			atten[k] = 1.0;
+		}
+		break;
+
+	case LightRecord::POINT:
+	case LightRecord::AREA:
+		for (int k = begin; k < end; ++k)
+		{
+			double v0 = rec.position[0] - P[0][k];
+			double v1 = rec.position[1] - P[1][k];
+			double v2 = rec.position[2] - P[2][k];
+			double d = sqrt(v0 * v0 + v1 * v1 + v2 * v2);
+			L[0][k] = v0 / d;
+			L[1][k] = v1 / d;
+			L[2][k] = v2 / d;
+			distance[k] = d;
+			double f = 1.0 / (rec.a + rec.b * d + rec.c * d * d);
+			atten[k] = 1.0 < f ? 1.0 : f;
+		}
+		break;
+
+	case LightRecord::SPOT:
+		for (int k = begin; k < end; ++k)
+		{
+			double v0 = P[0][k] - rec.position[0];
+			double v1 = P[1][k] - rec.position[1];
+			double v2 = P[2][k] - rec.position[2];
+			double d = sqrt(v0 * v0 + v1 * v1 + v2 * v2);
+			v0 /= d;
+			v1 /= d;
+			v2 /= d;
+			L[0][k] = -v0;
+			L[1][k] = -v1;
+			L[2][k] = -v2;
+			distance[k] = d;
+
+			double f = 1.0 / (rec.a + rec.b * d + rec.c * d * d);
+			double distance_atten = 1 < f ? 1 : f;
+			double coslambda = v0 * rec.orientation[0] + v1 * rec.orientation[1] + v2 * rec.orientation[2];
+			if (0 > coslambda)
+				coslambda = 0;
+			atten[k] = distance_atten * (coslambda < rec.cosCone ? 0.0 : pow(coslambda, rec.focus));
+		}
+		break;
+
+	default:
+		for (int k = begin; k < end; ++k)
+		{
+			LightSample s;
+			evaluateLight(rec, point(k), s);
+			L[0][k] = s.L[0];
+			L[1][k] = s.L[1];
+			L[2][k] = s.L[2];
+			distance[k] = s.distance;
+			atten[k] = s.atten;
+			color[0][k] = s.color[0];
+			color[1][k] = s.color[1];
+			color[2][k] = s.color[2];
+		}
+		return;
+	}
+
+	for (int k = begin; k < end; ++k)
+	{
+		color[0][k] = rec.color[0];
+		color[1][k] = rec.color[1];
+		color[2][k] = rec.color[2];
+	}
+}
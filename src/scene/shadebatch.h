@@ -0,0 +1,73 @@
+//
+// shadebatch.h
+//
+// Phong shading of many surface points at once.  The points of a batch
+// are lit a light at a time, so that each light's virtual functions are
+// called once per batch instead of once per point, and the arithmetic runs
+// in plain loops over arrays that the compiler can vectorise.
+//
+
+#ifndef __SHADEBATCH_H__
+#define __SHADEBATCH_H__
+
+#include <vector>
+
+#include "scene.h"
+
+using namespace std;
+
+class ray;
+class isect;
+
+class ShadeBatch
+{
+public:
+	// Add the point where r hits i, returning its index in the batch.
+	int add(const ray &r, const isect &i);
+	int size() const { return (int)time.size(); }
+	void clear();
+
+	// Work out the light that reaches every point of the batch straight
+	// from the scene's lights.  The result for each point is exactly what
+	// Material::directLight gives for it.
+	void light(Scene *scene);
+
+	// what light() found for point k
+	vec3f direct(int k) const { return vec3f(I[0][k], I[1][k], I[2][k]); }
+
+private:
+	vec3f point(int k) const { return vec3f(P[0][k], P[1][k], P[2][k]); }
+	RayOrigin origin(int k) const;
+	LightSample sample(int k) const;
+
+	// evaluateLight for points begin to end - 1, into the arrays below
+	void illuminate(const LightRecord &rec, int begin, int end);
+
+	// One array per component: the points, their normals, the directions
+	// back along the rays that found them, the diffuse and specular colours
+	// of their materials, the specular exponents and the rays' times, and
+	// the objects the points are on.
+	vector<double> P[3], N[3], V[3], kd[3], ks[3], exponent, time;
+	vector<const SceneObject *> objects;
+
+	// what the light being worked on gives each point
+	vector<double> L[3], distance, atten, color[3];
+
+	// the sum over the lights so far
+	vector<double> I[3];
+
+	// per light: the diffuse and specular factors, what each point would
+	// get without shadows, and the shadow attenuation
+	vector<double> diffuse, specular, weight[3], shadow[3];
+
+	// The points each light is needed for are users[first[l]] to
+	// users[first[l + 1] - 1], with its weights for them alongside, and
+	// share holds the weights of the light being worked on by point (0
+	// for points that do not need it).  picks is the scene's choice of
+	// lights for each point in turn, each list ended by a light of -1.
+	vector<int> first, users;
+	vector<double> weights, share;
+	vector<LightChoice> picks;
+};
+
+#endif // __SHADEBATCH_H__
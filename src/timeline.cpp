@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "timeline.h"
+#include "timing.h"
+
+using std::chrono::steady_clock;
+
+namespace
+{
+	struct Span
+	{
+		const char *name;
+		int tile;
+		int lane;
+		double begin, end; // microseconds after start()
+	};
+}
+
+static bool on = false;
+static steady_clock::time_point origin;
+
+// The spans of the threads that have ended, how many were lost when the
+// rings went round, and which lanes the living threads have.  All are made
+// on first use, so that they are still there when the last threads end.
+static std::mutex &endedLock()
+{
+	static std::mutex lock;
+	return lock;
+}
+
+static std::vector<Span> &ended()
+{
+	static std::vector<Span> spans;
+	return spans;
+}
+
+static long long &lost()
+{
+	static long long count = 0;
+	return count;
+}
+
+static std::vector<bool> &lanes()
+{
+	static std::vector<bool> taken;
+	return taken;
+}
+
+namespace
+{
+	// A thread's spans, oldest first until the ring is full and from
+	// count % CAPACITY after that.  A thread takes the lowest lane free
+	// when it starts recording and gives it up when it ends, so the pool
+	// of a later parallelFor fills the same lanes as the one before.
+	struct Ring
+	{
+		std::vector<Span> spans;
+		long long count;
+		int lane;
+
+		Ring()
+			: count(0)
+		{
+			std::lock_guard<std::mutex> hold(endedLock());
+			ended();
+			lost();
+			std::vector<bool> &taken = lanes();
+			lane = (int)(std::find(taken.begin(), taken.end(), false) - taken.begin());
+			if (lane == (int)taken.size())
+				taken.push_back(true);
+			else
+				taken[lane] = true;
+		}
+
+		~Ring()
+		{
+			std::lock_guard<std::mutex> hold(endedLock());
+			flush();
+			lanes()[lane] = false;
+		}
+
+		void add(const Span &span)
+		{
+			if (spans.size() < (size_t)Timeline::CAPACITY)
+				spans.push_back(span);
+			else
+				spans[count % Timeline::CAPACITY] = span;
+			++count;
+		}
+
+		// hand the spans in; the caller holds endedLock()
+		void flush()
+		{
+			size_t first = count > Timeline::CAPACITY ? (size_t)(count % Timeline::CAPACITY) : 0;
+			for (size_t k = 0; k < spans.size(); ++k)
+				ended().push_back(spans[(first + k) % spans.size()]);
+			lost() += count - (long long)spans.size();
+			spans.clear();
+			count = 0;
+		}
+	};
+
+	thread_local Ring ring;
+}
+
+static double microseconds(steady_clock::time_point t)
+{
+	return std::chrono::duration<double, std::micro>(t - origin).count();
+}
+
+void Timeline::start()
+{
+	// the caller takes its lane now, before any workers, to be first
+	ring.spans.clear();
+	ring.count = 0;
+
+	std::lock_guard<std::mutex> hold(endedLock());
+	ended().clear();
+	lost() = 0;
+	origin = steady_clock::now();
+	on = true;
+}
+
+bool Timeline::recording()
+{
+	return on;
+}
+
+void Timeline::record(const char *name, const Stopwatch &watch, int tile)
+{
+	if (!on)
+		return;
+
+	Span span;
+	span.name = name;
+	span.tile = tile;
+	span.lane = ring.lane;
+	span.end = microseconds(steady_clock::now());
+	span.begin = microseconds(watch.started());
+	ring.add(span);
+}
+
+static bool earlier(const Span &a, const Span &b)
+{
+	return a.begin < b.begin;
+}
+
+bool Timeline::write(const char *file)
+{
+	std::lock_guard<std::mutex> hold(endedLock());
+	ring.flush();
+	on = false;
+
+	std::vector<Span> &spans = ended();
+	std::stable_sort(spans.begin(), spans.end(), earlier);
+	if (lost() > 0)
+		fprintf(stderr, "timeline: the oldest %lld spans did not fit and are left out\n", lost());
+
+	FILE *f = fopen(file, "w");
+	if (!f)
+		return false;
+
+	int count = 0;
+	for (size_t k = 0; k < spans.size(); ++k)
+		count = std::max(count, spans[k].lane + 1);
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	const char *comma = "";
+	for (int lane = 0; lane < count; ++lane)
+	{
+		fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, ", comma, lane);
+		if (lane == ring.lane)
+			fprintf(f, "\"args\": {\"name\": \"main\"}}");
+		else
+			fprintf(f, "\"args\": {\"name\": \"thread %d\"}}", lane);
+		comma = ",\n";
+	}
+	for (size_t k = 0; k < spans.size(); ++k)
+	{
+		const Span &s = spans[k];
+		fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+				comma, s.name, s.lane, s.begin, s.end - s.begin);
+		if (s.tile >= 0)
+			fprintf(f, ", \"args\": {\"tile\": %d}", s.tile);
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n]}\n");
+
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
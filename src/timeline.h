@@ -0,0 +1,39 @@
+//
+// timeline.h
+//
+// A record of when each thread was doing what, written out in the Chrome
+// trace event format for chrome://tracing or Perfetto to draw.  Every
+// stage PhaseTimes times goes on it, and so does every tile, on the lane
+// of the thread that traced it; uneven tiles, threads left waiting and
+// stages that run on one thread stand out at a glance.
+//
+// Nothing is recorded until start() is called.  Each thread then keeps
+// its spans in a ring of its own without any locking, so a very long run
+// keeps only the latest of them, and hands them in when it ends.
+//
+
+#ifndef __TIMELINE_H__
+#define __TIMELINE_H__
+
+class Stopwatch;
+
+class Timeline
+{
+public:
+	// the spans each thread keeps before it starts to lose the oldest
+	static const int CAPACITY = 1 << 16;
+
+	// Forget what was recorded and start again, with the clock at 0.
+	static void start();
+	static bool recording();
+
+	// The span from when watch started until now, called name; tile is
+	// shown with it unless it is -1.  name must last the whole run.
+	static void record(const char *name, const Stopwatch &watch, int tile = -1);
+
+	// Write the spans of the threads that have ended and the caller's own
+	// to file, and stop recording; returns false if it cannot be written.
+	static bool write(const char *file);
+};
+
+#endif // __TIMELINE_H__
@@ -0,0 +1,76 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <chrono>
+
+#include "timeline.h"
+
+// Wall-clock time since the stopwatch was made, on a clock that is never
+// set back.  clock() is no good for timing a render: it adds up the
+// processor time of all its threads.
+class Stopwatch
+{
+public:
+	Stopwatch()
+		: start(std::chrono::steady_clock::now()) {}
+
+	double seconds() const
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::chrono::steady_clock::time_point started() const { return start; }
+
+private:
+	std::chrono::steady_clock::time_point start;
+};
+
+// The wall-clock seconds spent in each stage of making an image: reading
+// the scene file, building the BVH and lights (or refitting them for a new
+// frame), shooting photons, tracing, denoising and writing the image out.
+struct PhaseTimes
+{
+	enum Phase
+	{
+		PARSE,
+		BUILD,
+		PHOTONS,
+		RENDER,
+		DENOISE,
+		OUTPUT,
+		PHASES
+	};
+
+	double seconds[PHASES];
+
+	PhaseTimes() { clear(); }
+
+	void clear()
+	{
+		for (int p = 0; p < PHASES; ++p)
+			seconds[p] = 0.0;
+	}
+
+	// also puts the stage on the timeline, if one is being recorded
+	void add(Phase p, const Stopwatch &watch)
+	{
+		seconds[p] += watch.seconds();
+		Timeline::record(name(p), watch);
+	}
+
+	double total() const
+	{
+		double sum = 0.0;
+		for (int p = 0; p < PHASES; ++p)
+			sum += seconds[p];
+		return sum;
+	}
+
+	static const char *name(int p)
+	{
+		static const char *names[PHASES] = {"parse", "build", "photons", "render", "denoise", "output"};
+		return names[p];
+	}
+};
+
+#endif // __TIMING_H__
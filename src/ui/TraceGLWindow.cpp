@@ -2,6 +2,8 @@
 // A subclass of FL_GL_Window that handles drawing the traced image to the screen
 // 
 
+#include <float.h>
+
 #include "TraceGLWindow.h"
 #include "../RayTracer.h"
 
@@ -12,14 +14,120 @@ TraceGLWindow::TraceGLWindow(int x, int y, int w, int h, const char *l)
 {
 	m_nWindowWidth = w;
 	m_nWindowHeight = h;
+
+	raytracer = NULL;
+	m_bNavigate = false;
+	m_nLastX = m_nLastY = 0;
+	m_dPivotDistance = 1.0;
 }
 
 int TraceGLWindow::handle(int event)
 {
-	// disable all mouse and keyboard events
+	// disable all mouse and keyboard events, unless we are navigating
+	if (!m_bNavigate || !raytracer || !raytracer->sceneLoaded())
+		return 1;
+
+	switch (event)
+	{
+	case FL_PUSH:
+	{
+		m_nLastX = Fl::event_x();
+		m_nLastY = Fl::event_y();
+
+		// orbit around whatever is in the middle of the view, if anything
+		unsigned char *buf;
+		int w, h;
+		raytracer->getBuffer(buf, w, h);
+		float depth = raytracer->pixelDepth(w / 2, h / 2);
+		if (depth != FLT_MAX)
+			m_dPivotDistance = depth;
+		return 1;
+	}
+
+	case FL_DRAG:
+	{
+		int dx = Fl::event_x() - m_nLastX;
+		int dy = Fl::event_y() - m_nLastY;
+		m_nLastX = Fl::event_x();
+		m_nLastY = Fl::event_y();
+
+		if (dx == 0 && dy == 0)
+			return 1;
+
+		Camera old = *raytracer->getCamera();
+		if (Fl::event_button() == FL_MIDDLE_MOUSE ||
+			(Fl::event_button() == FL_LEFT_MOUSE && Fl::event_shift()))
+			pan(dx, dy);
+		else if (Fl::event_button() == FL_RIGHT_MOUSE)
+			dolly(-dy * 0.01);
+		else
+			orbit(dx, dy);
+
+		raytracer->cameraMoved(old);
+		redraw();
+		do_callback();
+		return 1;
+	}
+
+	case FL_MOUSEWHEEL:
+	{
+		Camera old = *raytracer->getCamera();
+		dolly(-Fl::event_dy() * 0.1);
+
+		raytracer->cameraMoved(old);
+		redraw();
+		do_callback();
+		return 1;
+	}
+	}
+
 	return 1;
 }
 
+// Rotate the camera about the pivot: horizontal motion turns it about its
+// up direction, vertical motion about its right direction.
+void TraceGLWindow::orbit(int dx, int dy)
+{
+	Camera *cam = raytracer->getCamera();
+
+	vec3f look = cam->getLook();
+	vec3f up = cam->getV().normalize();
+	vec3f right = cam->getU().normalize();
+	vec3f pivot = cam->getEye() + look * m_dPivotDistance;
+
+	const double radiansPerPixel = 0.01;
+	mat4f rot = mat4f::rotate(right, -dy * radiansPerPixel) *
+				mat4f::rotate(up, -dx * radiansPerPixel);
+	mat3f r = rot.upper33();
+
+	cam->setEye(pivot + r * (cam->getEye() - pivot));
+	cam->setLook((r * look).normalize(), (r * up).normalize());
+}
+
+// Slide the camera parallel to the image plane so that the pivot follows
+// the mouse.
+void TraceGLWindow::pan(int dx, int dy)
+{
+	Camera *cam = raytracer->getCamera();
+
+	// u and v span the image plane at unit distance from the eye
+	vec3f move = cam->getU() * (double(-dx) / w()) + cam->getV() * (double(dy) / h());
+	cam->setEye(cam->getEye() + move * m_dPivotDistance);
+}
+
+// Move the camera towards the pivot by the given fraction of the distance
+void TraceGLWindow::dolly(double amount)
+{
+	Camera *cam = raytracer->getCamera();
+
+	if (amount > 0.9)
+		amount = 0.9;
+
+	double step = m_dPivotDistance * amount;
+	cam->setEye(cam->getEye() + cam->getLook() * step);
+	m_dPivotDistance -= step;
+}
+
 void TraceGLWindow::draw()
 {
 	if(!valid())
@@ -76,4 +184,9 @@ void TraceGLWindow::saveImage(char *iname)
 void TraceGLWindow::setRayTracer(RayTracer *tracer)
 {
 	raytracer = tracer;
+}
+
+void TraceGLWindow::setNavigate(bool navigate)
+{
+	m_bNavigate = navigate;
 }
\ No newline at end of file
@@ -33,9 +33,24 @@ public:
 
 	void setRayTracer(RayTracer *tracer);
 
+	// When navigation is on, dragging with the left mouse button orbits the
+	// camera around the point at the centre of the view, the middle button
+	// (or shift + left) pans, and the right button or the wheel dollies.
+	// Each move updates the scene's camera, reprojects the current image and
+	// then fires the window's callback so that the render can be restarted.
+	void setNavigate(bool navigate);
+
 private:
+	void orbit(int dx, int dy);
+	void pan(int dx, int dy);
+	void dolly(double amount);
+
 	int m_nWindowWidth, m_nWindowHeight;
 	int m_nDrawWidth, m_nDrawHeight;
+
+	bool m_bNavigate;
+	int m_nLastX, m_nLastY;
+	double m_dPivotDistance;	// distance from the eye to the orbit centre
 };
 
 #endif // __TRACE_GL_WINDOW_H__
\ No newline at end of file
@@ -13,6 +13,11 @@
 #include "../RayTracer.h"
 
 static bool done;
+static bool restart;	// stop the current render and start it over
+static bool rendering;
+
+// photons shot when the Caustics box is ticked
+static const int CAUSTIC_PHOTONS = 200000;
 
 //------------------------------------- Help Functions --------------------------------------------
 TraceUI *TraceUI::whoami(Fl_Menu_ *o) // from menu item back to UI itself
@@ -103,88 +108,208 @@ void TraceUI::cb_threshSlides(Fl_Widget *o, void *v)
 	((TraceUI *)(o->user_data()))->m_nThresh = double(((Fl_Slider *)o)->value());
 }
 
+void TraceUI::cb_samplesSlides(Fl_Widget *o, void *v)
+{
+	((TraceUI *)(o->user_data()))->m_nSamples = int(((Fl_Slider *)o)->value());
+}
+
+void TraceUI::cb_progressive(Fl_Widget *o, void *v)
+{
+	((TraceUI *)(o->user_data()))->m_bProgressive = (((Fl_Check_Button *)o)->value() != 0);
+}
+
+void TraceUI::cb_navigate(Fl_Widget *o, void *v)
+{
+	TraceUI *pUI = (TraceUI *)(o->user_data());
+
+	pUI->m_bNavigate = (((Fl_Check_Button *)o)->value() != 0);
+	pUI->m_traceGlWindow->setNavigate(pUI->m_bNavigate);
+}
+
+void TraceUI::cb_denoise(Fl_Widget *o, void *v)
+{
+	((TraceUI *)(o->user_data()))->m_bDenoise = (((Fl_Check_Button *)o)->value() != 0);
+}
+
+void TraceUI::cb_pathTrace(Fl_Widget *o, void *v)
+{
+	((TraceUI *)(o->user_data()))->m_bPathTrace = (((Fl_Check_Button *)o)->value() != 0);
+}
+
+void TraceUI::cb_caustics(Fl_Widget *o, void *v)
+{
+	((TraceUI *)(o->user_data()))->m_bCaustics = (((Fl_Check_Button *)o)->value() != 0);
+}
+
 void TraceUI::cb_render(Fl_Widget *o, void *v)
 {
-	char buffer[256];
+	((TraceUI *)(o->user_data()))->render(false);
+}
+
+// The camera was moved in the image window: abandon the current render and
+// start again from the reprojected image.
+void TraceUI::cb_viewChanged(Fl_Widget *o, void *v)
+{
+	TraceUI *pUI = (TraceUI *)(o->user_data());
+
+	if (rendering)
+	{
+		done = true;
+		restart = true;
+	}
+	else
+	{
+		pUI->render(true);
+	}
+}
 
-	TraceUI *pUI = ((TraceUI *)(o->user_data()));
+void TraceUI::render(bool keepImage)
+{
+	char buffer[256];
 
-	if (pUI->raytracer->sceneLoaded())
+	if (raytracer->sceneLoaded())
 	{
-		int width = pUI->getSize();
-		int height = (int)(width / pUI->raytracer->aspectRatio() + 0.5);
-		pUI->m_traceGlWindow->resizeWindow(width, height);
+		int width = getSize();
+		int height = (int)(width / raytracer->aspectRatio() + 0.5);
+		m_traceGlWindow->resizeWindow(width, height);
+
+		m_traceGlWindow->show();
+
+		unsigned char *buf;
+		int bufWidth, bufHeight;
+		raytracer->getBuffer(buf, bufWidth, bufHeight);
+		if (!keepImage || !buf || bufWidth != width || bufHeight != height)
+			raytracer->traceSetup(width, height);
 
-		pUI->m_traceGlWindow->show();
+		raytracer->setDepth(m_nDepth);
+		raytracer->setThreshold(m_nThresh);
+		raytracer->setSampler(DEFAULT_SAMPLER, m_nSamples);
+		raytracer->setPathTracing(m_bPathTrace);
 
-		pUI->raytracer->traceSetup(width, height);
+		// the photon map only depends on the scene, so it is kept across
+		// renders (and camera moves) until the box is unticked
+		if (m_bCaustics != raytracer->hasCaustics())
+			raytracer->buildCaustics(m_bCaustics ? CAUSTIC_PHOTONS : 0);
 
 		// Save the window label
-		const char *old_label = pUI->m_traceGlWindow->label();
+		const char *old_label = m_traceGlWindow->label();
 
 		// start to render here
-		done = false;
+		rendering = true;
 		clock_t prev, now;
 		prev = clock();
 
-		pUI->m_traceGlWindow->refresh();
+		m_traceGlWindow->refresh();
 		Fl::check();
 		Fl::flush();
 
-		for (int y = 0; y < height; y++)
+		// events are checked more often while the camera is being moved
+		double interval = m_bNavigate ? 0.05 : 0.5;
+
+		bool complete;
+		do
 		{
-			for (int x = 0; x < width; x++)
+			done = false;
+			restart = false;
+			complete = false;
+
+			// In progressive mode the image is first traced at one pixel per
+			// PREVIEW_BLOCK x PREVIEW_BLOCK block, and then refined by halving
+			// the block size until every pixel has been traced.  A render that
+			// follows a camera move always starts coarse.
+			int first = (m_bProgressive || keepImage) ? PREVIEW_BLOCK : 1;
+			for (int step = first; step >= 1; step /= 2)
 			{
-				if (done)
-					break;
+				for (int y = 0; y < height; y += step)
+				{
+					for (int x = 0; x < width; x += step)
+					{
+						if (done)
+							break;
 
-				// current time
-				now = clock();
+						// current time
+						now = clock();
 
-				// check event every 1/2 second
-				if (((double)(now - prev) / CLOCKS_PER_SEC) > 0.5)
-				{
-					prev = now;
+						// check event every interval seconds
+						if (((double)(now - prev) / CLOCKS_PER_SEC) > interval)
+						{
+							prev = now;
+
+							if (Fl::ready())
+							{
+								// refresh
+								m_traceGlWindow->refresh();
+								// check event
+								Fl::check();
+
+								if (Fl::damage())
+								{
+									Fl::flush();
+								}
+							}
+						}
+
+						raytracer->traceBlock(x, y, step);
+					}
+					if (done)
+						break;
 
+					// flush when finish a row
 					if (Fl::ready())
 					{
 						// refresh
-						pUI->m_traceGlWindow->refresh();
-						// check event
-						Fl::check();
+						m_traceGlWindow->refresh();
 
 						if (Fl::damage())
 						{
 							Fl::flush();
 						}
 					}
+					// update the window label
+					if (step > 1)
+						sprintf(buffer, "(1/%d %d%%) %s", step, (int)((double)y / (double)height * 100.0), old_label);
+					else
+						sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
+					m_traceGlWindow->label(buffer);
 				}
+				if (done)
+					break;
 
-				pUI->raytracer->tracePixel(x, y);
+				// show each finished level before refining it
+				m_traceGlWindow->refresh();
+				Fl::check();
+				Fl::flush();
 			}
-			if (done)
-				break;
 
-			// flush when finish a row
-			if (Fl::ready())
+			complete = !done;
+
+			// A path traced image keeps getting more samples, one pass over
+			// all of its pixels at a time, until it is stopped.
+			for (int pass = 2; complete && m_bPathTrace && !done; ++pass)
 			{
-				// refresh
-				pUI->m_traceGlWindow->refresh();
+				raytracer->tracePass();
 
-				if (Fl::damage())
-				{
-					Fl::flush();
-				}
+				sprintf(buffer, "(pass %d) %s", pass, old_label);
+				m_traceGlWindow->label(buffer);
+				m_traceGlWindow->refresh();
+				Fl::check();
+				Fl::flush();
 			}
-			// update the window label
-			sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
-			pUI->m_traceGlWindow->label(buffer);
-		}
+
+			// a restart keeps the image that the camera move reprojected
+			keepImage = true;
+		} while (restart);
+
+		// only a finished image is worth denoising
+		if (m_bDenoise && complete)
+			raytracer->denoise();
+
+		rendering = false;
 		done = true;
-		pUI->m_traceGlWindow->refresh();
+		m_traceGlWindow->refresh();
 
 		// Restore the window label
-		pUI->m_traceGlWindow->label(old_label);
+		m_traceGlWindow->label(old_label);
 	}
 }
 
@@ -239,7 +364,13 @@ TraceUI::TraceUI()
 	// init.
 	m_nDepth = 0;
 	m_nSize = 150;
-	m_mainWindow = new Fl_Window(100, 40, 320, 100, "Ray <Not Loaded>");
+	m_nSamples = 1;
+	m_bProgressive = false;
+	m_bNavigate = false;
+	m_bDenoise = false;
+	m_bPathTrace = false;
+	m_bCaustics = false;
+	m_mainWindow = new Fl_Window(100, 40, 320, 194, "Ray <Not Loaded>");
 	m_mainWindow->user_data((void *)(this)); // record self to be used by static callback functions
 	// install menu bar
 	m_menubar = new Fl_Menu_Bar(0, 0, 320, 25);
@@ -285,6 +416,19 @@ TraceUI::TraceUI()
 	m_threshSlider->align(FL_ALIGN_RIGHT);
 	m_threshSlider->callback(cb_threshSlides);
 
+	// install slider samples per pixel
+	m_samplesSlider = new Fl_Value_Slider(10, 105, 180, 20, "Samples");
+	m_samplesSlider->user_data((void *)(this)); // record self to be used by static callback functions
+	m_samplesSlider->type(FL_HOR_NICE_SLIDER);
+	m_samplesSlider->labelfont(FL_COURIER);
+	m_samplesSlider->labelsize(12);
+	m_samplesSlider->minimum(1);
+	m_samplesSlider->maximum(64);
+	m_samplesSlider->step(1);
+	m_samplesSlider->value(m_nSamples);
+	m_samplesSlider->align(FL_ALIGN_RIGHT);
+	m_samplesSlider->callback(cb_samplesSlides);
+
 	m_renderButton = new Fl_Button(240, 27, 70, 25, "&Render");
 	m_renderButton->user_data((void *)(this));
 	m_renderButton->callback(cb_render);
@@ -293,6 +437,46 @@ TraceUI::TraceUI()
 	m_stopButton->user_data((void *)(this));
 	m_stopButton->callback(cb_stop);
 
+	// install progressive preview checkbox
+	m_progressiveButton = new Fl_Check_Button(10, 127, 180, 20, "Progressive Preview");
+	m_progressiveButton->user_data((void *)(this));
+	m_progressiveButton->labelfont(FL_COURIER);
+	m_progressiveButton->labelsize(12);
+	m_progressiveButton->value(m_bProgressive);
+	m_progressiveButton->callback(cb_progressive);
+
+	// install camera navigation checkbox
+	m_navigateButton = new Fl_Check_Button(200, 127, 110, 20, "Navigate");
+	m_navigateButton->user_data((void *)(this));
+	m_navigateButton->labelfont(FL_COURIER);
+	m_navigateButton->labelsize(12);
+	m_navigateButton->value(m_bNavigate);
+	m_navigateButton->callback(cb_navigate);
+
+	// install denoise checkbox
+	m_denoiseButton = new Fl_Check_Button(10, 149, 180, 20, "Denoise");
+	m_denoiseButton->user_data((void *)(this));
+	m_denoiseButton->labelfont(FL_COURIER);
+	m_denoiseButton->labelsize(12);
+	m_denoiseButton->value(m_bDenoise);
+	m_denoiseButton->callback(cb_denoise);
+
+	// install path tracing checkbox
+	m_pathTraceButton = new Fl_Check_Button(200, 149, 110, 20, "Path Trace");
+	m_pathTraceButton->user_data((void *)(this));
+	m_pathTraceButton->labelfont(FL_COURIER);
+	m_pathTraceButton->labelsize(12);
+	m_pathTraceButton->value(m_bPathTrace);
+	m_pathTraceButton->callback(cb_pathTrace);
+
+	// install caustics checkbox
+	m_causticsButton = new Fl_Check_Button(10, 171, 180, 20, "Caustics");
+	m_causticsButton->user_data((void *)(this));
+	m_causticsButton->labelfont(FL_COURIER);
+	m_causticsButton->labelsize(12);
+	m_causticsButton->value(m_bCaustics);
+	m_causticsButton->callback(cb_caustics);
+
 	m_mainWindow->callback(cb_exit2);
 	m_mainWindow->when(FL_HIDE);
 	m_mainWindow->end();
@@ -301,4 +485,6 @@ TraceUI::TraceUI()
 	m_traceGlWindow = new TraceGLWindow(100, 150, m_nSize, m_nSize, "Rendered Image");
 	m_traceGlWindow->end();
 	m_traceGlWindow->resizable(m_traceGlWindow);
+	m_traceGlWindow->user_data((void *)(this));
+	m_traceGlWindow->callback(cb_viewChanged);
 }
\ No newline at end of file
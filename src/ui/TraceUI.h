@@ -31,9 +31,15 @@ public:
 	Fl_Slider *m_depthSlider;
 	// add
 	Fl_Slider *m_threshSlider;
+	Fl_Slider *m_samplesSlider;
 
 	Fl_Button *m_renderButton;
 	Fl_Button *m_stopButton;
+	Fl_Check_Button *m_progressiveButton;
+	Fl_Check_Button *m_navigateButton;
+	Fl_Check_Button *m_denoiseButton;
+	Fl_Check_Button *m_pathTraceButton;
+	Fl_Check_Button *m_causticsButton;
 
 	TraceGLWindow *m_traceGlWindow;
 
@@ -55,6 +61,14 @@ private:
 	int m_nDepth;
 	// add
 	double m_nThresh = 0;
+	int m_nSamples;
+	bool m_bProgressive;
+	bool m_bNavigate;
+	bool m_bDenoise;
+	bool m_bPathTrace;
+	bool m_bCaustics;
+
+	void render(bool keepImage);
 
 	// static class members
 	static Fl_Menu_Item menuitems[];
@@ -72,6 +86,13 @@ private:
 	static void cb_depthSlides(Fl_Widget *o, void *v);
 	// add
 	static void cb_threshSlides(Fl_Widget *o, void *v);
+	static void cb_samplesSlides(Fl_Widget *o, void *v);
+	static void cb_progressive(Fl_Widget *o, void *v);
+	static void cb_navigate(Fl_Widget *o, void *v);
+	static void cb_denoise(Fl_Widget *o, void *v);
+	static void cb_pathTrace(Fl_Widget *o, void *v);
+	static void cb_caustics(Fl_Widget *o, void *v);
+	static void cb_viewChanged(Fl_Widget *o, void *v);
 
 	static void cb_render(Fl_Widget *o, void *v);
 	static void cb_stop(Fl_Widget *o, void *v);